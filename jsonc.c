@@ -1,8 +1,49 @@
+// fseeko()/ftello() с 64-битным off_t и на 32-битных системах.
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
+// В MSVC нет pthread.h и stdatomic.h: без явного JSONC_WITH_THREADS
+// (например, с pthreads-win32) библиотека собирается без потоков.
+#if defined(_MSC_VER) && !defined(JSONC_WITH_THREADS) && !defined(JSONC_NO_THREADS)
+#define JSONC_NO_THREADS
+#endif
+
 #include "jsonc.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#ifdef JSONC_STATS_TIMING
+#include <time.h>
+#endif
+#ifdef JSONC_WITH_ZLIB
+#include <limits.h>
+#include <zlib.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifndef JSONC_NO_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
 
 /*!
  * \brief Признак окончания строки.
@@ -21,6 +62,284 @@ static const size_t TRUE_STR_LEN = 4;
 
 static const size_t INIT_LEN = SIZE_MAX;
 
+// Allocator
+
+static void *defaultAlloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *defaultRealloc(void *ctx, void *ptr, size_t oldSize, size_t newSize) {
+    (void)ctx;
+    (void)oldSize;
+    return realloc(ptr, newSize);
+}
+
+static void defaultFree(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+/*!
+ * \brief Аллокатор по умолчанию (malloc/realloc/free).
+ */
+static const JsonAllocator DEFAULT_ALLOCATOR = {
+    defaultAlloc, defaultRealloc, defaultFree, NULL
+};
+
+/*!
+ * \brief Глобальный аллокатор, задается jsonSetAllocator().
+ */
+static JsonAllocator globalAllocator = {
+    defaultAlloc, defaultRealloc, defaultFree, NULL
+};
+
+#if defined(_MSC_VER)
+#define JSONC_THREAD_LOCAL __declspec(thread)
+#else
+#define JSONC_THREAD_LOCAL _Thread_local
+#endif
+
+/*!
+ * \brief Аллокатор потока, задается jsonSetThreadAllocator().
+ */
+static JSONC_THREAD_LOCAL const JsonAllocator *threadAllocator = NULL;
+
+void jsonSetAllocator(const JsonAllocator *allocator) {
+    globalAllocator = allocator ? *allocator : DEFAULT_ALLOCATOR;
+}
+
+void jsonSetThreadAllocator(const JsonAllocator *allocator) {
+    threadAllocator = allocator;
+}
+
+const JsonAllocator *jsonCurrentAllocator(void) {
+    return threadAllocator ? threadAllocator : &globalAllocator;
+}
+
+static inline void *jsonAlloc(const JsonAllocator *a, size_t size) {
+    return a->alloc(a->ctx, size);
+}
+
+static inline void *jsonRealloc(const JsonAllocator *a, void *ptr, size_t oldSize, size_t newSize) {
+    return a->realloc(a->ctx, ptr, oldSize, newSize);
+}
+
+static inline void jsonFree(const JsonAllocator *a, void *ptr, size_t size) {
+    if (ptr) {
+        a->free(a->ctx, ptr, size);
+    }
+}
+
+// Intern
+
+/// Размер блока памяти под строки таблицы интернирования.
+#define INTERN_BLOCK_SIZE 16384
+
+/*!
+ * \brief Блок памяти под строки таблицы.
+ */
+typedef struct InternBlockTypeDef {
+    struct InternBlockTypeDef *next;
+    size_t size;
+    char data[];
+} InternBlock;
+
+/*!
+ * \brief Ячейка хеш-таблицы, str == NULL - пустая.
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+    uint64_t hash;
+} InternSlot;
+
+struct JsonInternTableTypeDef {
+    /// Копия аллокатора, действовавшего при создании.
+    JsonAllocator allocator;
+    /// Строки-значения не длиннее интернируются, ключи - всегда.
+    size_t strMaxLen;
+    /// Открытая адресация, capacity - степень двойки.
+    InternSlot *slots;
+    size_t capacity;
+    size_t count;
+    /// Текущий блок, остальные - по next.
+    InternBlock *block;
+    /// Занято в текущем блоке.
+    size_t used;
+};
+
+/*!
+ * \brief Таблица интернирования потока, задается jsonSetThreadInternTable().
+ */
+static JSONC_THREAD_LOCAL JsonInternTable *threadInternTable = NULL;
+
+/*!
+ * \brief Перемешивает биты (финализатор splitmix64).
+ */
+static uint64_t hashMix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9u;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebu;
+    h ^= h >> 31;
+    return h;
+}
+
+/*!
+ * \brief 64-битный хеш строки.
+ *
+ * Строка читается словами по 8 байт (без требований к выравниванию),
+ * поэтому значение зависит от порядка байт платформы.
+ */
+static uint64_t hashBytes(const char *data, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15u ^ (uint64_t)len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xff51afd7ed558ccdu;
+        h ^= h >> 32;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        h = (h ^ word) * 0xff51afd7ed558ccdu;
+    }
+    return hashMix(h);
+}
+
+JsonInternTable *createJsonInternTable(size_t strMaxLen) {
+    const JsonAllocator *a = jsonCurrentAllocator();
+    JsonInternTable *table = jsonAlloc(a, sizeof(JsonInternTable));
+    if (!table) {
+        return NULL;
+    }
+    table->allocator = *a;
+    table->strMaxLen = strMaxLen;
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->block = NULL;
+    table->used = 0;
+    return table;
+}
+
+void freeJsonInternTable(JsonInternTable *table) {
+    if (!table) {
+        return;
+    }
+    const JsonAllocator a = table->allocator;
+    if (threadInternTable == table) {
+        threadInternTable = NULL;
+    }
+    for (InternBlock *b = table->block; b;) {
+        InternBlock *next = b->next;
+        jsonFree(&a, b, sizeof(InternBlock) + b->size);
+        b = next;
+    }
+    jsonFree(&a, table->slots, table->capacity * sizeof(InternSlot));
+    jsonFree(&a, table, sizeof(JsonInternTable));
+}
+
+void jsonSetThreadInternTable(JsonInternTable *table) {
+    threadInternTable = table;
+}
+
+size_t jsonInternCount(const JsonInternTable *table) {
+    return table ? table->count : 0;
+}
+
+/*!
+ * \brief Выделяет size байт под строку из блоков таблицы.
+ */
+static char *internStore(JsonInternTable *t, size_t size) {
+    if (!t->block || t->block->size - t->used < size) {
+        // Длинные строки получают свой блок, текущий продолжает заполняться.
+        const bool large = size > INTERN_BLOCK_SIZE / 4;
+        const size_t blockSize = large ? size : INTERN_BLOCK_SIZE;
+        InternBlock *b = jsonAlloc(&t->allocator, sizeof(InternBlock) + blockSize);
+        if (!b) {
+            return NULL;
+        }
+        b->size = blockSize;
+        if (large && t->block) {
+            b->next = t->block->next;
+            t->block->next = b;
+            return b->data;
+        }
+        b->next = t->block;
+        t->block = b;
+        t->used = 0;
+    }
+    char *r = t->block->data + t->used;
+    t->used += size;
+    return r;
+}
+
+/*!
+ * \brief Увеличивает хеш-таблицу вдвое.
+ */
+static bool internGrow(JsonInternTable *t) {
+    const size_t capacity = t->capacity ? t->capacity * 2 : 64;
+    InternSlot *slots = jsonAlloc(&t->allocator, capacity * sizeof(InternSlot));
+    if (!slots) {
+        return false;
+    }
+    memset(slots, 0, capacity * sizeof(InternSlot));
+    for (size_t i = 0; i < t->capacity; ++i) {
+        const InternSlot *slot = t->slots + i;
+        if (!slot->str) {
+            continue;
+        }
+        size_t j = (size_t)slot->hash & (capacity - 1);
+        while (slots[j].str) {
+            j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = *slot;
+    }
+    jsonFree(&t->allocator, t->slots, t->capacity * sizeof(InternSlot));
+    t->slots = slots;
+    t->capacity = capacity;
+    return true;
+}
+
+const char *jsonIntern(JsonInternTable *table, const char *str, size_t len) {
+    if (!table || !str) {
+        return NULL;
+    }
+    if ((table->count + 1) * 4 > table->capacity * 3 && !internGrow(table)) {
+        return NULL;
+    }
+    const uint64_t hash = hashBytes(str, len);
+    size_t i = (size_t)hash & (table->capacity - 1);
+    for (; table->slots[i].str; i = (i + 1) & (table->capacity - 1)) {
+        const InternSlot *slot = table->slots + i;
+        if (slot->hash == hash && slot->len == len
+                && memcmp(slot->str, str, len) == 0) {
+            return slot->str;
+        }
+    }
+    if (len > SIZE_MAX - 3) {
+        return NULL;
+    }
+    // Строка хранится в кавычках, как в тексте: itemSpan() берет str - 1.
+    char *copy = internStore(table, len + 3);
+    if (!copy) {
+        return NULL;
+    }
+    copy[0] = '"';
+    memcpy(copy + 1, str, len);
+    copy[len + 1] = '"';
+    copy[len + 2] = END_STR;
+    table->slots[i].str = copy + 1;
+    table->slots[i].len = len;
+    table->slots[i].hash = hash;
+    ++table->count;
+    return copy + 1;
+}
+
 /*!
  * \brief Инициализирует JsonItem.
  * \param r - выходная структура.
@@ -30,6 +349,7 @@ static void initJsonItem(JsonItem *r) {
     r->key = NULL;
     r->keyLen = INIT_LEN;
     r->type = JsonTypeCount;
+    r->_flags = 0;
     r->number = 1E+37;
     r->str = NULL;
     r->strLen = INIT_LEN;
@@ -38,6 +358,187 @@ static void initJsonItem(JsonItem *r) {
     r->_childrenReserve = 0;
 }
 
+/*!
+ * \brief Служебные флаги JsonItem::_flags.
+ */
+enum {
+    /// Потомки хранятся блоками, см. setChildrenChunked().
+    ITEM_CHUNKED = 1u << 0,
+    /// Элемент помечен удаленным, см. markChildRemoved().
+    ITEM_TOMBSTONE = 1u << 1,
+    /// Среди потомков есть помеченные удаленными.
+    ITEM_HAS_TOMBSTONES = 1u << 2,
+    /// Элемент разобран из текста, его фрагмент известен (см. itemSpan()).
+    ITEM_HAS_SPAN = 1u << 3,
+    /// Элемент или его потомки изменены после разбора.
+    ITEM_DIRTY = 1u << 4,
+    /// Массив чисел хранится как double[], см. JsonParseOptions::packNumberArrays.
+    ITEM_PACKED = 1u << 5,
+    /// Потомки объекта отсортированы по ключу, см. jsonFreeze().
+    ITEM_FROZEN = 1u << 6,
+    /// key принадлежит таблице интернирования, freeJsonItemFull() его не
+    /// освобождает.
+    ITEM_KEY_INTERNED = 1u << 7,
+    /// str принадлежит таблице интернирования.
+    ITEM_STR_INTERNED = 1u << 8,
+    /// В number объекта или массива лежит хеш значения, см. jsonHash().
+    ITEM_HASHED = 1u << 9,
+    /// key - копия, выделенная библиотекой (keyLen + 1 байт), освобождается
+    /// вместе с элементом.
+    ITEM_KEY_OWNED = 1u << 10
+};
+
+/*!
+ * \brief Хеш, сохраненный jsonHash() в number объекта или массива.
+ */
+static uint64_t cachedHash(const JsonItem *item) {
+    uint64_t h;
+    memcpy(&h, &item->number, sizeof(h));
+    return h;
+}
+
+static void setCachedHash(JsonItem *item, uint64_t h) {
+    memcpy(&item->number, &h, sizeof(h));
+    item->_flags |= ITEM_HASHED;
+}
+
+/*!
+ * \brief Количество потомков в одном блоке.
+ */
+static const size_t CHUNK_SIZE = 64;
+
+/*!
+ * \brief Каталог блоков потомков (только для ITEM_CHUNKED).
+ */
+static inline JsonItem **chunkDir(const JsonItem *item) {
+    return (JsonItem**)item->childrenList;
+}
+
+/*!
+ * \brief Числа упакованного массива (только для ITEM_PACKED).
+ *
+ * _childrenReserve - емкость буфера в числах.
+ */
+static inline double *packedNumbers(const JsonItem *item) {
+    return (double*)item->childrenList;
+}
+
+/*!
+ * \brief Емкость каталога блоков для chunkCount блоков.
+ *
+ * Каталог растет степенями двойки, поэтому емкость вычисляется, а не
+ * хранится.
+ */
+static size_t chunkDirCapacity(size_t chunkCount) {
+    size_t r = 4;
+    while (r < chunkCount) {
+        r *= 2;
+    }
+    return chunkCount ? r : 0;
+}
+
+/*!
+ * \brief Потомок по индексу без проверок, для обоих режимов хранения.
+ */
+static inline JsonItem *childAt(const JsonItem *item, size_t index) {
+    if (item->_flags & ITEM_CHUNKED) {
+        return chunkDir(item)[index / CHUNK_SIZE] + index % CHUNK_SIZE;
+    }
+    return item->childrenList + index;
+}
+
+/*!
+ * \brief Потомок для чтения, в том числе у упакованного массива.
+ *
+ * Для упакованного массива элемент собирается в tmp и действителен до
+ * следующего вызова с тем же tmp.
+ */
+static inline const JsonItem *elementAt(const JsonItem *item, size_t index, JsonItem *tmp) {
+    if (!(item->_flags & ITEM_PACKED)) {
+        return childAt(item, index);
+    }
+    memset(tmp, 0, sizeof(JsonItem));
+    tmp->parent = (JsonItem*)item;
+    tmp->keyLen = INIT_LEN;
+    tmp->type = JsonTypeNumber;
+    tmp->number = packedNumbers(item)[index];
+    tmp->strLen = INIT_LEN;
+    return tmp;
+}
+
+/*!
+ * \brief Проверяет, помечен ли элемент удаленным.
+ */
+static inline bool isTombstone(const JsonItem *item) {
+    return item->_flags & ITEM_TOMBSTONE;
+}
+
+/*!
+ * \brief Исходный фрагмент текста разобранного элемента.
+ *
+ * У строк фрагмент - str в кавычках, у остальных типов парсер сохраняет
+ * его в str/strLen.
+ * \param item - элемент.
+ * \param begin - начало фрагмента.
+ * \param len - длина фрагмента.
+ * \return false, если фрагмент неизвестен.
+ */
+static bool itemSpan(const JsonItem *item, const char **begin, size_t *len) {
+    if (!(item->_flags & ITEM_HAS_SPAN)) {
+        return false;
+    }
+    if (item->type == JsonTypeString) {
+        *begin = item->str - 1;
+        *len = item->strLen + 2;
+    } else {
+        *begin = item->str;
+        *len = item->strLen;
+    }
+    return true;
+}
+
+/*!
+ * \brief Восстанавливает указатель parent у потомков item.
+ *
+ * Нужно после перемещения item в памяти.
+ */
+static void fixChildrenParent(JsonItem *item) {
+    if (item->_flags & ITEM_PACKED) {
+        return;
+    }
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        childAt(item, i)->parent = item;
+    }
+}
+
+/*!
+ * \brief Превращает упакованный массив в обычных потомков.
+ *
+ * Вызывается перед любой операцией, которой нужны сами JsonItem потомков.
+ * \return false, если не хватило памяти (массив остается упакованным).
+ */
+static bool unpackChildren(const JsonAllocator *a, JsonItem *item) {
+    if (!(item->_flags & ITEM_PACKED)) {
+        return true;
+    }
+    double *numbers = packedNumbers(item);
+    JsonItem *list = jsonAlloc(a, item->childrenCount * sizeof(JsonItem));
+    if (!list) {
+        return false;
+    }
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        initJsonItem(list + i);
+        list[i].parent = item;
+        list[i].type = JsonTypeNumber;
+        list[i].number = numbers[i];
+    }
+    jsonFree(a, numbers, item->_childrenReserve * sizeof(double));
+    item->childrenList = list;
+    item->_childrenReserve = item->childrenCount;
+    item->_flags &= ~ITEM_PACKED;
+    return true;
+}
+
 /*!
  * \brief Инициализирует JsonCStruct.
  * \param r - выходная структура.
@@ -45,7 +546,11 @@ static void initJsonItem(JsonItem *r) {
 static void initJsonCStruct(JsonCStruct *r) {
     r->jsonTextFull = NULL;
     r->rootItem = NULL;
+    r->allocator = NULL;
     r->error = JsonJustInit;
+    r->errorOffset = 0;
+    r->errorLine = 0;
+    r->errorColumn = 0;
 }
 
 
@@ -63,6 +568,9 @@ static const char *findCh(char ch, const char *str) {
         if (str[i] == ch) {
             return str + i;
         } else if (str[i] == mask) {
+            if (str[i + 1] == END_STR) {
+                return NULL;
+            }
             ++i; // Пропуск следующего символа
         }
     }
@@ -127,17 +635,41 @@ static const char *myAtoi(const char *str, int32_t *number) {
     return str + i;
 }
 
+/*!
+ * \brief Переводит фрагмент текста с проверенным числом в double.
+ * \param a - аллокатор для временной строки.
+ * \param str - начало числа.
+ * \param len - длина числа.
+ * \param number - выходное число.
+ * \return false, если не хватило памяти.
+ */
+static bool textToDouble(const JsonAllocator *a, const char *str, size_t len, double *number) {
+    // Обычные числа помещаются в буфер на стеке, без выделения памяти.
+    char stackStr[64];
+    char * const doubleStr = len < sizeof(stackStr) ?
+                stackStr : jsonAlloc(a, (len + 1) * sizeof(char));
+    if (doubleStr == NULL) { return false; }
+    memcpy(doubleStr, str, len);
+    doubleStr[len] = 0;
+    *number = atof(doubleStr);
+    if (doubleStr != stackStr) {
+        jsonFree(a, doubleStr, (len + 1) * sizeof(char));
+    }
+    return true;
+}
+
 /*!
  * \brief Перевод строки в double.
  *
  * Переводит строку до первого символа не входящий в шаблон:
  * [+-][0-9]*[.]?[0-9]*([eE][+-]?[0-9]+)?
+ * \param a - аллокатор для временной строки.
  * \param str - входная строка.
  * \param number - выходное число.
  * \return если ошибка то NULL, иначе ссылку на следующий символ после
  * окончания вершины.
  */
-static const char *myAtof(const char *str, double *number) {
+static const char *myAtof(const JsonAllocator *a, const char *str, double *number) {
     const char *it = str;
     /// Наличие точки, или букв 'e' || 'E'.
     bool isDot = it[0] == '.';
@@ -169,8 +701,9 @@ static const char *myAtof(const char *str, double *number) {
             isDot = true;
             isE = true;
             continue;
-        } else if (!isESign && isPlusMinus(it[i])) {
+        } else if (isE && !isESign && isPlusMinus(it[i])) {
             isESign = true;
+            continue;
         }
         break;
     }
@@ -181,19 +714,25 @@ static const char *myAtof(const char *str, double *number) {
         // "1.1e" -- исключаем 'e'.
         --i;
     }
-    if (isDot && !isNum) {
-        // "." -- если введена только точка до 'e' || 'E'.
+    if (!isNum) {
+        // "." или "-" -- если нет ни одной цифры до 'e' || 'E'.
+        return NULL;
+    }
+    if (!textToDouble(a, it, i, number)) {
         return NULL;
     }
-    char * const doubleStr = malloc((i + 1) * sizeof(char));
-    if (doubleStr == NULL) { return NULL; }
-    memcpy(doubleStr, it, i);
-    doubleStr[i] = 0;
-    *number = atof(doubleStr);
-    free(doubleStr);
     return it + i;
 }
 
+/*!
+ * \brief Порядок ключей jsonFreeze(): побайтно, при равном начале короче
+ * раньше.
+ */
+static int compareKeys(const char *a, size_t aLen, const char *b, size_t bLen) {
+    const int r = memcmp(a, b, aLen < bLen ? aLen : bLen);
+    return r ? r : (aLen > bLen) - (aLen < bLen);
+}
+
 /*!
  * \brief Сравнение строк.
  *
@@ -266,641 +805,5626 @@ static const char *firstChar(const char *jsonText) {
     return NULL;
 }
 
+#ifdef JSONC_STATS_TIMING
+/*!
+ * \brief Текущее время в наносекундах (для замеров фаз разбора).
+ */
+static uint64_t statsNowNs(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+/*!
+ * \brief Состояние разбора, передается по рекурсии parseValue().
+ */
+typedef struct {
+    /// Выходная структура (ошибка и позиция ошибки).
+    JsonCStruct *jStruct;
+    /// Аллокатор дерева.
+    const JsonAllocator *allocator;
+    /// Статистика, NULL если не нужна.
+    JsonParseStats *stats;
+    /// Текущая глубина вложенности.
+    size_t depth;
+    /// Текущий объем выделенной под дерево памяти (для stats).
+    size_t memory;
+    /// Упаковывать массивы из одних чисел.
+    bool packNumberArrays;
+    /// Таблица интернирования ключей и строк, может быть NULL.
+    JsonInternTable *intern;
+    /// Максимальная вложенность, 0 - без ограничения.
+    size_t maxDepth;
+} ParseContext;
+
+// Вспомогательные макросы статистики. Без JSONC_NO_STATS стоимость при
+// выключенной статистике - одна проверка указателя.
+#ifdef JSONC_NO_STATS
+#define STATS_DO(ctx, code) do { (void)(ctx); } while (false)
+#else
+#define STATS_DO(ctx, code) \
+    do { \
+        if ((ctx)->stats) { \
+            JsonParseStats * const st = (ctx)->stats; \
+            code; \
+        } \
+    } while (false)
+#endif
+
+#if defined(JSONC_STATS_TIMING) && !defined(JSONC_NO_STATS)
+#define STATS_TIME_BEGIN(ctx, t) \
+    const uint64_t t = (ctx)->stats ? statsNowNs() : 0
+#define STATS_TIME_END(ctx, t, field) \
+    STATS_DO(ctx, st->field += statsNowNs() - t)
+#else
+#define STATS_TIME_BEGIN(ctx, t) do { (void)(ctx); } while (false)
+#define STATS_TIME_END(ctx, t, field) do { (void)(ctx); } while (false)
+#endif
+
+/*!
+ * \brief Учитывает в статистике выделение памяти.
+ * \param ctx - состояние разбора.
+ * \param oldSize - прежний размер блока (0 для нового).
+ * \param newSize - новый размер блока.
+ */
+static void statsAlloc(ParseContext *ctx, size_t oldSize, size_t newSize) {
+    (void)oldSize;
+    (void)newSize;
+    STATS_DO(ctx, {
+        st->bytesAllocated += newSize;
+        ctx->memory += newSize - oldSize;
+        if (ctx->memory > st->peakMemory) {
+            st->peakMemory = ctx->memory;
+        }
+    });
+}
+
+/*!
+ * \brief Вычисляет строку и столбец (с 1) позиции pos в тексте.
+ */
+static void textPosition(const char *text, const char *pos, size_t *line, size_t *column) {
+    *line = 1;
+    *column = 1;
+    for (const char *it = text; it < pos; ++it) {
+        if (*it == '\n') {
+            ++*line;
+            *column = 1;
+        } else {
+            ++*column;
+        }
+    }
+}
+
+/*!
+ * \brief Запоминает ошибку и ее позицию.
+ *
+ * Вызывается только на пути ошибки, поэтому строка и столбец считаются
+ * проходом от начала текста.
+ * \param ctx - состояние разбора.
+ * \param err - код ошибки.
+ * \param pos - место ошибки, NULL - конец текста.
+ */
+static void setParseError(ParseContext *ctx, JsonErrorEnum err, const char *pos) {
+    JsonCStruct *jStruct = ctx->jStruct;
+    const char *text = jStruct->jsonTextFull;
+    if (!pos) {
+        pos = text + strlen(text);
+    }
+    jStruct->error = err;
+    jStruct->errorOffset = pos - text;
+    textPosition(text, pos, &jStruct->errorLine, &jStruct->errorColumn);
+}
+
 // вспомогательный макрос для функции parseValue.
-#define IF_TO_ERROR(x, err) \
+#define IF_TO_ERROR(x, err, pos) \
     do { \
         if (x) { \
-            printf("%d", __LINE__); \
-            (*ppStruct)->error = err; \
+            setParseError(ctx, err, pos); \
             return NULL; \
         } \
     } while (false)
 
+/*!
+ * \brief firstChar() с учетом времени в статистике.
+ */
+static const char *parseSkip(ParseContext *ctx, const char *jsonText) {
+    STATS_TIME_BEGIN(ctx, t);
+    const char *r = firstChar(jsonText);
+    STATS_TIME_END(ctx, t, whitespaceNs);
+    return r;
+}
+
+static JsonItem *addChildAlloc(const JsonAllocator *a, JsonItem *pCurrent);
+
+/*!
+ * \brief addChild() с учетом перевыделений в статистике.
+ */
+static JsonItem *parseAddChild(ParseContext *ctx, JsonItem *pCurrent) {
+    STATS_TIME_BEGIN(ctx, t);
+    STATS_DO(ctx, {
+        if (pCurrent->childrenCount == pCurrent->_childrenReserve) {
+            const size_t oldReserve = pCurrent->_childrenReserve;
+            const size_t newReserve = oldReserve ? oldReserve * 2 : 1;
+            ++st->reallocCount;
+            statsAlloc(ctx, oldReserve * sizeof(JsonItem),
+                       newReserve * sizeof(JsonItem));
+        }
+    });
+    JsonItem *r = addChildAlloc(ctx->allocator, pCurrent);
+    STATS_TIME_END(ctx, t, buildNs);
+    return r;
+}
+
+/*!
+ * \brief Разбирает массив из одних чисел сразу в упакованный вид.
+ *
+ * Если в массиве встретилось не число или ошибка, буфер освобождается и
+ * массив разбирается обычным образом (он же сообщает об ошибке).
+ * \param json - символ '[' массива.
+ * \param pCurrent - элемент массива.
+ * \param ctx - состояние разбора.
+ * \return символ ']' массива или NULL, если массив не упакован.
+ */
+static const char *parsePackedArray(const char *json, JsonItem *pCurrent, ParseContext *ctx) {
+    const JsonAllocator *a = ctx->allocator;
+    double *numbers = NULL;
+    size_t count = 0;
+    size_t reserve = 0;
+    const char *it = json;
+    for (;;) {
+        it = parseSkip(ctx, it + 1);
+        if (!it || !isNumericPlusMinus(it[0])) {
+            break;
+        }
+        if (count == reserve) {
+            const size_t newReserve = reserve ? reserve * 2 : 8;
+            double *newNumbers = jsonRealloc(a, numbers, reserve * sizeof(double),
+                                             newReserve * sizeof(double));
+            if (!newNumbers) {
+                break;
+            }
+            STATS_DO(ctx, ++st->reallocCount);
+            statsAlloc(ctx, reserve * sizeof(double), newReserve * sizeof(double));
+            numbers = newNumbers;
+            reserve = newReserve;
+        }
+        STATS_TIME_BEGIN(ctx, t);
+        const char *next = myAtof(a, it, numbers + count);
+        STATS_TIME_END(ctx, t, numberNs);
+        if (!next) {
+            break;
+        }
+        ++count;
+        it = parseSkip(ctx, next);
+        if (!it || (it[0] != ',' && it[0] != ']')) {
+            break;
+        }
+        if (it[0] == ']') {
+            if (reserve > count) {
+                double *fit = jsonRealloc(a, numbers, reserve * sizeof(double),
+                                          count * sizeof(double));
+                if (fit) {
+                    statsAlloc(ctx, reserve * sizeof(double), count * sizeof(double));
+                    numbers = fit;
+                    reserve = count;
+                }
+            }
+            pCurrent->childrenList = (JsonItem*)numbers;
+            pCurrent->childrenCount = count;
+            pCurrent->_childrenReserve = reserve;
+            pCurrent->_flags |= ITEM_PACKED;
+            STATS_DO(ctx, st->nodeCount[JsonTypeNumber] += count);
+            return it;
+        }
+    }
+    jsonFree(a, numbers, reserve * sizeof(double));
+    statsAlloc(ctx, reserve * sizeof(double), 0);
+    return NULL;
+}
+
 /*!
  * \brief Парсит json, следит за синтаксисом.
  *
  * Вызывается внутри openJsonFile().
  * \param json - массив данных json файла
- * \param ppCurrent - текущая вершина.
- * \param ppStruct - структура
+ * \param pCurrent - текущая вершина.
+ * \param ctx - состояние разбора.
  * \return если ошибка то NULL, иначе ссылку на следующий символ после
  * окончания вершины.
  */
-static const char *parseValue(const char *json, JsonItem **ppCurrent, JsonCStruct **ppStruct) {
-    const bool IS_ROOT = !(*ppStruct);
-    if (IS_ROOT) {
-        (*ppStruct) = malloc(sizeof(JsonCStruct));
-        if (*ppStruct == NULL) { return NULL; }
-        initJsonCStruct(*ppStruct);
-        (*ppStruct)->jsonTextFull = json;
-        *ppCurrent = malloc(sizeof(JsonItem));
-        if (*ppCurrent == NULL) { return NULL; }
-        initJsonItem(*ppCurrent);
-        (*ppStruct)->rootItem = *ppCurrent;
-        (*ppStruct)->error = JsonSuccess;
-    }
-    JsonItem *pCurrent = *ppCurrent;
+static const char *parseValue(const char *json, JsonItem *pCurrent, ParseContext *ctx) {
     const char *it1 = json;
     const char *it2 = NULL;
-    it1 = firstChar(json);
-    if (!it1) {
-        return NULL;
-    } else if (strcmp(it1, NULL_STR) == 0) {
+    it1 = parseSkip(ctx, json);
+    IF_TO_ERROR(!it1, JsonErrorEnd, NULL);
+    const char * const start = it1;
+    if (strncmp(it1, NULL_STR, NULL_STR_LEN) == 0) {
         pCurrent->type = JsonTypeNull;
         it1 += NULL_STR_LEN;
-    } else if (strcmp(it1, FALSE_STR) == 0) {
+    } else if (strncmp(it1, FALSE_STR, FALSE_STR_LEN) == 0) {
         pCurrent->type = JsonTypeBool;
         pCurrent->number = 0;
         it1 += FALSE_STR_LEN;
-    } else if (strcmp(it1, TRUE_STR) == 0) {
+    } else if (strncmp(it1, TRUE_STR, TRUE_STR_LEN) == 0) {
         pCurrent->type = JsonTypeBool;
         pCurrent->number = 1;
         it1 += TRUE_STR_LEN;
     } else if (isNumericPlusMinus(it1[0])) {
         pCurrent->type = JsonTypeNumber;
-        it1 = myAtof(it1, &pCurrent->number);
+        STATS_TIME_BEGIN(ctx, t);
+        it2 = myAtof(ctx->allocator, it1, &pCurrent->number);
+        STATS_TIME_END(ctx, t, numberNs);
+        IF_TO_ERROR(!it2, JsonErrorValue, it1);
+        it1 = it2;
     } else if (it1[0] == '"') {
         pCurrent->type = JsonTypeString;
+        STATS_TIME_BEGIN(ctx, t);
         it2 = parseString(it1);
-        IF_TO_ERROR(!it2, JsonErrorValue);
+        STATS_TIME_END(ctx, t, stringNs);
+        IF_TO_ERROR(!it2, JsonErrorValue, it1);
         pCurrent->str = ++it1;
         pCurrent->strLen = it2 - it1;
+        if (ctx->intern && pCurrent->strLen <= ctx->intern->strMaxLen) {
+            pCurrent->str = jsonIntern(ctx->intern, it1, pCurrent->strLen);
+            IF_TO_ERROR(!pCurrent->str, JsonErrorUnknow, it1);
+            pCurrent->_flags |= ITEM_STR_INTERNED;
+        }
         it1 = it2 + 1;
     } else if (it1[0] == '[') {
         pCurrent->type = JsonTypeArray;
-        it2 = firstChar(it1 + 1);
-        if (it2[0] != ']') {
+        ++ctx->depth;
+        IF_TO_ERROR(ctx->maxDepth && ctx->depth > ctx->maxDepth, JsonErrorDepth, it1);
+        STATS_DO(ctx, {
+            if (ctx->depth > st->maxDepth) {
+                st->maxDepth = ctx->depth;
+            }
+        });
+        it2 = parseSkip(ctx, it1 + 1);
+        IF_TO_ERROR(!it2, JsonErrorEnd, NULL);
+        const char *packedEnd = NULL;
+        if (ctx->packNumberArrays && isNumericPlusMinus(it2[0])) {
+            packedEnd = parsePackedArray(it1, pCurrent, ctx);
+        }
+        if (packedEnd) {
+            it1 = packedEnd;
+        } else if (it2[0] != ']') {
             while (it1[0] != ']') {
-                JsonItem *jNew = addChild(pCurrent);
-                it1 = parseValue(it1 + 1, &jNew, ppStruct);
+                JsonItem *jNew = parseAddChild(ctx, pCurrent);
+                IF_TO_ERROR(!jNew, JsonErrorUnknow, it1);
+                it1 = parseValue(it1 + 1, jNew, ctx);
                 if (!it1) {
                     // parseValue сам заполняет jCurrent->error.
                     return NULL;
                 }
-                it1 = firstChar(it1);
-                IF_TO_ERROR(!it1, JsonErrorSyntax);
-                IF_TO_ERROR(it1[0] != ',' && it1[0] != ']', JsonErrorSyntax);
+                it1 = parseSkip(ctx, it1);
+                IF_TO_ERROR(!it1, JsonErrorSyntax, NULL);
+                IF_TO_ERROR(it1[0] != ',' && it1[0] != ']', JsonErrorSyntax, it1);
             }
         } else {
             it1 = it2;
         }
+        --ctx->depth;
         ++it1;
     } else if (it1[0] == '{') {
         pCurrent->type = JsonTypeObject;
-        it2 = firstChar(it1 + 1);
+        ++ctx->depth;
+        IF_TO_ERROR(ctx->maxDepth && ctx->depth > ctx->maxDepth, JsonErrorDepth, it1);
+        STATS_DO(ctx, {
+            if (ctx->depth > st->maxDepth) {
+                st->maxDepth = ctx->depth;
+            }
+        });
+        it2 = parseSkip(ctx, it1 + 1);
+        IF_TO_ERROR(!it2, JsonErrorEnd, NULL);
         if (it2[0] != '}') {    // Проверка на пустоту.
             while (it1[0] != '}') {
-                it1 = firstChar(it1 + 1);
-                IF_TO_ERROR(!it1, JsonErrorEnd);
-                IF_TO_ERROR(it1[0] != '"', JsonErrorSyntax);
+                it1 = parseSkip(ctx, it1 + 1);
+                IF_TO_ERROR(!it1, JsonErrorEnd, NULL);
+                IF_TO_ERROR(it1[0] != '"', JsonErrorSyntax, it1);
+                STATS_TIME_BEGIN(ctx, t);
                 it2 = parseString(it1);
-                IF_TO_ERROR(!it2, JsonErrorKey);
-                JsonItem *jNew = addChild(pCurrent);
+                STATS_TIME_END(ctx, t, stringNs);
+                IF_TO_ERROR(!it2, JsonErrorKey, it1);
+                JsonItem *jNew = parseAddChild(ctx, pCurrent);
+                IF_TO_ERROR(!jNew, JsonErrorUnknow, it1);
                 jNew->key = ++it1;
                 jNew->keyLen = it2 - it1;
-                it1 = firstChar(it2 + 1);
-                IF_TO_ERROR(!it1, JsonErrorEnd);
-                IF_TO_ERROR(it1[0] != ':', JsonErrorSyntax);
-                it1 = parseValue(it1 + 1, &jNew, ppStruct);
+                if (ctx->intern) {
+                    jNew->key = jsonIntern(ctx->intern, it1, jNew->keyLen);
+                    IF_TO_ERROR(!jNew->key, JsonErrorUnknow, it1);
+                    jNew->_flags |= ITEM_KEY_INTERNED;
+                }
+                it1 = parseSkip(ctx, it2 + 1);
+                IF_TO_ERROR(!it1, JsonErrorEnd, NULL);
+                IF_TO_ERROR(it1[0] != ':', JsonErrorSyntax, it1);
+                it1 = parseValue(it1 + 1, jNew, ctx);
                 if (!it1) {
                     // parseValue сам заполняет jCurrent->error.
                     return NULL;
                 }
-                it1 = firstChar(it1);
-                IF_TO_ERROR(!it1, JsonErrorSyntax);
-                IF_TO_ERROR(it1[0] != ',' && it1[0] != '}', JsonErrorSyntax);
+                it1 = parseSkip(ctx, it1);
+                IF_TO_ERROR(!it1, JsonErrorSyntax, NULL);
+                IF_TO_ERROR(it1[0] != ',' && it1[0] != '}', JsonErrorSyntax, it1);
             }
         } else {
             it1 = it2;
         }
+        --ctx->depth;
         ++it1;
+    } else {
+        IF_TO_ERROR(true, JsonErrorValue, it1);
     }
+    if (pCurrent->type != JsonTypeString) {
+        // Фрагмент текста для fprintJsonItemIncremental().
+        pCurrent->str = start;
+        pCurrent->strLen = it1 - start;
+    }
+    pCurrent->_flags |= ITEM_HAS_SPAN;
+    STATS_DO(ctx, ++st->nodeCount[pCurrent->type]);
     return it1;
 }
 
-static void freeJsonItemChild(JsonItem *item) {
+/*!
+ * \brief Освобождает память под список потомков (оба режима хранения).
+ * \param a - аллокатор дерева.
+ * \param item - элемент.
+ */
+static void freeChildrenStorage(const JsonAllocator *a, JsonItem *item) {
+    if (item->_flags & ITEM_PACKED) {
+        jsonFree(a, item->childrenList, item->_childrenReserve * sizeof(double));
+    } else if (item->_flags & ITEM_CHUNKED) {
+        const size_t chunkCount = item->_childrenReserve / CHUNK_SIZE;
+        for (size_t i = 0; i < chunkCount; ++i) {
+            jsonFree(a, chunkDir(item)[i], CHUNK_SIZE * sizeof(JsonItem));
+        }
+        jsonFree(a, item->childrenList,
+                 chunkDirCapacity(chunkCount) * sizeof(JsonItem*));
+    } else {
+        jsonFree(a, item->childrenList, item->_childrenReserve * sizeof(JsonItem));
+    }
+}
+
+/*!
+ * \brief Задает элементу собственную копию ключа (ITEM_KEY_OWNED).
+ * \return false, если не хватило памяти (элемент не меняется).
+ */
+static bool setOwnedKey(const JsonAllocator *a, JsonItem *item, const char *key, size_t keyLen) {
+    char *copy = jsonAlloc(a, keyLen + 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, key, keyLen);
+    copy[keyLen] = END_STR;
+    item->key = copy;
+    item->keyLen = keyLen;
+    item->_flags |= ITEM_KEY_OWNED;
+    return true;
+}
+
+/*!
+ * \brief Освобождает собственный ключ элемента, если он есть.
+ */
+static void freeOwnedKey(const JsonAllocator *a, JsonItem *item) {
+    if (item->_flags & ITEM_KEY_OWNED) {
+        jsonFree(a, (void*)item->key, item->keyLen + 1);
+        item->key = NULL;
+        item->keyLen = 0;
+        item->_flags &= ~ITEM_KEY_OWNED;
+    }
+}
+
+/*!
+ * \brief Копирует ключ src в dst: ключ текста или таблицы интернирования
+ * разделяется, собственный ключ копируется.
+ * \return false, если не хватило памяти.
+ */
+static bool copyChildKey(const JsonAllocator *a, JsonItem *dst, const JsonItem *src) {
+    if (src->_flags & ITEM_KEY_OWNED) {
+        return setOwnedKey(a, dst, src->key, src->keyLen);
+    }
+    dst->key = src->key;
+    dst->keyLen = src->keyLen;
+    dst->_flags |= src->_flags & ITEM_KEY_INTERNED;
+    return true;
+}
+
+/*!
+ * \brief Освобождает потомков item, сам item не освобождается.
+ *
+ * Собственные ключи потомков (ITEM_KEY_OWNED) освобождаются.
+ * \param a - аллокатор дерева.
+ * \param item - элемент.
+ */
+static void freeJsonItemChild(const JsonAllocator *a, JsonItem *item) {
     if (!item) {
         return;
     }
-    for (size_t i = 0; i < item->childrenCount; ++i) {
-        freeJsonItemChild(item->childrenList + i);
+    for (size_t i = 0; !(item->_flags & ITEM_PACKED) && i < item->childrenCount; ++i) {
+        JsonItem *child = childAt(item, i);
+        freeJsonItemChild(a, child);
+        freeOwnedKey(a, child);
     }
-    free(item->childrenList);
+    freeChildrenStorage(a, item);
 }
 
-static void freeJsonItemChildFull(JsonItem *item) {
+/*!
+ * \brief Освобождает потомков item вместе с их key и str.
+ * \param a - аллокатор дерева.
+ * \param item - элемент.
+ */
+static void freeJsonItemChildFull(const JsonAllocator *a, JsonItem *item) {
     if (!item) {
         return;
     }
-    for (size_t i = 0; i < item->childrenCount; ++i) {
-        freeJsonItemChild(item);
+    for (size_t i = 0; !(item->_flags & ITEM_PACKED) && i < item->childrenCount; ++i) {
+        JsonItem *child = childAt(item, i);
+        freeJsonItemChildFull(a, child);
+        if (child->_flags & ITEM_KEY_OWNED) {
+            freeOwnedKey(a, child);
+        } else if (!(child->_flags & ITEM_KEY_INTERNED)) {
+            jsonFree(a, (void*)child->key, 0);
+        }
+        if ((!(child->_flags & ITEM_HAS_SPAN) || child->type == JsonTypeString)
+                && !(child->_flags & ITEM_STR_INTERNED)) {
+            jsonFree(a, (void*)child->str, 0);
+        }
     }
-    free((void*)item->key);
-    free((void*)item->str);
-    free(item->childrenList);
+    freeChildrenStorage(a, item);
 }
 
 JsonCStruct openJsonFromStr(const char *jsonTextFull) {
-    JsonItem *jCurrent = NULL;
-    JsonCStruct *jStruct = NULL;
-    parseValue(jsonTextFull, &jCurrent, &jStruct);
-    if (!jStruct) {
-        JsonCStruct r;
-        initJsonCStruct(&r);
-        return r;
-    }
-    JsonCStruct r = *jStruct;
-    free(jStruct);
-    return r;
+    return openJsonFromStrOpt(jsonTextFull, NULL);
 }
 
-JsonCStruct openJsonFromFile(const char *fileName) {
+JsonCStruct openJsonFromStrStats(const char *jsonTextFull, JsonParseStats *stats) {
+    JsonParseOptions options = { NULL, stats, false, NULL, 0 };
+    return openJsonFromStrOpt(jsonTextFull, &options);
+}
+
+JsonCStruct openJsonFromStrOpt(const char *jsonTextFull, const JsonParseOptions *options) {
     JsonCStruct r;
     initJsonCStruct(&r);
-    FILE *ptrFile = fopen(fileName, "r");
-    if (ptrFile == NULL) {
-        r.error = JsonErrorFile;
+    JsonParseStats *stats = options ? options->stats : NULL;
+    r.allocator = options && options->allocator ?
+                options->allocator : jsonCurrentAllocator();
+    if (stats) {
+        memset(stats, 0, sizeof(JsonParseStats));
+    }
+    if (!jsonTextFull) {
         return r;
     }
-    fseek(ptrFile, 0, SEEK_END);
-    long lSize = ftell(ptrFile) + 1;    // +1 для нулевого символа
-    rewind(ptrFile);
-
-    char *buffer = (char*)malloc(sizeof(char) * lSize);
-    if (buffer == NULL) {
-        r.error = JsonErrorFile;
+    r.jsonTextFull = jsonTextFull;
+    r.rootItem = jsonAlloc(r.allocator, sizeof(JsonItem));
+    if (r.rootItem == NULL) {
+        r.error = JsonErrorUnknow;
         return r;
     }
-
-    size_t result = fread(buffer, 1, lSize, ptrFile);
-    fclose(ptrFile);
-    buffer[result] = 0; // добавления нулевого символа
-    return openJsonFromStr(buffer);
-}
-
-int32_t saveJsonCStruct(const char *fileName, JsonCStruct jStruct) {
-    FILE *ptrFile = fopen(fileName, "w");
-    if (ptrFile == NULL) {
-        return -1;
+    initJsonItem(r.rootItem);
+    r.error = JsonSuccess;
+    ParseContext ctx = { &r, r.allocator, stats, 0, 0,
+                         options && options->packNumberArrays,
+                         options ? options->internTable : NULL,
+                         options ? options->maxDepth : 0 };
+    statsAlloc(&ctx, 0, sizeof(JsonItem));
+    STATS_DO(&ctx, st->byteCount = strlen(jsonTextFull));
+    const char *end = parseValue(jsonTextFull, r.rootItem, &ctx);
+    if (end && (end = parseSkip(&ctx, end))) {
+        // После корневого элемента допустимы только пробелы и комментарии.
+        setParseError(&ctx, JsonErrorSyntax, end);
     }
-    int32_t res = fprintJsonItem(ptrFile, jStruct.rootItem);
-    fclose(ptrFile);
-
-    return res;
+    return r;
 }
 
-void freeJsonCStruct(JsonCStruct jStruct) {
-    freeJsonParent(jStruct.rootItem);
-}
+static const JsonAllocator *structAllocator(const JsonCStruct *jStruct);
 
-void freeJsonCStructFull(JsonCStruct jStruct) {
-    freeJsonCStruct(jStruct);
-    free((void*)jStruct.jsonTextFull);
+/*!
+ * \brief Разбирает значение поверх элемента прошлого разбора той же формы.
+ *
+ * Грамматика как у parseValue(). Объекты и массивы должны совпадать по типу,
+ * количеству потомков и ключам (по порядку), скаляры перезаписываются
+ * (тип скаляра может смениться). Элементы, измененные после разбора или с
+ * удаленными потомками, формой не совпадают. Ошибку не сообщает: при
+ * несовпадении элемент может остаться частично перезаписанным.
+ * \param json - текст значения.
+ * \param pCurrent - элемент шаблона.
+ * \param ctx - состояние разбора.
+ * \return символ после значения или NULL, если форма или текст не совпали.
+ */
+static const char *reparseValue(const char *json, JsonItem *pCurrent, ParseContext *ctx) {
+    const char *it1 = parseSkip(ctx, json);
+    const char *it2 = NULL;
+    if (!it1 || !(pCurrent->_flags & ITEM_HAS_SPAN)
+            || (pCurrent->_flags & ITEM_HAS_TOMBSTONES)) {
+        return NULL;
+    }
+    const char * const start = it1;
+    const bool container = pCurrent->type == JsonTypeObject || pCurrent->type == JsonTypeArray;
+    pCurrent->_flags &= ~(ITEM_HASHED | ITEM_DIRTY | ITEM_STR_INTERNED);
+    if (it1[0] == '[' || it1[0] == '{') {
+        const bool object = it1[0] == '{';
+        const char close = object ? '}' : ']';
+        if (pCurrent->type != (object ? JsonTypeObject : JsonTypeArray)) {
+            return NULL;
+        }
+        ++ctx->depth;
+        if (ctx->maxDepth && ctx->depth > ctx->maxDepth) {
+            return NULL;
+        }
+        STATS_DO(ctx, {
+            if (ctx->depth > st->maxDepth) {
+                st->maxDepth = ctx->depth;
+            }
+        });
+        it2 = parseSkip(ctx, it1 + 1);
+        if (!it2) {
+            return NULL;
+        }
+        const bool packed = pCurrent->_flags & ITEM_PACKED;
+        size_t i = 0;
+        if (it2[0] != close) {
+            while (it1[0] != close) {
+                if (i == pCurrent->childrenCount) {
+                    return NULL;
+                }
+                if (packed) {
+                    it1 = parseSkip(ctx, it1 + 1);
+                    if (!it1 || !isNumericPlusMinus(it1[0])) {
+                        return NULL;
+                    }
+                    STATS_TIME_BEGIN(ctx, t);
+                    it1 = myAtof(ctx->allocator, it1, (double*)pCurrent->childrenList + i);
+                    STATS_TIME_END(ctx, t, numberNs);
+                    STATS_DO(ctx, ++st->nodeCount[JsonTypeNumber]);
+                } else {
+                    JsonItem *child = childAt(pCurrent, i);
+                    ++it1;
+                    if (object) {
+                        it1 = parseSkip(ctx, it1);
+                        if (!it1 || it1[0] != '"') {
+                            return NULL;
+                        }
+                        STATS_TIME_BEGIN(ctx, t);
+                        it2 = parseString(it1);
+                        STATS_TIME_END(ctx, t, stringNs);
+                        ++it1;
+                        if (!it2 || (size_t)(it2 - it1) != child->keyLen
+                                || memcmp(child->key, it1, child->keyLen) != 0) {
+                            return NULL;
+                        }
+                        if (!(child->_flags & (ITEM_KEY_INTERNED | ITEM_KEY_OWNED))) {
+                            child->key = it1;
+                        }
+                        it1 = parseSkip(ctx, it2 + 1);
+                        if (!it1 || it1[0] != ':') {
+                            return NULL;
+                        }
+                        ++it1;
+                    }
+                    it1 = reparseValue(it1, child, ctx);
+                }
+                if (!it1) {
+                    return NULL;
+                }
+                it1 = parseSkip(ctx, it1);
+                if (!it1 || (it1[0] != ',' && it1[0] != close)) {
+                    return NULL;
+                }
+                ++i;
+            }
+        } else {
+            it1 = it2;
+        }
+        if (i != pCurrent->childrenCount) {
+            return NULL;
+        }
+        --ctx->depth;
+        ++it1;
+    } else if (container) {
+        return NULL;
+    } else if (strncmp(it1, NULL_STR, NULL_STR_LEN) == 0) {
+        pCurrent->type = JsonTypeNull;
+        it1 += NULL_STR_LEN;
+    } else if (strncmp(it1, FALSE_STR, FALSE_STR_LEN) == 0) {
+        pCurrent->type = JsonTypeBool;
+        pCurrent->number = 0;
+        it1 += FALSE_STR_LEN;
+    } else if (strncmp(it1, TRUE_STR, TRUE_STR_LEN) == 0) {
+        pCurrent->type = JsonTypeBool;
+        pCurrent->number = 1;
+        it1 += TRUE_STR_LEN;
+    } else if (isNumericPlusMinus(it1[0])) {
+        pCurrent->type = JsonTypeNumber;
+        STATS_TIME_BEGIN(ctx, t);
+        it1 = myAtof(ctx->allocator, it1, &pCurrent->number);
+        STATS_TIME_END(ctx, t, numberNs);
+        if (!it1) {
+            return NULL;
+        }
+    } else if (it1[0] == '"') {
+        pCurrent->type = JsonTypeString;
+        STATS_TIME_BEGIN(ctx, t);
+        it2 = parseString(it1);
+        STATS_TIME_END(ctx, t, stringNs);
+        if (!it2) {
+            return NULL;
+        }
+        pCurrent->str = ++it1;
+        pCurrent->strLen = it2 - it1;
+        if (ctx->intern && pCurrent->strLen <= ctx->intern->strMaxLen) {
+            pCurrent->str = jsonIntern(ctx->intern, it1, pCurrent->strLen);
+            if (!pCurrent->str) {
+                return NULL;
+            }
+            pCurrent->_flags |= ITEM_STR_INTERNED;
+        }
+        it1 = it2 + 1;
+    } else {
+        return NULL;
+    }
+    if (pCurrent->type != JsonTypeString) {
+        pCurrent->str = start;
+        pCurrent->strLen = it1 - start;
+    }
+    STATS_DO(ctx, ++st->nodeCount[pCurrent->type]);
+    return it1;
 }
 
-JsonItem *createJsonParent(void) {
-    JsonItem *jIt = (JsonItem*)malloc(sizeof(JsonItem));
-    initJsonItem(jIt);
-    jIt->type = JsonTypeObject;
-    return jIt;
+bool reparseJsonFromStr(JsonCStruct *jStruct, const char *jsonTextFull) {
+    return reparseJsonFromStrOpt(jStruct, jsonTextFull, NULL);
 }
 
-bool freeJsonParent(JsonItem *item) {
-    if (!item || item->parent) {
+bool reparseJsonFromStrOpt(JsonCStruct *jStruct, const char *jsonTextFull,
+                           const JsonParseOptions *options) {
+    if (!jStruct) {
         return false;
     }
-    freeJsonItemChild(item->childrenList);
-    free(item);
-    return true;
+    JsonParseStats *stats = options ? options->stats : NULL;
+    const JsonAllocator *a = options && options->allocator ?
+                options->allocator : structAllocator(jStruct);
+    JsonItem *root = jStruct->rootItem;
+    if (jsonTextFull && root && jStruct->error == JsonSuccess && !(root->_flags & ITEM_DIRTY)) {
+        if (stats) {
+            memset(stats, 0, sizeof(JsonParseStats));
+        }
+        ParseContext ctx = { jStruct, a, stats, 0, 0, false,
+                             options ? options->internTable : NULL,
+                             options ? options->maxDepth : 0 };
+        STATS_DO(&ctx, st->byteCount = strlen(jsonTextFull));
+        const char *end = reparseValue(jsonTextFull, root, &ctx);
+        if (end && !parseSkip(&ctx, end)) {
+            jStruct->jsonTextFull = jsonTextFull;
+            return true;
+        }
+    }
+    // Форма не совпала: обычный разбор тем же аллокатором.
+    JsonParseOptions opt = { a, stats, false, NULL, 0 };
+    if (options) {
+        opt = *options;
+        opt.allocator = a;
+    }
+    freeJsonCStruct(*jStruct);
+    *jStruct = openJsonFromStrOpt(jsonTextFull, &opt);
+    return false;
 }
 
-bool freeJsonItemFull(JsonItem *item) {
-    if (!item || item->parent) {
-        return false;
-    }
-    freeJsonItemChildFull(item->childrenList);
-    free((void*)item->key);
-    free((void*)item->str);
-    free(item);
-    return true;
+JsonCStruct openJsonFromFile(const char *fileName) {
+    return openJsonFromFileOpt(fileName, NULL);
 }
 
-JsonItem *findChildKey(const JsonItem *root, const char *key) {
-    return findChildKeyLen(root, key, strlen(key));
+JsonCStruct openJsonFromFileStats(const char *fileName, JsonParseStats *stats) {
+    JsonParseOptions options = { NULL, stats, false, NULL, 0 };
+    return openJsonFromFileOpt(fileName, &options);
 }
 
-JsonItem *findChildKeyLen(const JsonItem *root, const char *key, size_t keyLen) {
-    if (!root || root->type != JsonTypeObject) {
-        return NULL;
+/*!
+ * \brief Размер открытого файла в байтах (64 бита), файл перематывается в
+ * начало.
+ * \return размер или -1 при ошибке.
+ */
+static int64_t fileSize(FILE *file) {
+#ifdef _WIN32
+    if (_fseeki64(file, 0, SEEK_END) != 0) {
+        return -1;
     }
-    for (size_t i = 0; i < root->childrenCount; ++i) {
-        if (root->childrenList[i].keyLen == keyLen &&
-                myStrcmp(key, root->childrenList[i].key, keyLen)) {
-            return root->childrenList + i;
-        }
+    const int64_t size = _ftelli64(file);
+#else
+    if (fseeko(file, 0, SEEK_END) != 0) {
+        return -1;
     }
-    return NULL;
+    const int64_t size = (int64_t)ftello(file);
+#endif
+    rewind(file);
+    return size;
 }
 
-JsonItem *findChildIndex(JsonItem *root, size_t index) {
-    if (index == INIT_LEN
-            || root->type != JsonTypeArray
-            || root->childrenCount <= index) {
-        return NULL;
-    }
-    return root->childrenList + index;
-}
+/// Сигнатуры сжатых форматов.
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
 
-size_t indexOfChild(JsonItem* pChild) {
-    JsonItem *parent = pChild->parent;
-    if (!parent
-            || (parent->type != JsonTypeArray
-                && parent->type != JsonTypeObject)) {
-        return SIZE_MAX;
+#ifdef JSONC_WITH_ZLIB
+/// Размер блока сжатых данных, читаемого из файла.
+#define GZIP_READ_BLOCK ((size_t)64 * 1024)
+/// Предельная степень сжатия deflate, больший ISIZE - мусор.
+#define GZIP_MAX_RATIO 1032
+
+/*!
+ * \brief Распаковывает gzip файл блоками прямо в буфер текста.
+ *
+ * Сжатый файл целиком в память не читается. Начальный размер буфера берется
+ * из поля ISIZE в конце файла (размер распакованных данных по модулю 2^32),
+ * поэтому обычно буфер не перевыделяется. Склеенные gzip потоки
+ * распаковываются подряд. Буфер обрезается до первого нулевого символа,
+ * как его освобождает freeJsonCStructFull().
+ * \param file - файл, позиция в начале.
+ * \param fileLen - размер файла.
+ * \param a - аллокатор текста.
+ * \param text - выходной текст с нулевым символом.
+ * \return JsonSuccess или JsonErrorFile.
+ */
+static JsonErrorEnum readGzipText(FILE *file, int64_t fileLen, const JsonAllocator *a,
+                                  char **text) {
+    unsigned char trailer[4];
+    size_t cap = 0;
+#ifdef _WIN32
+    const int seek = _fseeki64(file, -4, SEEK_END);
+#else
+    const int seek = fseeko(file, -4, SEEK_END);
+#endif
+    if (fileLen >= 18 && seek == 0
+            && fread(trailer, 1, sizeof(trailer), file) == sizeof(trailer)) {
+        cap = (size_t)trailer[0] | (size_t)trailer[1] << 8
+                | (size_t)trailer[2] << 16 | (size_t)trailer[3] << 24;
     }
-    if (pChild < parent->childrenList
-            || pChild > parent->childrenList + parent->childrenCount) {
-        return SIZE_MAX;
+    rewind(file);
+    if (cap < (size_t)fileLen || cap / GZIP_MAX_RATIO > (size_t)fileLen) {
+        // ISIZE переполнился, потоков несколько или файл обрезан.
+        cap = (size_t)fileLen * 4;
     }
-    return parent->childrenList - pChild;
-}
+    cap = cap < SIZE_MAX - 1 ? cap + 1 : cap;
 
-bool reserveChildCount(JsonItem *pCurrent, size_t childrenReserve) {
-    if (!pCurrent
-            || (pCurrent->type != JsonTypeArray
-                && pCurrent->type != JsonTypeObject)) {
-        return false;
+    unsigned char *in = jsonAlloc(a, GZIP_READ_BLOCK);
+    char *out = jsonAlloc(a, cap);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (!in || !out || inflateInit2(&z, 15 + 16) != Z_OK) {
+        jsonFree(a, in, GZIP_READ_BLOCK);
+        jsonFree(a, out, cap);
+        return JsonErrorFile;
     }
-    childrenReserve = childrenReserve >= pCurrent->childrenCount ?
-                                childrenReserve : pCurrent->childrenCount;
-    if (childrenReserve == pCurrent->_childrenReserve) {
-        return true;
+    size_t len = 0;
+    bool eof = false;
+    int zr = Z_OK;
+    for (;;) {
+        if (z.avail_in == 0 && !eof) {
+            z.next_in = in;
+            z.avail_in = (uInt)fread(in, 1, GZIP_READ_BLOCK, file);
+            eof = z.avail_in < GZIP_READ_BLOCK;
+        }
+        if (z.avail_in == 0 && eof) {
+            break;
+        }
+        if (zr == Z_STREAM_END) {
+            // Следующий gzip поток в том же файле.
+            if (inflateReset(&z) != Z_OK) {
+                break;
+            }
+        }
+        if (cap - len <= 1) {
+            const size_t newCap = cap * 2;
+            char *newOut = newCap > cap ? jsonRealloc(a, out, cap, newCap) : NULL;
+            if (!newOut) {
+                zr = Z_MEM_ERROR;
+                break;
+            }
+            out = newOut;
+            cap = newCap;
+        }
+        const size_t room = cap - len - 1;
+        z.next_out = (Bytef*)out + len;
+        z.avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+        const uInt before = z.avail_out;
+        zr = inflate(&z, Z_NO_FLUSH);
+        len += before - z.avail_out;
+        if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR) {
+            break;
+        }
     }
-    /// \todo необходимо проверить работу realloc().
-    void *newList = realloc(pCurrent->childrenList,
-                                     childrenReserve * sizeof(JsonItem));
-    if (!newList) {
-        return false;
+    inflateEnd(&z);
+    jsonFree(a, in, GZIP_READ_BLOCK);
+    if (zr != Z_STREAM_END || ferror(file)) {
+        jsonFree(a, out, cap);
+        return JsonErrorFile;
     }
-    pCurrent->childrenList = newList;
-    for (size_t i = 0; i < pCurrent->childrenCount; ++i) {
-        for (size_t j = 0; j < pCurrent->childrenList[i].childrenCount; ++j) {
-            pCurrent->childrenList[i].childrenList[j].parent
-                                                = pCurrent->childrenList + i;
+    out[len] = END_STR;
+    len = strlen(out);
+    if (len + 1 != cap) {
+        char *fit = jsonRealloc(a, out, cap, len + 1);
+        if (!fit) {
+            jsonFree(a, out, cap);
+            return JsonErrorFile;
         }
+        out = fit;
     }
-    pCurrent->_childrenReserve = childrenReserve;
-    return true;
+    *text = out;
+    return JsonSuccess;
 }
+#endif
 
-bool removeChild(JsonItem *pChild) {
-    size_t ind = indexOfChild(pChild);
-    if (ind == SIZE_MAX) {
-        return false;
+/*!
+ * \brief Читает текст файла, gzip распаковывается (JSONC_WITH_ZLIB).
+ * \param file - файл, позиция в начале.
+ * \param fileLen - размер файла.
+ * \param a - аллокатор текста.
+ * \param text - выходной текст с нулевым символом.
+ * \return JsonSuccess или JsonErrorFile.
+ */
+static JsonErrorEnum readFileText(FILE *file, int64_t fileLen, const JsonAllocator *a,
+                                  char **text) {
+    unsigned char magic[sizeof(ZSTD_MAGIC)];
+    const size_t magicLen = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    if (magicLen >= sizeof(GZIP_MAGIC) && memcmp(magic, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+#ifdef JSONC_WITH_ZLIB
+        return readGzipText(file, fileLen, a, text);
+#else
+        return JsonErrorFile;
+#endif
     }
-    freeJsonItemChild(pChild);
-    JsonItem *parent = pChild->parent;
-    for (size_t i = ind; i < parent->childrenCount - 1; ++i) {
-        parent->childrenList[i] = parent->childrenList[i + 1];
+    if (magicLen == sizeof(ZSTD_MAGIC) && memcmp(magic, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+        return JsonErrorFile;
     }
-    --parent->childrenCount;
-    initJsonItem(parent->childrenList + parent->childrenCount);
-    return true;
+    const size_t lSize = (size_t)fileLen + 1;    // +1 для нулевого символа
+
+    char *buffer = (char*)jsonAlloc(a, sizeof(char) * lSize);
+    if (buffer == NULL) {
+        return JsonErrorFile;
+    }
+
+    size_t result = fread(buffer, 1, lSize - 1, file);
+    buffer[result] = 0; // добавления нулевого символа
+    *text = buffer;
+    return JsonSuccess;
 }
 
-JsonItem *addChild(JsonItem *pCurrent) {
-    if (pCurrent->type != JsonTypeArray
-            && pCurrent->type != JsonTypeObject) {
-        return NULL;
+JsonCStruct openJsonFromFileOpt(const char *fileName, const JsonParseOptions *options) {
+    JsonCStruct r;
+    initJsonCStruct(&r);
+    const JsonAllocator *a = options && options->allocator ?
+                options->allocator : jsonCurrentAllocator();
+    FILE *ptrFile = fopen(fileName, "rb");
+    if (ptrFile == NULL) {
+        r.error = JsonErrorFile;
+        return r;
     }
-    if (pCurrent->_childrenReserve == pCurrent->childrenCount) {
-        if (pCurrent->_childrenReserve == 0) {
-            reserveChildCount(pCurrent, 1);
-        } else {
-            reserveChildCount(pCurrent, pCurrent->childrenCount * 2);
-        }
+    const int64_t fileLen = fileSize(ptrFile);
+    if (fileLen < 0 || (uint64_t)fileLen >= SIZE_MAX) {
+        fclose(ptrFile);
+        r.error = JsonErrorFile;
+        return r;
     }
-    JsonItem *child = &pCurrent->childrenList[pCurrent->childrenCount];
-    initJsonItem(child);
-    ++(pCurrent->childrenCount);
-    child->parent = pCurrent;
-    return child;
+    char *buffer = NULL;
+    r.error = readFileText(ptrFile, fileLen, a, &buffer);
+    fclose(ptrFile);
+    if (r.error != JsonSuccess) {
+        return r;
+    }
+    return openJsonFromStrOpt(buffer, options);
 }
 
-JsonItem *addChildType(JsonItem *pCurrent, JsonTypeEnum type) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = type;
-    return r;
-}
+// Batch
 
-JsonItem *addChildKeyType(JsonItem *pCurrent, const char *key, JsonTypeEnum type) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = type;
-    r->key = key;
-    r->keyLen = strlen(key);
-    return r;
-}
+#ifdef JSONC_NO_THREADS
+typedef size_t BatchCounter;
+#define BATCH_FETCH_ADD(counter) ((counter)++)
+#else
+typedef atomic_size_t BatchCounter;
+#define BATCH_FETCH_ADD(counter) \
+    atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+#endif
 
-JsonItem *addChildKeyLenType(JsonItem *pCurrent, const char *key, size_t keyLen, JsonTypeEnum type) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = type;
-    r->key = key;
-    r->keyLen = keyLen;
-    return r;
+/*!
+ * \brief Общее состояние openJsonFromFilesOpt().
+ */
+typedef struct {
+    const char * const *paths;
+    JsonCStruct *results;
+    size_t count;
+    JsonParseOptions options;
+    /// Индекс следующего файла: потоки берут работу по одному файлу.
+    BatchCounter next;
+    /// Количество успешно разобранных файлов.
+    BatchCounter parsed;
+} BatchContext;
+
+static void batchRun(BatchContext *ctx) {
+    for (;;) {
+        const size_t i = BATCH_FETCH_ADD(ctx->next);
+        if (i >= ctx->count) {
+            return;
+        }
+        ctx->results[i] = openJsonFromFileOpt(ctx->paths[i], &ctx->options);
+        if (ctx->results[i].error == JsonSuccess) {
+            BATCH_FETCH_ADD(ctx->parsed);
+        }
+    }
 }
 
-JsonItem *addChildBool(JsonItem *pCurrent, bool boolValue) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeBool;
-    r->number = boolValue;
-    return r;
+#ifndef JSONC_NO_THREADS
+static void *batchThread(void *arg) {
+    batchRun(arg);
+    return NULL;
 }
+#endif
 
-JsonItem *addChildKeyBool(JsonItem *pCurrent, const char *key, bool boolValue) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeBool;
-    r->key = key;
-    r->keyLen = strlen(key);
-    r->number = boolValue;
-    return r;
+size_t openJsonFromFiles(const char * const *paths, size_t count,
+                         JsonCStruct *results, size_t threads) {
+    return openJsonFromFilesOpt(paths, count, results, threads, NULL);
 }
 
-JsonItem *addChildKeyLenBool(JsonItem *pCurrent, const char *key, size_t keyLen, bool boolValue) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeBool;
-    r->key = key;
-    r->keyLen = keyLen;
-    r->number = boolValue;
+size_t openJsonFromFilesOpt(const char * const *paths, size_t count,
+                            JsonCStruct *results, size_t threads,
+                            const JsonParseOptions *options) {
+    if (!paths || !results) {
+        return 0;
+    }
+    BatchContext ctx;
+    ctx.paths = paths;
+    ctx.results = results;
+    ctx.count = count;
+    ctx.options.allocator = options && options->allocator ?
+                options->allocator : jsonCurrentAllocator();
+    ctx.options.stats = NULL;
+    ctx.options.packNumberArrays = options && options->packNumberArrays;
+    // Таблица интернирования не потокобезопасна.
+    ctx.options.internTable = NULL;
+    ctx.options.maxDepth = options ? options->maxDepth : 0;
+    ctx.next = 0;
+    ctx.parsed = 0;
+#ifndef JSONC_NO_THREADS
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (threads > count) {
+        threads = count;
+    }
+    // Вызывающий поток тоже разбирает файлы.
+    const size_t workers = threads > 1 ? threads - 1 : 0;
+    const JsonAllocator *a = jsonCurrentAllocator();
+    pthread_t *ids = workers ? jsonAlloc(a, workers * sizeof(pthread_t)) : NULL;
+    size_t started = 0;
+    while (ids && started < workers
+           && pthread_create(ids + started, NULL, batchThread, &ctx) == 0) {
+        ++started;
+    }
+    batchRun(&ctx);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    jsonFree(a, ids, workers * sizeof(pthread_t));
+#else
+    (void)threads;
+    batchRun(&ctx);
+#endif
+    return ctx.parsed;
+}
+
+// JsonParser
+
+/// Выравнивание блоков арены.
+static const size_t ARENA_ALIGN = 16;
+/// Размер арены по умолчанию.
+static const size_t ARENA_DEFAULT_SIZE = 64 * 1024;
+
+/*!
+ * \brief Блок памяти арены, данные идут сразу после заголовка.
+ */
+typedef struct ArenaBlockTypeDef {
+    struct ArenaBlockTypeDef *next;
+    size_t size;
+} ArenaBlock;
+
+struct JsonParserTypeDef {
+    /// Аллокатор поверх арены, его получают деревья парсера.
+    JsonAllocator allocator;
+    /// Аллокатор, из которого берутся блоки арены.
+    JsonAllocator backing;
+    /// Текущий блок, остальные блоки связаны через next.
+    ArenaBlock *block;
+    /// Занято в текущем блоке.
+    size_t used;
+    /// Суммарный размер всех блоков.
+    size_t totalSize;
+    /// Последнее выделение, его можно расширить или вернуть на месте.
+    char *last;
+    /// Арена в регионе вызывающего (openJsonFromStrRegion()), не растет.
+    bool fixed;
+    /// В фиксированной арене не хватило места.
+    bool exhausted;
+};
+
+static inline size_t arenaAlignUp(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static inline char *arenaBlockData(ArenaBlock *block) {
+    return (char*)block + arenaAlignUp(sizeof(ArenaBlock));
+}
+
+/*!
+ * \brief Добавляет в арену новый блок не меньше minSize.
+ */
+static bool arenaGrow(JsonParser *parser, size_t minSize) {
+    if (parser->fixed) {
+        parser->exhausted = true;
+        return false;
+    }
+    size_t size = parser->block ? parser->block->size * 2 : ARENA_DEFAULT_SIZE;
+    if (size < minSize) {
+        size = minSize;
+    }
+    ArenaBlock *block = jsonAlloc(&parser->backing,
+                                  arenaAlignUp(sizeof(ArenaBlock)) + size);
+    if (!block) {
+        return false;
+    }
+    block->next = parser->block;
+    block->size = size;
+    parser->block = block;
+    parser->used = 0;
+    parser->totalSize += size;
+    return true;
+}
+
+static void *arenaAlloc(void *ctx, size_t size) {
+    JsonParser *parser = ctx;
+    size = arenaAlignUp(size);
+    if (!parser->block || parser->block->size - parser->used < size) {
+        if (!arenaGrow(parser, size)) {
+            return NULL;
+        }
+    }
+    char *r = arenaBlockData(parser->block) + parser->used;
+    parser->used += size;
+    parser->last = r;
+    return r;
+}
+
+static void *arenaRealloc(void *ctx, void *ptr, size_t oldSize, size_t newSize) {
+    JsonParser *parser = ctx;
+    if (ptr && ptr == parser->last) {
+        // Последнее выделение растет на месте.
+        const size_t start = parser->last - arenaBlockData(parser->block);
+        if (parser->block->size - start >= arenaAlignUp(newSize)) {
+            parser->used = start + arenaAlignUp(newSize);
+            return ptr;
+        }
+    }
+    void *r = arenaAlloc(ctx, newSize);
+    if (r && ptr) {
+        memcpy(r, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+    return r;
+}
+
+static void arenaFree(void *ctx, void *ptr, size_t size) {
+    (void)size;
+    JsonParser *parser = ctx;
+    if (ptr && ptr == parser->last) {
+        // Последнее выделение возвращается, остальные живут до сброса.
+        parser->used = parser->last - arenaBlockData(parser->block);
+        parser->last = NULL;
+    }
+}
+
+JsonParser *createJsonParser(size_t capacity) {
+    const JsonAllocator *backing = jsonCurrentAllocator();
+    JsonParser *parser = jsonAlloc(backing, sizeof(JsonParser));
+    if (!parser) {
+        return NULL;
+    }
+    parser->allocator.alloc = arenaAlloc;
+    parser->allocator.realloc = arenaRealloc;
+    parser->allocator.free = arenaFree;
+    parser->allocator.ctx = parser;
+    parser->backing = *backing;
+    parser->block = NULL;
+    parser->used = 0;
+    parser->totalSize = 0;
+    parser->last = NULL;
+    parser->fixed = false;
+    parser->exhausted = false;
+    if (!arenaGrow(parser, capacity ? capacity : ARENA_DEFAULT_SIZE)) {
+        jsonFree(backing, parser, sizeof(JsonParser));
+        return NULL;
+    }
+    return parser;
+}
+
+void resetJsonParser(JsonParser *parser) {
+    if (!parser) {
+        return;
+    }
+    if (parser->block && parser->block->next) {
+        // Прошлый документ не поместился в один блок: блоки заменяются
+        // одним общего размера, дальше сброс снова O(1).
+        const size_t totalSize = parser->totalSize;
+        while (parser->block) {
+            ArenaBlock *next = parser->block->next;
+            jsonFree(&parser->backing, parser->block,
+                     arenaAlignUp(sizeof(ArenaBlock)) + parser->block->size);
+            parser->block = next;
+        }
+        parser->totalSize = 0;
+        arenaGrow(parser, totalSize);
+    }
+    parser->used = 0;
+    parser->last = NULL;
+}
+
+void freeJsonParser(JsonParser *parser) {
+    if (!parser) {
+        return;
+    }
+    while (parser->block) {
+        ArenaBlock *next = parser->block->next;
+        jsonFree(&parser->backing, parser->block,
+                 arenaAlignUp(sizeof(ArenaBlock)) + parser->block->size);
+        parser->block = next;
+    }
+    JsonAllocator backing = parser->backing;
+    jsonFree(&backing, parser, sizeof(JsonParser));
+}
+
+JsonCStruct openJsonFromStrParser(JsonParser *parser, const char *jsonTextFull) {
+    resetJsonParser(parser);
+    JsonParseOptions options = { &parser->allocator, NULL, false, NULL, 0 };
+    return openJsonFromStrOpt(jsonTextFull, &options);
+}
+
+/// Вложенность по умолчанию для openJsonFromStrRegion().
+#define REGION_MAX_DEPTH 1024
+
+/*!
+ * \brief Размер заголовка региона: JsonParser и заголовок блока арены.
+ */
+static inline size_t regionHeaderSize(void) {
+    return arenaAlignUp(sizeof(JsonParser)) + arenaAlignUp(sizeof(ArenaBlock));
+}
+
+/*!
+ * \brief Параметры разбора в регион: без внешней памяти и с ограниченной
+ * вложенностью.
+ *
+ * Массивы не упаковываются: буфер чисел растет перевыделением, а дерево
+ * региона только читается.
+ */
+static JsonParseOptions regionOptions(const JsonParseOptions *options,
+                                      const JsonAllocator *allocator) {
+    JsonParseOptions r = { allocator, NULL, false, NULL, REGION_MAX_DEPTH };
+    if (options) {
+        r.stats = options->stats;
+        if (options->maxDepth) {
+            r.maxDepth = options->maxDepth;
+        }
+    }
+    return r;
+}
+
+JsonCStruct openJsonFromStrRegion(void *region, size_t size, const char *jsonTextFull,
+                                  const JsonParseOptions *options) {
+    JsonCStruct r;
+    initJsonCStruct(&r);
+    if (!region) {
+        return r;
+    }
+    // Заголовок и блок арены - в начале региона, выровненном вверх.
+    const size_t pad = (ARENA_ALIGN - (uintptr_t)region % ARENA_ALIGN) % ARENA_ALIGN;
+    if (size < pad || size - pad < regionHeaderSize()) {
+        r.error = JsonErrorCapacity;
+        return r;
+    }
+    JsonParser *parser = (JsonParser*)((char*)region + pad);
+    parser->allocator.alloc = arenaAlloc;
+    parser->allocator.realloc = arenaRealloc;
+    parser->allocator.free = arenaFree;
+    parser->allocator.ctx = parser;
+    parser->backing = DEFAULT_ALLOCATOR;
+    parser->block = (ArenaBlock*)((char*)parser + arenaAlignUp(sizeof(JsonParser)));
+    parser->block->next = NULL;
+    parser->block->size = (size - pad - regionHeaderSize()) & ~(ARENA_ALIGN - 1);
+    parser->used = 0;
+    parser->totalSize = parser->block->size;
+    parser->last = NULL;
+    parser->fixed = true;
+    parser->exhausted = false;
+    JsonParseOptions opt = regionOptions(options, &parser->allocator);
+    r = openJsonFromStrOpt(jsonTextFull, &opt);
+    if (r.error != JsonSuccess && parser->exhausted) {
+        r.error = JsonErrorCapacity;
+    }
+    return r;
+}
+
+/*!
+ * \brief Аллокатор-счетчик для jsonRegionSize().
+ *
+ * Память берется у обычного аллокатора, а смещения повторяют арену
+ * фиксированного региона без ограничения размера: used, last и пик.
+ */
+typedef struct {
+    const JsonAllocator *backing;
+    size_t used;
+    size_t peak;
+    /// Последнее выделение и его смещение в воображаемом регионе.
+    void *last;
+    size_t lastStart;
+} RegionMeasure;
+
+static void regionMeasureBump(RegionMeasure *m, void *ptr, size_t start, size_t size) {
+    m->used = start + arenaAlignUp(size);
+    if (m->used > m->peak) {
+        m->peak = m->used;
+    }
+    m->last = ptr;
+    m->lastStart = start;
+}
+
+static void *regionMeasureAlloc(void *ctx, size_t size) {
+    RegionMeasure *m = ctx;
+    void *r = jsonAlloc(m->backing, size ? size : 1);
+    if (r) {
+        regionMeasureBump(m, r, m->used, size);
+    }
     return r;
 }
 
-JsonItem *addChildNumber(JsonItem *pCurrent, double number) {
-    JsonItem *r = addChild(pCurrent);
-    if (!r) {
-        return r;
+static void *regionMeasureRealloc(void *ctx, void *ptr, size_t oldSize, size_t newSize) {
+    RegionMeasure *m = ctx;
+    const bool isLast = ptr && ptr == m->last;
+    const size_t start = isLast ? m->lastStart : m->used;
+    void *r = jsonRealloc(m->backing, ptr, oldSize, newSize ? newSize : 1);
+    if (r) {
+        if (isLast || !ptr) {
+            regionMeasureBump(m, r, start, newSize);
+        } else {
+            // В арене не последнее выделение копируется в новое место.
+            regionMeasureBump(m, r, m->used, newSize);
+        }
+    }
+    return r;
+}
+
+static void regionMeasureFree(void *ctx, void *ptr, size_t size) {
+    RegionMeasure *m = ctx;
+    if (ptr && ptr == m->last) {
+        m->used = m->lastStart;
+        m->last = NULL;
+    }
+    jsonFree(m->backing, ptr, size);
+}
+
+size_t jsonRegionSize(const char *jsonTextFull, const JsonParseOptions *options) {
+    RegionMeasure m = { jsonCurrentAllocator(), 0, 0, NULL, 0 };
+    const JsonAllocator measure = {
+        regionMeasureAlloc, regionMeasureRealloc, regionMeasureFree, &m
+    };
+    JsonParseOptions opt = regionOptions(options, &measure);
+    JsonCStruct r = openJsonFromStrOpt(jsonTextFull, &opt);
+    const bool ok = r.error == JsonSuccess;
+    freeJsonCStruct(r);
+    return ok ? regionHeaderSize() + m.peak : SIZE_MAX;
+}
+
+// Validate
+
+/// Максимальная вложенность для jsonValidate().
+#define VALIDATE_MAX_DEPTH 1024
+
+/*!
+ * \brief Пропуск пробелов и комментариев в ограниченном буфере.
+ * \return первый значащий символ или end.
+ */
+static inline const char *validateSkip(const char *p, const char *end) {
+    if (p < end && (unsigned char)*p > ' ' && *p != '/') {
+        return p;
+    }
+    while (p < end) {
+        const char ch = *p;
+        if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r') {
+            ++p;
+        } else if (ch == '/' && p + 1 < end && p[1] == '/') {
+            const char *nl = memchr(p + 2, '\n', end - p - 2);
+            if (!nl) {
+                return end;
+            }
+            p = nl + 1;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/*!
+ * \brief Находит закрывающую кавычку строки, как parseString().
+ * \param p - открывающая кавычка.
+ * \return закрывающая кавычка или NULL.
+ */
+static inline const char *validateString(const char *p, const char *end) {
+    for (const char *it = p + 1; it < end; ++it) {
+        if (*it == '"') {
+            return it;
+        } else if (*it == '\\') {
+            ++it; // Пропуск следующего символа
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * \brief Проверяет число по грамматике myAtof().
+ * \return символ после числа или NULL.
+ */
+static inline const char *validateNumber(const char *p, const char *end) {
+    const char *it = p + 1;
+    bool isNum = isNumeric(*p);
+    while (it < end && isNumeric(*it)) {
+        isNum = true;
+        ++it;
+    }
+    if (it < end && *it == '.') {
+        ++it;
+        while (it < end && isNumeric(*it)) {
+            isNum = true;
+            ++it;
+        }
+    }
+    if (!isNum) {
+        return NULL;
+    }
+    if (it < end && (*it == 'e' || *it == 'E')) {
+        const char *e = it + 1;
+        if (e < end && isPlusMinus(*e)) {
+            ++e;
+        }
+        if (e < end && isNumeric(*e)) {
+            while (e < end && isNumeric(*e)) {
+                ++e;
+            }
+            it = e;
+        }
+    }
+    return it;
+}
+
+/*!
+ * \brief Проверяет ключевое слово в ограниченном буфере.
+ */
+static inline bool validateWord(const char *p, const char *end, const char *word, size_t wordLen) {
+    return (size_t)(end - p) >= wordLen && memcmp(p, word, wordLen) == 0;
+}
+
+/*!
+ * \brief Проверяет одно значение (с вложенными) в ограниченном буфере.
+ * \param pos - начало значения (значащий символ); на выходе - символ после
+ * значения и пробелов за ним, при ошибке - позиция ошибки.
+ * \param end - конец текста.
+ * \param err - выходная ошибка.
+ * \return true, если значение корректно.
+ */
+static bool validateValue(const char **pos, const char *end, JsonErrorEnum *err) {
+    // Стек вложенности: бит 1 - объект, 0 - массив.
+    uint64_t stack[VALIDATE_MAX_DEPTH / 64];
+    size_t depth = 0;
+    const char *p = *pos;
+    const char *q = NULL;
+    if (p == end) {
+        *err = JsonErrorEnd;
+        goto error;
+    }
+value:
+    switch (*p) {
+    case '{':
+    case '[': {
+        const bool isObject = *p == '{';
+        if (depth == VALIDATE_MAX_DEPTH) {
+            *err = JsonErrorDepth;
+            goto error;
+        }
+        if (isObject) {
+            stack[depth / 64] |= (uint64_t)1 << (depth % 64);
+        } else {
+            stack[depth / 64] &= ~((uint64_t)1 << (depth % 64));
+        }
+        ++depth;
+        p = validateSkip(p + 1, end);
+        if (p == end) {
+            *err = JsonErrorEnd;
+            goto error;
+        }
+        if (*p == (isObject ? '}' : ']')) {
+            --depth;
+            ++p;
+            goto afterValue;
+        }
+        if (isObject) {
+            goto key;
+        }
+        goto value;
+    }
+    case '"':
+        if (!(q = validateString(p, end))) {
+            *err = JsonErrorValue;
+            goto error;
+        }
+        p = q + 1;
+        goto afterValue;
+    case 'n':
+    case 't':
+    case 'f':
+        if (validateWord(p, end, NULL_STR, NULL_STR_LEN)) {
+            p += NULL_STR_LEN;
+        } else if (validateWord(p, end, TRUE_STR, TRUE_STR_LEN)) {
+            p += TRUE_STR_LEN;
+        } else if (validateWord(p, end, FALSE_STR, FALSE_STR_LEN)) {
+            p += FALSE_STR_LEN;
+        } else {
+            *err = JsonErrorValue;
+            goto error;
+        }
+        goto afterValue;
+    default:
+        if (!isNumericPlusMinus(*p) || !(q = validateNumber(p, end))) {
+            *err = JsonErrorValue;
+            goto error;
+        }
+        p = q;
+        goto afterValue;
+    }
+afterValue:
+    p = validateSkip(p, end);
+    if (depth == 0) {
+        *pos = p;
+        return true;
+    }
+    if (p == end) {
+        *err = JsonErrorSyntax;
+        goto error;
+    }
+    {
+        const bool isObject = (stack[(depth - 1) / 64] >> ((depth - 1) % 64)) & 1;
+        if (*p == (isObject ? '}' : ']')) {
+            --depth;
+            ++p;
+            goto afterValue;
+        }
+        if (*p != ',') {
+            *err = JsonErrorSyntax;
+            goto error;
+        }
+        p = validateSkip(p + 1, end);
+        if (p == end) {
+            *err = JsonErrorEnd;
+            goto error;
+        }
+        if (!isObject) {
+            goto value;
+        }
+    }
+key:
+    if (*p != '"') {
+        *err = JsonErrorSyntax;
+        goto error;
+    }
+    if (!(q = validateString(p, end))) {
+        *err = JsonErrorKey;
+        goto error;
+    }
+    p = validateSkip(q + 1, end);
+    if (p == end) {
+        *err = JsonErrorEnd;
+        goto error;
+    }
+    if (*p != ':') {
+        *err = JsonErrorSyntax;
+        goto error;
+    }
+    p = validateSkip(p + 1, end);
+    if (p == end) {
+        *err = JsonErrorEnd;
+        goto error;
+    }
+    goto value;
+error:
+    *pos = p;
+    return false;
+}
+
+/*!
+ * \brief Заполняет errorInfo (если задан) ошибкой err в позиции p.
+ */
+static void setErrorInfo(JsonErrorInfo *errorInfo, JsonErrorEnum err, const char *buf, const char *p) {
+    if (!errorInfo) {
+        return;
+    }
+    errorInfo->error = err;
+    if (err == JsonSuccess) {
+        errorInfo->offset = 0;
+        errorInfo->line = 0;
+        errorInfo->column = 0;
+    } else {
+        errorInfo->offset = p - buf;
+        textPosition(buf, p, &errorInfo->line, &errorInfo->column);
+    }
+}
+
+bool jsonValidate(const char *buf, size_t len, JsonErrorInfo *errorInfo) {
+    // Как и openJsonFromStr(), текст заканчивается на первом нулевом символе.
+    const char *nul = memchr(buf, END_STR, len);
+    const char * const end = nul ? nul : buf + len;
+    JsonErrorEnum err = JsonSuccess;
+    const char *p = validateSkip(buf, end);
+    if (validateValue(&p, end, &err) && p != end) {
+        err = JsonErrorSyntax;
+    }
+    setErrorInfo(errorInfo, err, buf, p);
+    return err == JsonSuccess;
+}
+
+// Numeric arrays
+
+/*!
+ * \brief Тип выходного буфера jsonArrayTo*().
+ */
+typedef enum {
+    NumberDouble,
+    NumberFloat,
+    NumberInt32,
+    NumberInt64
+} NumberKind;
+
+/*!
+ * \brief Проверяет число и записывает его в out[index], если index < n.
+ * \return false, если число не представимо в типе kind.
+ */
+static inline bool storeNumber(void *out, size_t index, size_t n, double number, NumberKind kind) {
+    switch (kind) {
+    case NumberDouble:
+        if (index < n) {
+            ((double*)out)[index] = number;
+        }
+        return true;
+    case NumberFloat:
+        if (index < n) {
+            ((float*)out)[index] = (float)number;
+        }
+        return true;
+    case NumberInt32:
+        if (!(number >= INT32_MIN && number <= INT32_MAX)
+                || number != (double)(int32_t)number) {
+            return false;
+        }
+        if (index < n) {
+            ((int32_t*)out)[index] = (int32_t)number;
+        }
+        return true;
+    case NumberInt64:
+        // 2^63 точно представимо в double, INT64_MAX - нет.
+        if (!(number >= -9223372036854775808.0 && number < 9223372036854775808.0)
+                || number != (double)(int64_t)number) {
+            return false;
+        }
+        if (index < n) {
+            ((int64_t*)out)[index] = (int64_t)number;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*!
+ * \brief Общая часть jsonArrayTo*().
+ *
+ * Вызывается с константным kind, поэтому switch в storeNumber()
+ * сворачивается компилятором.
+ */
+static inline size_t arrayToNumbers(const JsonItem *item, void *out, size_t n, NumberKind kind) {
+    if (!item || item->type != JsonTypeArray) {
+        return SIZE_MAX;
+    }
+    if (item->_flags & ITEM_PACKED) {
+        const double *numbers = packedNumbers(item);
+        if (kind == NumberDouble) {
+            memcpy(out, numbers, (n < item->childrenCount ? n : item->childrenCount) * sizeof(double));
+            return item->childrenCount;
+        }
+        for (size_t i = 0; i < item->childrenCount; ++i) {
+            if (!storeNumber(out, i, n, numbers[i], kind)) {
+                return SIZE_MAX;
+            }
+        }
+        return item->childrenCount;
+    }
+    const bool hasTombstones = item->_flags & ITEM_HAS_TOMBSTONES;
+    size_t count = 0;
+    if (!(item->_flags & ITEM_CHUNKED) && !hasTombstones) {
+        const JsonItem *it = item->childrenList;
+        for (; count < item->childrenCount; ++count, ++it) {
+            if (it->type != JsonTypeNumber || !storeNumber(out, count, n, it->number, kind)) {
+                return SIZE_MAX;
+            }
+        }
+        return count;
+    }
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        const JsonItem *child = childAt(item, i);
+        if (hasTombstones && isTombstone(child)) {
+            continue;
+        }
+        if (child->type != JsonTypeNumber || !storeNumber(out, count, n, child->number, kind)) {
+            return SIZE_MAX;
+        }
+        ++count;
+    }
+    return count;
+}
+
+size_t jsonArrayToDoubles(const JsonItem *item, double *out, size_t n) {
+    return arrayToNumbers(item, out, n, NumberDouble);
+}
+
+size_t jsonArrayToFloats(const JsonItem *item, float *out, size_t n) {
+    return arrayToNumbers(item, out, n, NumberFloat);
+}
+
+size_t jsonArrayToInt32(const JsonItem *item, int32_t *out, size_t n) {
+    return arrayToNumbers(item, out, n, NumberInt32);
+}
+
+size_t jsonArrayToInt64(const JsonItem *item, int64_t *out, size_t n) {
+    return arrayToNumbers(item, out, n, NumberInt64);
+}
+
+bool isArrayPacked(const JsonItem *item) {
+    return item && (item->_flags & ITEM_PACKED);
+}
+
+bool getArrayNumberAt(const JsonItem *item, size_t index, double *number) {
+    if (!item || !number || item->type != JsonTypeArray || index >= item->childrenCount) {
+        return false;
+    }
+    if (item->_flags & ITEM_PACKED) {
+        *number = packedNumbers(item)[index];
+        return true;
+    }
+    const JsonItem *child = childAt(item, index);
+    if (isTombstone(child) || child->type != JsonTypeNumber) {
+        return false;
+    }
+    *number = child->number;
+    return true;
+}
+
+bool unpackNumberArray(JsonItem *item) {
+    return item && unpackChildren(jsonCurrentAllocator(), item);
+}
+
+size_t parseJsonDoubles(const char *buf, size_t len, double *out, size_t n, JsonErrorInfo *errorInfo) {
+    const char *nul = memchr(buf, END_STR, len);
+    const char * const end = nul ? nul : buf + len;
+    JsonErrorEnum err = JsonSuccess;
+    size_t count = 0;
+    const char *p = validateSkip(buf, end);
+    const char *q = NULL;
+    if (p == end) {
+        err = JsonErrorEnd;
+        goto error;
+    }
+    if (*p != '[') {
+        err = JsonErrorValue;
+        goto error;
+    }
+    p = validateSkip(p + 1, end);
+    if (p < end && *p == ']') {
+        ++p;
+        goto done;
+    }
+    for (;;) {
+        if (p == end) {
+            err = JsonErrorEnd;
+            goto error;
+        }
+        if (!isNumericPlusMinus(*p) || !(q = validateNumber(p, end))) {
+            err = JsonErrorValue;
+            goto error;
+        }
+        if (count < n && !textToDouble(jsonCurrentAllocator(), p, q - p, out + count)) {
+            err = JsonErrorUnknow;
+            goto error;
+        }
+        ++count;
+        p = validateSkip(q, end);
+        if (p == end) {
+            err = JsonErrorSyntax;
+            goto error;
+        }
+        if (*p == ']') {
+            ++p;
+            goto done;
+        }
+        if (*p != ',') {
+            err = JsonErrorSyntax;
+            goto error;
+        }
+        p = validateSkip(p + 1, end);
+    }
+done:
+    p = validateSkip(p, end);
+    if (p != end) {
+        err = JsonErrorSyntax;
+        goto error;
+    }
+    if (errorInfo) {
+        errorInfo->error = JsonSuccess;
+        errorInfo->offset = 0;
+        errorInfo->line = 0;
+        errorInfo->column = 0;
+    }
+    return count;
+error:
+    if (errorInfo) {
+        errorInfo->error = err;
+        errorInfo->offset = p - buf;
+        textPosition(buf, p, &errorInfo->line, &errorInfo->column);
+    }
+    return SIZE_MAX;
+}
+
+int64_t saveJsonCStruct(const char *fileName, JsonCStruct jStruct) {
+    FILE *ptrFile = fopen(fileName, "w");
+    if (ptrFile == NULL) {
+        return -1;
+    }
+    int64_t res = fprintJsonItem(ptrFile, jStruct.rootItem);
+    fclose(ptrFile);
+
+    return res;
+}
+
+/*!
+ * \brief Аллокатор, которым было создано дерево jStruct.
+ */
+static const JsonAllocator *structAllocator(const JsonCStruct *jStruct) {
+    return jStruct->allocator ? jStruct->allocator : jsonCurrentAllocator();
+}
+
+/*!
+ * \brief Освобождает корневой элемент и потомков указанным аллокатором.
+ */
+static bool freeJsonParentAlloc(const JsonAllocator *a, JsonItem *item) {
+    if (!item || item->parent) {
+        return false;
+    }
+    freeJsonItemChild(a, item);
+    jsonFree(a, item, sizeof(JsonItem));
+    return true;
+}
+
+void freeJsonCStruct(JsonCStruct jStruct) {
+    freeJsonParentAlloc(structAllocator(&jStruct), jStruct.rootItem);
+}
+
+void freeJsonCStructFull(JsonCStruct jStruct) {
+    freeJsonCStruct(jStruct);
+    if (jStruct.jsonTextFull) {
+        jsonFree(structAllocator(&jStruct), (void*)jStruct.jsonTextFull,
+                 strlen(jStruct.jsonTextFull) + 1);
+    }
+}
+
+JsonItem *createJsonParent(void) {
+    JsonItem *jIt = (JsonItem*)jsonAlloc(jsonCurrentAllocator(), sizeof(JsonItem));
+    if (!jIt) {
+        return NULL;
+    }
+    initJsonItem(jIt);
+    jIt->type = JsonTypeObject;
+    return jIt;
+}
+
+bool freeJsonParent(JsonItem *item) {
+    return freeJsonParentAlloc(jsonCurrentAllocator(), item);
+}
+
+bool freeJsonItemFull(JsonItem *item) {
+    if (!item || item->parent) {
+        return false;
+    }
+    const JsonAllocator *a = jsonCurrentAllocator();
+    freeJsonItemChildFull(a, item);
+    jsonFree(a, (void*)item->key, 0);
+    if (!(item->_flags & ITEM_HAS_SPAN) || item->type == JsonTypeString) {
+        jsonFree(a, (void*)item->str, 0);
+    }
+    jsonFree(a, item, sizeof(JsonItem));
+    return true;
+}
+
+JsonItem *findChildKey(const JsonItem *root, const char *key) {
+    return findChildKeyLen(root, key, strlen(key));
+}
+
+JsonItem *findChildKeyLen(const JsonItem *root, const char *key, size_t keyLen) {
+    if (!root || root->type != JsonTypeObject) {
+        return NULL;
+    }
+    if (root->_flags & ITEM_FROZEN) {
+        // Первый потомок с ключом не меньше key.
+        size_t lo = 0;
+        size_t hi = root->childrenCount;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            const JsonItem *child = childAt(root, mid);
+            if (compareKeys(child->key, child->keyLen, key, keyLen) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < root->childrenCount; ++lo) {
+            JsonItem *child = childAt(root, lo);
+            if (child->keyLen != keyLen
+                    || (child->key != key && memcmp(child->key, key, keyLen) != 0)) {
+                break;
+            }
+            if (!isTombstone(child)) {
+                return child;
+            }
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < root->childrenCount; ++i) {
+        JsonItem *child = childAt(root, i);
+        // Интернированные ключи совпадают по указателю.
+        if (child->keyLen == keyLen
+                && (child->key == key || myStrcmp(key, child->key, keyLen))
+                && !isTombstone(child)) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+JsonItem *findChildIndex(JsonItem *root, size_t index) {
+    if (index == INIT_LEN
+            || root->type != JsonTypeArray
+            || root->childrenCount <= index
+            || (root->_flags & ITEM_PACKED)) {
+        return NULL;
+    }
+    JsonItem *child = childAt(root, index);
+    return isTombstone(child) ? NULL : child;
+}
+
+JsonItem *getChildAt(const JsonItem *root, size_t index) {
+    if (!root || index >= root->childrenCount || (root->_flags & ITEM_PACKED)) {
+        return NULL;
+    }
+    JsonItem *child = childAt(root, index);
+    return isTombstone(child) ? NULL : child;
+}
+
+size_t indexOfChild(JsonItem* pChild) {
+    JsonItem *parent = pChild->parent;
+    if (!parent
+            || (parent->type != JsonTypeArray
+                && parent->type != JsonTypeObject)) {
+        return SIZE_MAX;
+    }
+    if (parent->_flags & ITEM_CHUNKED) {
+        const size_t chunkCount = parent->_childrenReserve / CHUNK_SIZE;
+        for (size_t i = 0; i < chunkCount; ++i) {
+            const JsonItem *chunk = chunkDir(parent)[i];
+            if (pChild >= chunk && pChild < chunk + CHUNK_SIZE) {
+                const size_t index = i * CHUNK_SIZE + (pChild - chunk);
+                return index < parent->childrenCount ? index : SIZE_MAX;
+            }
+        }
+        return SIZE_MAX;
+    }
+    if (pChild < parent->childrenList
+            || pChild >= parent->childrenList + parent->childrenCount) {
+        return SIZE_MAX;
+    }
+    return pChild - parent->childrenList;
+}
+
+/*!
+ * \brief reserveChildCount() для блочного режима.
+ *
+ * Добавляет или освобождает целые блоки, потомки не перемещаются.
+ */
+static bool reserveChunks(const JsonAllocator *a, JsonItem *pCurrent, size_t childrenReserve) {
+    const size_t oldChunks = pCurrent->_childrenReserve / CHUNK_SIZE;
+    const size_t newChunks = (childrenReserve + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const size_t oldCapacity = chunkDirCapacity(oldChunks);
+    const size_t newCapacity = chunkDirCapacity(newChunks);
+    for (size_t i = newChunks; i < oldChunks; ++i) {
+        jsonFree(a, chunkDir(pCurrent)[i], CHUNK_SIZE * sizeof(JsonItem));
+    }
+    if (newCapacity != oldCapacity) {
+        JsonItem **dir = NULL;
+        if (newCapacity) {
+            dir = jsonRealloc(a, chunkDir(pCurrent),
+                              oldCapacity * sizeof(JsonItem*),
+                              newCapacity * sizeof(JsonItem*));
+            if (!dir) {
+                return false;
+            }
+        } else {
+            jsonFree(a, chunkDir(pCurrent), oldCapacity * sizeof(JsonItem*));
+        }
+        pCurrent->childrenList = (JsonItem*)dir;
+    }
+    for (size_t i = oldChunks; i < newChunks; ++i) {
+        JsonItem *chunk = jsonAlloc(a, CHUNK_SIZE * sizeof(JsonItem));
+        if (!chunk) {
+            pCurrent->_childrenReserve = i * CHUNK_SIZE;
+            return false;
+        }
+        chunkDir(pCurrent)[i] = chunk;
+    }
+    pCurrent->_childrenReserve = newChunks * CHUNK_SIZE;
+    return true;
+}
+
+/*!
+ * \brief reserveChildCount() с указанным аллокатором.
+ */
+static bool reserveChildCountAlloc(const JsonAllocator *a, JsonItem *pCurrent, size_t childrenReserve) {
+    if (!pCurrent
+            || (pCurrent->type != JsonTypeArray
+                && pCurrent->type != JsonTypeObject)) {
+        return false;
+    }
+    if (!unpackChildren(a, pCurrent)) {
+        return false;
+    }
+    childrenReserve = childrenReserve >= pCurrent->childrenCount ?
+                                childrenReserve : pCurrent->childrenCount;
+    if (childrenReserve == pCurrent->_childrenReserve) {
+        return true;
+    }
+    if (pCurrent->_flags & ITEM_CHUNKED) {
+        return reserveChunks(a, pCurrent, childrenReserve);
+    }
+    if (childrenReserve == 0) {
+        jsonFree(a, pCurrent->childrenList,
+                 pCurrent->_childrenReserve * sizeof(JsonItem));
+        pCurrent->childrenList = NULL;
+        pCurrent->_childrenReserve = 0;
+        return true;
+    }
+    void *newList = jsonRealloc(a, pCurrent->childrenList,
+                                pCurrent->_childrenReserve * sizeof(JsonItem),
+                                childrenReserve * sizeof(JsonItem));
+    if (!newList) {
+        return false;
+    }
+    if (newList != pCurrent->childrenList) {
+        pCurrent->childrenList = newList;
+        for (size_t i = 0; i < pCurrent->childrenCount; ++i) {
+            fixChildrenParent(pCurrent->childrenList + i);
+        }
+    }
+    pCurrent->_childrenReserve = childrenReserve;
+    return true;
+}
+
+bool reserveChildCount(JsonItem *pCurrent, size_t childrenReserve) {
+    return reserveChildCountAlloc(jsonCurrentAllocator(), pCurrent, childrenReserve);
+}
+
+bool setChildrenChunked(JsonItem *pCurrent) {
+    if (!pCurrent
+            || (pCurrent->type != JsonTypeArray
+                && pCurrent->type != JsonTypeObject)) {
+        return false;
+    }
+    if (pCurrent->_flags & ITEM_CHUNKED) {
+        return true;
+    }
+    const JsonAllocator *a = jsonCurrentAllocator();
+    if (!unpackChildren(a, pCurrent)) {
+        return false;
+    }
+    JsonItem old = *pCurrent;
+    pCurrent->childrenList = NULL;
+    pCurrent->_childrenReserve = 0;
+    pCurrent->_flags |= ITEM_CHUNKED;
+    if (!reserveChunks(a, pCurrent, old.childrenCount)) {
+        freeChildrenStorage(a, pCurrent);
+        *pCurrent = old;
+        return false;
+    }
+    // Единственное перемещение потомков: перенос в блоки.
+    for (size_t i = 0; i < old.childrenCount; ++i) {
+        JsonItem *child = childAt(pCurrent, i);
+        *child = old.childrenList[i];
+        fixChildrenParent(child);
+    }
+    freeChildrenStorage(a, &old);
+    return true;
+}
+
+bool isChildrenChunked(const JsonItem *item) {
+    return item && (item->_flags & ITEM_CHUNKED);
+}
+
+/*!
+ * \brief Сдвигает живых потомков к началу, начиная с индекса from.
+ *
+ * Один проход: каждый перемещенный потомок копируется один раз, и его
+ * потомкам один раз исправляется parent. Помеченные удаленными должны быть
+ * уже освобождены.
+ * \param parent - родитель.
+ * \param from - первый индекс, где может быть удаленный потомок.
+ * \return количество убранных потомков.
+ */
+static size_t compactChildrenFrom(JsonItem *parent, size_t from) {
+    size_t w = from;
+    for (size_t r = from; r < parent->childrenCount; ++r) {
+        JsonItem *child = childAt(parent, r);
+        if (isTombstone(child)) {
+            continue;
+        }
+        if (w != r) {
+            JsonItem *dst = childAt(parent, w);
+            *dst = *child;
+            fixChildrenParent(dst);
+        }
+        ++w;
+    }
+    const size_t removed = parent->childrenCount - w;
+    for (size_t i = w; i < parent->childrenCount; ++i) {
+        initJsonItem(childAt(parent, i));
+    }
+    parent->childrenCount = w;
+    parent->_flags &= ~ITEM_HAS_TOMBSTONES;
+    return removed;
+}
+
+/*!
+ * \brief Освобождает потомков pChild и помечает его удаленным.
+ */
+static void tombstoneChild(const JsonAllocator *a, JsonItem *pChild) {
+    markItemDirty(pChild->parent);
+    freeJsonItemChild(a, pChild);
+    freeOwnedKey(a, pChild);
+    pChild->childrenList = NULL;
+    pChild->childrenCount = 0;
+    pChild->_childrenReserve = 0;
+    // Признаки владения key и str нужны freeJsonItemChildFull().
+    pChild->_flags = ITEM_TOMBSTONE
+            | (pChild->_flags & (ITEM_KEY_INTERNED | ITEM_STR_INTERNED | ITEM_HAS_SPAN));
+    pChild->parent->_flags |= ITEM_HAS_TOMBSTONES;
+}
+
+bool removeChild(JsonItem *pChild) {
+    size_t ind = indexOfChild(pChild);
+    if (ind == SIZE_MAX || isTombstone(pChild)) {
+        return false;
+    }
+    JsonItem *parent = pChild->parent;
+    const bool hadTombstones = parent->_flags & ITEM_HAS_TOMBSTONES;
+    tombstoneChild(jsonCurrentAllocator(), pChild);
+    compactChildrenFrom(parent, ind);
+    if (hadTombstones) {
+        // Помеченные раньше ind остаются до compactChildren().
+        parent->_flags |= ITEM_HAS_TOMBSTONES;
+    }
+    return true;
+}
+
+size_t removeChildrenIf(JsonItem *parent, JsonChildPredicate predicate, void *ctx) {
+    const JsonAllocator *a = jsonCurrentAllocator();
+    if (!parent || !predicate || !unpackChildren(a, parent)) {
+        return 0;
+    }
+    size_t removed = 0;
+    for (size_t i = 0; i < parent->childrenCount; ++i) {
+        JsonItem *child = childAt(parent, i);
+        if (!isTombstone(child) && predicate(child, i, ctx)) {
+            tombstoneChild(a, child);
+            ++removed;
+        }
+    }
+    compactChildren(parent);
+    return removed;
+}
+
+size_t removeChildrenIndexes(JsonItem *parent, const size_t *indexes, size_t count) {
+    const JsonAllocator *a = jsonCurrentAllocator();
+    if (!parent || !indexes || !unpackChildren(a, parent)) {
+        return 0;
+    }
+    size_t removed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (indexes[i] < parent->childrenCount) {
+            JsonItem *child = childAt(parent, indexes[i]);
+            if (!isTombstone(child)) {
+                tombstoneChild(a, child);
+                ++removed;
+            }
+        }
+    }
+    compactChildren(parent);
+    return removed;
+}
+
+bool markChildRemoved(JsonItem *pChild) {
+    if (!pChild || isTombstone(pChild) || indexOfChild(pChild) == SIZE_MAX) {
+        return false;
+    }
+    tombstoneChild(jsonCurrentAllocator(), pChild);
+    return true;
+}
+
+size_t compactChildren(JsonItem *parent) {
+    if (!parent || !(parent->_flags & ITEM_HAS_TOMBSTONES)) {
+        return 0;
+    }
+    return compactChildrenFrom(parent, 0);
+}
+
+static JsonItem *addChildAlloc(const JsonAllocator *a, JsonItem *pCurrent) {
+    if ((pCurrent->type != JsonTypeArray
+            && pCurrent->type != JsonTypeObject)
+            || !unpackChildren(a, pCurrent)) {
+        return NULL;
+    }
+    if (pCurrent->_childrenReserve == pCurrent->childrenCount) {
+        // В блочном режиме добавляется один блок, без копирования.
+        const size_t newReserve = pCurrent->_flags & ITEM_CHUNKED ?
+                    pCurrent->childrenCount + CHUNK_SIZE :
+                    pCurrent->_childrenReserve == 0 ?
+                    1 : pCurrent->childrenCount * 2;
+        if (!reserveChildCountAlloc(a, pCurrent, newReserve)) {
+            return NULL;
+        }
+    }
+    JsonItem *child = childAt(pCurrent, pCurrent->childrenCount);
+    initJsonItem(child);
+    ++(pCurrent->childrenCount);
+    // Новый ключ добавляется в конец, порядок больше не гарантирован.
+    pCurrent->_flags &= ~ITEM_FROZEN;
+    child->parent = pCurrent;
+    return child;
+}
+
+JsonItem *addChild(JsonItem *pCurrent) {
+    JsonItem *r = addChildAlloc(jsonCurrentAllocator(), pCurrent);
+    if (r) {
+        markItemDirty(pCurrent);
+    }
+    return r;
+}
+
+/*!
+ * \brief Добавляет потомка с ключом и строкой.
+ *
+ * Если задана таблица потока (jsonSetThreadInternTable()), ключ и короткая
+ * строка заменяются ее копиями.
+ * \param key - ключ, NULL - без ключа.
+ * \param str - строка, NULL - тип не задается.
+ * \return потомок или NULL, если не хватило памяти.
+ */
+static JsonItem *addChildInterned(JsonItem *pCurrent, const char *key, size_t keyLen,
+                                  const char *str, size_t strLen) {
+    JsonInternTable *table = threadInternTable;
+    uint32_t flags = 0;
+    if (table && key) {
+        key = jsonIntern(table, key, keyLen);
+        if (!key) {
+            return NULL;
+        }
+        flags |= ITEM_KEY_INTERNED;
+    }
+    if (table && str && strLen <= table->strMaxLen) {
+        str = jsonIntern(table, str, strLen);
+        if (!str) {
+            return NULL;
+        }
+        flags |= ITEM_STR_INTERNED;
+    }
+    JsonItem *r = addChild(pCurrent);
+    if (!r) {
+        return NULL;
+    }
+    r->_flags |= flags;
+    if (key) {
+        r->key = key;
+        r->keyLen = keyLen;
+    }
+    if (str) {
+        r->type = JsonTypeString;
+        r->str = str;
+        r->strLen = strLen;
+    }
+    return r;
+}
+
+JsonItem *addChildType(JsonItem *pCurrent, JsonTypeEnum type) {
+    JsonItem *r = addChild(pCurrent);
+    r->type = type;
+    return r;
+}
+
+JsonItem *addChildKeyType(JsonItem *pCurrent, const char *key, JsonTypeEnum type) {
+    return addChildKeyLenType(pCurrent, key, strlen(key), type);
+}
+
+JsonItem *addChildKeyLenType(JsonItem *pCurrent, const char *key, size_t keyLen, JsonTypeEnum type) {
+    JsonItem *r = addChildInterned(pCurrent, key, keyLen, NULL, 0);
+    if (!r) {
+        return r;
+    }
+    r->type = type;
+    return r;
+}
+
+JsonItem *addChildBool(JsonItem *pCurrent, bool boolValue) {
+    JsonItem *r = addChild(pCurrent);
+    r->type = JsonTypeBool;
+    r->number = boolValue;
+    return r;
+}
+
+JsonItem *addChildKeyBool(JsonItem *pCurrent, const char *key, bool boolValue) {
+    return addChildKeyLenBool(pCurrent, key, strlen(key), boolValue);
+}
+
+JsonItem *addChildKeyLenBool(JsonItem *pCurrent, const char *key, size_t keyLen, bool boolValue) {
+    JsonItem *r = addChildInterned(pCurrent, key, keyLen, NULL, 0);
+    if (!r) {
+        return r;
+    }
+    r->type = JsonTypeBool;
+    r->number = boolValue;
+    return r;
+}
+
+JsonItem *addChildNumber(JsonItem *pCurrent, double number) {
+    JsonItem *r = addChild(pCurrent);
+    if (!r) {
+        return r;
+    }
+    r->type = JsonTypeNumber;
+    r->number = number;
+    return r;
+}
+
+JsonItem *addChildKeyNumber(JsonItem *pCurrent, const char *key, double number) {
+    return addChildKeyLenNumber(pCurrent, key, strlen(key), number);
+}
+
+JsonItem *addChildKeyLenNumber(JsonItem *pCurrent, const char *key, size_t keyLen, double number) {
+    JsonItem *r = addChildInterned(pCurrent, key, keyLen, NULL, 0);
+    if (!r) {
+        return r;
+    }
+    r->type = JsonTypeNumber;
+    r->number = number;
+    return r;
+}
+
+JsonItem *addChildStr(JsonItem *pCurrent, const char *str) {
+    return addChildInterned(pCurrent, NULL, 0, str, strlen(str));
+}
+
+JsonItem *addChildStrLen(JsonItem *pCurrent, const char *str, size_t strLen) {
+    return addChildInterned(pCurrent, NULL, 0, str, strLen);
+}
+
+JsonItem *addChildKeyStr(JsonItem *pCurrent, const char *key, const char *str) {
+    return addChildInterned(pCurrent, key, strlen(key), str, strlen(str));
+}
+
+JsonItem *addChildKeyStrLen(JsonItem *pCurrent, const char *key, const char *str, size_t strLen) {
+    return addChildInterned(pCurrent, key, strlen(key), str, strLen);
+}
+
+JsonItem *addChildKeyLenStr(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str) {
+    return addChildInterned(pCurrent, key, keyLen, str, strlen(str));
+}
+
+JsonItem *addChildKeyLenStrLen(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str, size_t strLen) {
+    return addChildInterned(pCurrent, key, keyLen, str, strLen);
+}
+
+void markItemDirty(JsonItem *item) {
+    if (!item) {
+        return;
+    }
+    item->_flags = (item->_flags | ITEM_DIRTY) & ~ITEM_HASHED;
+    // Уже измененные предки пропускаются, только если кеша хеша у них нет.
+    for (item = item->parent;
+            item && (item->_flags & (ITEM_DIRTY | ITEM_HASHED)) != ITEM_DIRTY;
+            item = item->parent) {
+        item->_flags = (item->_flags | ITEM_DIRTY) & ~ITEM_HASHED;
+    }
+}
+
+bool isItemDirty(const JsonItem *item) {
+    return item && (item->_flags & ITEM_DIRTY);
+}
+
+void clearItemDirty(JsonItem *root) {
+    if (!root || !(root->_flags & ITEM_DIRTY)) {
+        return;
+    }
+    root->_flags &= ~ITEM_DIRTY;
+    for (size_t i = 0; !(root->_flags & ITEM_PACKED) && i < root->childrenCount; ++i) {
+        clearItemDirty(childAt(root, i));
+    }
+}
+
+/*!
+ * \brief Готовит элемент к смене значения: освобождает потомков.
+ */
+static void resetItemValue(JsonItem *item, JsonTypeEnum type) {
+    freeJsonItemChild(jsonCurrentAllocator(), item);
+    item->childrenList = NULL;
+    item->childrenCount = 0;
+    item->_childrenReserve = 0;
+    item->_flags &= ~(ITEM_CHUNKED | ITEM_PACKED | ITEM_FROZEN | ITEM_HAS_TOMBSTONES | ITEM_HAS_SPAN
+                      | ITEM_STR_INTERNED);
+    item->type = type;
+    item->str = NULL;
+    item->strLen = INIT_LEN;
+    markItemDirty(item);
+}
+
+void setItemNull(JsonItem *item) {
+    resetItemValue(item, JsonTypeNull);
+}
+
+void setItemBool(JsonItem *item, bool boolValue) {
+    resetItemValue(item, JsonTypeBool);
+    item->number = boolValue;
+}
+
+void setItemNumber(JsonItem *item, double number) {
+    resetItemValue(item, JsonTypeNumber);
+    item->number = number;
+}
+
+void setItemStr(JsonItem *item, const char *str) {
+    setItemStrLen(item, str, strlen(str));
+}
+
+void setItemStrLen(JsonItem *item, const char *str, size_t strLen) {
+    resetItemValue(item, JsonTypeString);
+    JsonInternTable *table = threadInternTable;
+    if (table && strLen <= table->strMaxLen) {
+        const char *interned = jsonIntern(table, str, strLen);
+        if (interned) {
+            str = interned;
+            item->_flags |= ITEM_STR_INTERNED;
+        }
+    }
+    item->str = str;
+    item->strLen = strLen;
+}
+
+// Output
+
+/*!
+ * \brief Записывает число кратчайшей строкой, которая читается обратно без
+ * потерь.
+ *
+ * NaN и бесконечности в JSON не представимы и записываются как null.
+ * \param buf - буфер не меньше 32 символов.
+ * \param number - число.
+ * \return длина строки.
+ */
+static int formatNumber(char *buf, double number) {
+    if (number != number || number - number != 0) {
+        memcpy(buf, NULL_STR, NULL_STR_LEN + 1);
+        return (int)NULL_STR_LEN;
+    }
+    // Диапазон проверяется до приведения: вне int64 оно не определено.
+    if (fabs(number) < 1e15 && number == (double)(int64_t)number) {
+        return snprintf(buf, 32, "%lld", (long long)number);
+    }
+    int n = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        n = snprintf(buf, 32, "%.*g", precision, number);
+        if (strtod(buf, NULL) == number) {
+            break;
+        }
+    }
+    return n;
+}
+
+/// Размер буфера потокового вывода.
+#define SINK_BUFFER_SIZE 16384
+
+/*!
+ * \brief Буфер потокового вывода: копит мелкие записи и отдает приемнику
+ * кусками до SINK_BUFFER_SIZE.
+ */
+typedef struct {
+    JsonSink sink;
+    size_t len;
+    /// Всего записано байт.
+    int64_t total;
+    /// Приемник вернул ошибку, дальнейшие записи игнорируются.
+    bool failed;
+    char data[SINK_BUFFER_SIZE];
+} SinkBuffer;
+
+static void initSinkBuffer(SinkBuffer *b, JsonSink sink) {
+    b->sink = sink;
+    b->len = 0;
+    b->total = 0;
+    b->failed = false;
+}
+
+static void sinkFlush(SinkBuffer *b) {
+    if (!b->failed && b->len && !b->sink.write(b->sink.ctx, b->data, b->len)) {
+        b->failed = true;
+    }
+    b->len = 0;
+}
+
+static void sinkAppend(SinkBuffer *b, const char *data, size_t len) {
+    if (b->failed) {
+        return;
+    }
+    b->total += (int64_t)len;
+    if (len > SINK_BUFFER_SIZE - b->len) {
+        sinkFlush(b);
+        if (len >= SINK_BUFFER_SIZE) {
+            // Большие фрагменты (длинные строки) пишутся без копирования.
+            if (!b->failed && !b->sink.write(b->sink.ctx, data, len)) {
+                b->failed = true;
+            }
+            return;
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void sinkAppendNumber(SinkBuffer *b, double number) {
+    char buf[32];
+    const int n = formatNumber(buf, number);
+    sinkAppend(b, buf, (size_t)n);
+}
+
+static void sinkIndent(SinkBuffer *b, uint32_t offset) {
+    for (uint32_t i = 0; i < offset; ++i) {
+        sinkAppend(b, "    ", 4);
+    }
+}
+
+/*!
+ * \brief Сбрасывает буфер приемнику.
+ * \return количество записанных байт или -1 при ошибке.
+ */
+static int64_t sinkFinish(SinkBuffer *b) {
+    sinkFlush(b);
+    return b->failed ? -1 : b->total;
+}
+
+static bool fileSinkWrite(void *ctx, const char *data, size_t len) {
+    return fwrite(data, 1, len, (FILE*)ctx) == len;
+}
+
+static bool fdSinkWrite(void *ctx, const char *data, size_t len) {
+    const int fd = (int)(intptr_t)ctx;
+    while (len) {
+#ifdef _WIN32
+        const int n = _write(fd, data, len > INT32_MAX ? INT32_MAX : (unsigned)len);
+#else
+        const ssize_t n = write(fd, data, len);
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+JsonSink jsonFileSink(FILE *file) {
+    JsonSink r = { fileSinkWrite, file };
+    return r;
+}
+
+JsonSink jsonFdSink(int fd) {
+    JsonSink r = { fdSinkWrite, (void*)(intptr_t)fd };
+    return r;
+}
+
+static bool printItem(SinkBuffer *out, const JsonItem *item, uint32_t offset,
+                      bool pretty, bool incremental);
+static bool printValue(SinkBuffer *out, const JsonItem *item, uint32_t offset,
+                       bool pretty, bool incremental);
+
+/*!
+ * \brief Пропускает пробелы и комментарии "//" исходного текста до end.
+ */
+static const char *skipTrivia(const char *it, const char *end) {
+    while (it < end) {
+        if (*it == ' ' || *it == '\n' || *it == '\t' || *it == '\r') {
+            ++it;
+        } else if (*it == '/' && it + 1 < end && it[1] == '/') {
+            const char *eol = memchr(it, '\n', end - it);
+            it = eol ? eol + 1 : end;
+        } else {
+            break;
+        }
+    }
+    return it;
+}
+
+/*!
+ * \brief Разбирает исходный текст между соседними потомками контейнера.
+ *
+ * В тексте могут остаться удаленные потомки, тогда копировать можно только
+ * пробелы и комментарии после последней запятой.
+ * \param begin - начало текста.
+ * \param end - конец текста.
+ * \param lead - выходное начало пробелов и комментариев после последней
+ * запятой (или begin без запятых), NULL, если после нее есть значения.
+ * \return количество запятых или SIZE_MAX, если в тексте есть значения.
+ */
+static size_t scanGap(const char *begin, const char *end, const char **lead) {
+    size_t commas = 0;
+    bool clean = true;
+    int depth = 0;
+    const char *it = skipTrivia(begin, end);
+    *lead = it == end ? begin : NULL;
+    while (it < end) {
+        if (*it == ',' && depth == 0) {
+            ++commas;
+            *lead = ++it;
+        } else if (*it == '"') {
+            // Строка удаленного потомка, запятые в ней не считаются.
+            for (++it; it < end && *it != '"'; ++it) {
+                it += *it == '\\';
+            }
+            ++it;
+            clean = false;
+            *lead = NULL;
+        } else {
+            depth += *it == '{' || *it == '[';
+            depth -= *it == '}' || *it == ']';
+            ++it;
+            clean = false;
+            *lead = NULL;
+        }
+        it = skipTrivia(it, end);
+    }
+    return clean ? commas : SIZE_MAX;
+}
+
+/*!
+ * \brief Находит потомка в исходном тексте контейнера.
+ *
+ * Потомок найден, если его ключ (в массиве - значение) лежит в тексте
+ * контейнера не раньше from.
+ * \param child - потомок.
+ * \param from - конец предыдущего скопированного текста.
+ * \param end - закрывающая скобка контейнера.
+ * \param begin - выходное начало потомка (кавычка ключа или значение).
+ * \param value - выходное начало значения в тексте (после ':') или NULL.
+ * \param valueEnd - выходной конец значения или NULL, если значение новое.
+ * \return false, если потомок новый.
+ */
+static bool childSourceSpan(const JsonItem *child, const char *from, const char *end,
+                            const char **begin, const char **value, const char **valueEnd) {
+    const char *span;
+    size_t spanLen;
+    const bool hasSpan = itemSpan(child, &span, &spanLen);
+    *value = NULL;
+    *valueEnd = NULL;
+    if (child->parent->type == JsonTypeObject) {
+        if (!child->key || child->key <= from || child->key + child->keyLen >= end
+                || child->key[-1] != '"' || child->key[child->keyLen] != '"') {
+            return false;
+        }
+        *begin = child->key - 1;
+        const char *colon = skipTrivia(child->key + child->keyLen + 1, end);
+        if (colon < end && *colon == ':') {
+            *value = skipTrivia(colon + 1, end);
+            if (hasSpan && span == *value && span + spanLen <= end) {
+                *valueEnd = span + spanLen;
+            }
+        }
+        return true;
+    }
+    if (!hasSpan || span < from || span + spanLen > end) {
+        return false;
+    }
+    *begin = *value = span;
+    *valueEnd = span + spanLen;
+    return true;
+}
+
+/*!
+ * \brief Записывает измененный разобранный контейнер с сохранением текста.
+ *
+ * Текст между оставшимися потомками исходного текста (запятые, пробелы,
+ * комментарии) копируется как есть, заново выводятся только новые потомки
+ * и измененные значения.
+ * \param span - фрагмент контейнера в исходном тексте.
+ * \param spanLen - длина фрагмента.
+ * \return false, если у потомка неизвестный тип.
+ */
+static bool printContainerIncremental(SinkBuffer *out, const JsonItem *item, uint32_t offset,
+                                      bool pretty, const char *span, size_t spanLen) {
+    const char *end = span + spanLen - 1;
+    // Конец последнего скопированного потомка; contiguous - сразу после него
+    // в вывод ничего не добавлено.
+    const char *prevEnd = span + 1;
+    bool contiguous = true;
+    bool first = true;
+    sinkAppend(out, span, 1);
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        const JsonItem *child = childAt(item, i);
+        if (isTombstone(child)) {
+            continue;
+        }
+        const char *begin;
+        const char *value;
+        const char *valueEnd;
+        if (childSourceSpan(child, prevEnd, end, &begin, &value, &valueEnd)) {
+            const char *lead;
+            const size_t commas = scanGap(prevEnd, begin, &lead);
+            if (contiguous && commas == (first ? 0u : 1u)) {
+                sinkAppend(out, prevEnd, begin - prevEnd);
+            } else {
+                if (!first) {
+                    sinkAppend(out, ",", 1);
+                }
+                if (lead) {
+                    sinkAppend(out, lead, begin - lead);
+                } else if (pretty) {
+                    sinkAppend(out, "\n", 1);
+                    sinkIndent(out, offset + 1);
+                }
+            }
+            if (value) {
+                sinkAppend(out, begin, value - begin);
+            } else {
+                sinkAppend(out, begin, child->keyLen + 2);
+                sinkAppend(out, ": ", pretty ? 2 : 1);
+            }
+            if (!printValue(out, child, offset + 1, pretty, true)) {
+                return false;
+            }
+            // Старое значение без фрагмента остается в тексте до следующего
+            // потомка, scanGap() его пропустит.
+            prevEnd = valueEnd ? valueEnd : value ? value : begin + child->keyLen + 2;
+            contiguous = valueEnd != NULL;
+        } else {
+            if (!first) {
+                sinkAppend(out, ",", 1);
+            }
+            if (pretty) {
+                sinkAppend(out, "\n", 1);
+            }
+            if (!printItem(out, child, offset + 1, pretty, true)) {
+                return false;
+            }
+            contiguous = false;
+        }
+        first = false;
+    }
+    const char *lead;
+    const size_t commas = scanGap(prevEnd, end, &lead);
+    if (commas != SIZE_MAX && (contiguous
+                               || (commas == 0 && memchr(prevEnd, '\n', end - prevEnd)))) {
+        sinkAppend(out, prevEnd, end - prevEnd);
+    } else if (pretty && !first) {
+        sinkAppend(out, "\n", 1);
+        sinkIndent(out, offset);
+    }
+    sinkAppend(out, end, 1);
+    return true;
+}
+
+/*!
+ * \brief Записывает значение элемента, без отступа и ключа.
+ * \param out - буфер вывода.
+ * \param item - элемент.
+ * \param offset - отступ самого элемента (для закрывающей скобки).
+ * \param pretty - с переводами строк и отступами, иначе компактно.
+ * \param incremental - неизмененные разобранные элементы копируются из
+ * исходного текста как есть.
+ * \return false, если у элемента неизвестный тип.
+ */
+static bool printValue(SinkBuffer *out, const JsonItem *item, uint32_t offset,
+                       bool pretty, bool incremental) {
+    const char *span;
+    size_t spanLen;
+    if (incremental && !(item->_flags & ITEM_DIRTY)
+            && itemSpan(item, &span, &spanLen)) {
+        sinkAppend(out, span, spanLen);
+        return true;
+    }
+    switch (item->type) {
+    case JsonTypeNull:
+        sinkAppend(out, NULL_STR, NULL_STR_LEN);
+        break;
+    case JsonTypeBool:
+        if (item->number) {
+            sinkAppend(out, TRUE_STR, TRUE_STR_LEN);
+        } else {
+            sinkAppend(out, FALSE_STR, FALSE_STR_LEN);
+        }
+        break;
+    case JsonTypeNumber:
+        sinkAppendNumber(out, item->number);
+        break;
+    case JsonTypeString:
+        sinkAppend(out, "\"", 1);
+        sinkAppend(out, item->str, item->strLen);
+        sinkAppend(out, "\"", 1);
+        break;
+    case JsonTypeObject:
+    case JsonTypeArray: {
+        if (incremental && !(item->_flags & ITEM_PACKED) && itemSpan(item, &span, &spanLen)) {
+            return printContainerIncremental(out, item, offset, pretty, span, spanLen);
+        }
+        sinkAppend(out, item->type == JsonTypeObject ? "{\n" : "[\n", pretty ? 2 : 1);
+        bool first = true;
+        JsonItem tmp;
+        for (size_t i = 0; i < item->childrenCount; ++i) {
+            const JsonItem *child = elementAt(item, i, &tmp);
+            if (isTombstone(child)) {
+                continue;
+            }
+            if (!first) {
+                sinkAppend(out, ",\n", pretty ? 2 : 1);
+            }
+            first = false;
+            if (!printItem(out, child, offset + 1, pretty, incremental)) {
+                return false;
+            }
+        }
+        if (pretty) {
+            sinkAppend(out, "\n", 1);
+            sinkIndent(out, offset);
+        }
+        sinkAppend(out, item->type == JsonTypeObject ? "}" : "]", 1);
+        break;
+    }
+    default:
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Записывает элемент с отступом и ключом (если родитель - объект).
+ * \param offset - количество отступов.
+ * \return false, если у элемента неизвестный тип.
+ */
+static bool printItem(SinkBuffer *out, const JsonItem *item, uint32_t offset,
+                      bool pretty, bool incremental) {
+    if (pretty) {
+        sinkIndent(out, offset);
+    }
+    if (item->parent && item->parent->type != JsonTypeArray) {
+        sinkAppend(out, "\"", 1);
+        sinkAppend(out, item->key, item->keyLen);
+        sinkAppend(out, "\": ", pretty ? 3 : 2);
+    }
+    return printValue(out, item, offset, pretty, incremental);
+}
+
+/*!
+ * \brief Записывает элемент в приемник через буфер на стеке.
+ */
+static int64_t printToSink(JsonSink sink, const JsonItem *item, uint32_t offset,
+                           bool pretty, bool incremental) {
+    if (!item || !sink.write) {
+        return -1;
+    }
+    SinkBuffer out;
+    initSinkBuffer(&out, sink);
+    const bool ok = printItem(&out, item, offset, pretty, incremental);
+    const int64_t r = sinkFinish(&out);
+    return ok ? r : -1;
+}
+
+int64_t writeJsonItem(JsonSink sink, const JsonItem *item, bool pretty) {
+    return printToSink(sink, item, 0, pretty, false);
+}
+
+int64_t writeJsonItemIncremental(JsonSink sink, const JsonItem *item) {
+    return printToSink(sink, item, 0, true, true);
+}
+
+int64_t fprintJsonItem(FILE *file, const JsonItem *item) {
+    return fprintJsonItemOffset(file, item, 0);
+}
+
+int64_t fprintJsonItemOffset(FILE *file, const JsonItem *item, uint32_t offset) {
+    return printToSink(jsonFileSink(file), item, offset, true, false);
+}
+
+int64_t fprintJsonItemIncremental(FILE *file, const JsonItem *item) {
+    return printToSink(jsonFileSink(file), item, 0, true, true);
+}
+
+int64_t fprintJsonStruct(FILE *file, JsonCStruct jStruct) {
+    if (jStruct.error != JsonSuccess) {
+        return 0;
+    }
+    int64_t s = fprintJsonItem(file, jStruct.rootItem);
+    if (s < 0 || fputc('\n', file) == EOF) {
+        return -1;
+    }
+    return s + 1;
+}
+
+int64_t saveJsonCStructIncremental(const char *fileName, JsonCStruct jStruct) {
+    const JsonItem *root = jStruct.rootItem;
+    if (!root) {
+        return -1;
+    }
+    FILE *ptrFile = fopen(fileName, "w");
+    if (ptrFile == NULL) {
+        return -1;
+    }
+    const char *span;
+    size_t spanLen;
+    SinkBuffer out;
+    initSinkBuffer(&out, jsonFileSink(ptrFile));
+    const bool hasSpan = jStruct.jsonTextFull && itemSpan(root, &span, &spanLen);
+    if (hasSpan) {
+        // Комментарии до и после корня сохраняются.
+        sinkAppend(&out, jStruct.jsonTextFull, span - jStruct.jsonTextFull);
+    }
+    const bool ok = printItem(&out, root, 0, true, true);
+    if (hasSpan) {
+        const char *tail = span + spanLen;
+        sinkAppend(&out, tail, strlen(tail));
+    }
+    int64_t res = sinkFinish(&out);
+    if (fclose(ptrFile) != 0 || !ok) {
+        res = -1;
+    }
+    return res;
+}
+
+int64_t saveJsonItem(const char *fileName, const JsonItem* root) {
+    FILE *ptrFile = fopen(fileName, "w");
+    if (ptrFile == NULL) {
+        return -1;
+    }
+    int64_t res = fprintJsonItem(ptrFile, root);
+
+    fclose(ptrFile);
+
+    return res;
+}
+// KeyPath
+
+const char* const INTO = "->";
+const size_t INTO_SIZE = 2;
+
+/*!
+ * \brief Инициализирует KeyItem.
+ * \param r - выходная структура.
+ */
+static void initKeyItem(KeyItem *r) {
+    r->keyStr = NULL;
+    r->keyStrLen = INIT_LEN;
+    r->child = NULL;
+    r->index = INIT_LEN;
+}
+
+/*!
+ * \brief Проверка на последовательность INTO.
+ * \param str - строка, где происходит проверка.
+ * \return NULL - если не совпало, иначе на первый символ после INTO.
+ */
+static const char* checkInto(const char *str) {
+    for (size_t i = 0; i < INTO_SIZE; ++i) {
+        if (str[i] != INTO[i]) {
+            return NULL;
+        }
+    }
+    return str + INTO_SIZE;
+}
+
+bool parseKeyPath(const char *keyPath, KeyItem **keyItem) {
+    const JsonAllocator *a = jsonCurrentAllocator();
+    KeyItem *root = jsonAlloc(a, sizeof(KeyItem));
+    if (root == NULL) { return false; }
+    initKeyItem(root);
+    const char *it = keyPath;
+    if (!(it = parseString(keyPath))) {
+        jsonFree(a, root, sizeof(KeyItem));
+        return false;
+    }
+    root->keyStr = keyPath + 1;
+    root->keyStrLen = it - root->keyStr;
+    ++it;
+    if (it[0] == END_STR) {
+        *keyItem = root;
+        return true;
+    }
+    if (it[0] == '[') {
+        int32_t t;
+        it = myAtoi(it + 1, &t);
+        root->index = t;
+        if (it[0] != ']') {
+            jsonFree(a, root, sizeof(KeyItem));
+            return false;
+        }
+        ++it;
+        if (it[0] == END_STR) {
+            *keyItem = root;
+            return true;
+        }
+    }
+    it = checkInto(it);
+    if (!it) {
+        jsonFree(a, root, sizeof(KeyItem));
+        return false;
+    }
+    if (!parseKeyPath(it, &root->child)) {
+        jsonFree(a, root, sizeof(KeyItem));
+        return false;
+    }
+    *keyItem = root;
+    return true;
+}
+
+void freeKeyItem(KeyItem *keyItem) {
+    if (!keyItem) {
+        return;
+    }
+    if (keyItem->child) {
+        freeKeyItem(keyItem->child);
+    }
+    jsonFree(jsonCurrentAllocator(), keyItem, sizeof(KeyItem));
+}
+
+JsonItem *getItem(const KeyItem *keyItem, const JsonItem *root) {
+    if (!keyItem || !root) {
+        return NULL;
+    }
+    JsonItem *child = NULL;
+    child = findChildKeyLen(root, keyItem->keyStr, keyItem->keyStrLen);
+    if (!child) {
+        return NULL;
+    }
+    if (keyItem->index != INIT_LEN) {
+        child = findChildIndex(child, keyItem->index);
+        if (!child) {
+            return NULL;
+        }
+    }
+    if (keyItem->child) {
+        child = getItem(keyItem->child, child);
+    }
+    return child;
+}
+
+
+JsonItem *getItemStr(const char *keyPath, const JsonItem *root) {
+    KeyItem *keyItem = NULL;
+    if (!parseKeyPath(keyPath, &keyItem) || !keyItem) {
+        return NULL;
+    }
+    JsonItem *resultItem = getItem(keyItem, root);
+    freeKeyItem(keyItem);
+    return resultItem;
+}
+
+bool getItemNumber(const KeyItem *keyItem, const JsonItem *root, double *number) {
+    if (!keyItem || !root || !number) {
+        return false;
+    }
+    for (; keyItem->child; keyItem = keyItem->child) {
+        KeyItem step = *keyItem;
+        step.child = NULL;
+        if (!(root = getItem(&step, root))) {
+            return false;
+        }
+    }
+    JsonItem *item = findChildKeyLen(root, keyItem->keyStr, keyItem->keyStrLen);
+    if (item && keyItem->index != INIT_LEN) {
+        if (item->_flags & ITEM_PACKED) {
+            return getArrayNumberAt(item, keyItem->index, number);
+        }
+        item = findChildIndex(item, keyItem->index);
+    }
+    if (!item || item->type != JsonTypeNumber) {
+        return false;
+    }
+    *number = item->number;
+    return true;
+}
+
+bool getItemNumberStr(const char *keyPath, const JsonItem *root, double *number) {
+    KeyItem *keyItem = NULL;
+    if (!parseKeyPath(keyPath, &keyItem) || !keyItem) {
+        return false;
+    }
+    const bool r = getItemNumber(keyItem, root, number);
+    freeKeyItem(keyItem);
+    return r;
+}
+
+// Text buffer
+
+/*!
+ * \brief Растущий буфер текста.
+ */
+typedef struct {
+    const JsonAllocator *allocator;
+    char *data;
+    size_t len;
+    size_t cap;
+    /// Была ошибка выделения памяти, дальнейшие записи игнорируются.
+    bool failed;
+} TextBuffer;
+
+static void initTextBuffer(TextBuffer *b, const JsonAllocator *a) {
+    b->allocator = a;
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+    b->failed = false;
+}
+
+static void freeTextBuffer(TextBuffer *b) {
+    jsonFree(b->allocator, b->data, b->cap);
+    initTextBuffer(b, b->allocator);
+}
+
+static void textAppend(TextBuffer *b, const char *data, size_t len) {
+    if (b->failed) {
+        return;
+    }
+    if (b->cap - b->len < len + 1) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        while (cap - b->len < len + 1) {
+            cap *= 2;
+        }
+        char *newData = jsonRealloc(b->allocator, b->data, b->cap, cap);
+        if (!newData) {
+            b->failed = true;
+            return;
+        }
+        b->data = newData;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = END_STR;
+}
+
+static void textAppendStr(TextBuffer *b, const char *str) {
+    textAppend(b, str, strlen(str));
+}
+
+static void textAppendNumber(TextBuffer *b, double number) {
+    char buf[32];
+    const int n = formatNumber(buf, number);
+    textAppend(b, buf, (size_t)n);
+}
+
+/*!
+ * \brief Забирает текст из буфера, подрезав память по длине.
+ * \param b - буфер.
+ * \param len - выходная длина текста, может быть NULL.
+ * \return текст (освобождать freeJsonText()) или NULL при ошибке.
+ */
+static char *textRelease(TextBuffer *b, size_t *len) {
+    if (b->failed) {
+        freeTextBuffer(b);
+        return NULL;
+    }
+    textAppend(b, "", 0);
+    char *r = jsonRealloc(b->allocator, b->data, b->cap, b->len + 1);
+    if (!r) {
+        r = b->data;
+    }
+    if (len) {
+        *len = b->len;
+    }
+    initTextBuffer(b, b->allocator);
+    return r;
+}
+
+/*!
+ * \brief Записывает элемент в компактном виде (без пробелов и ключа).
+ */
+static void textAppendItem(TextBuffer *b, const JsonItem *item) {
+    switch (item->type) {
+    case JsonTypeNull:
+        textAppend(b, NULL_STR, NULL_STR_LEN);
+        break;
+    case JsonTypeBool:
+        if (item->number) {
+            textAppend(b, TRUE_STR, TRUE_STR_LEN);
+        } else {
+            textAppend(b, FALSE_STR, FALSE_STR_LEN);
+        }
+        break;
+    case JsonTypeNumber:
+        textAppendNumber(b, item->number);
+        break;
+    case JsonTypeString:
+        textAppend(b, "\"", 1);
+        textAppend(b, item->str, item->strLen);
+        textAppend(b, "\"", 1);
+        break;
+    case JsonTypeObject:
+    case JsonTypeArray: {
+        textAppend(b, item->type == JsonTypeObject ? "{" : "[", 1);
+        bool first = true;
+        JsonItem tmp;
+        for (size_t i = 0; i < item->childrenCount; ++i) {
+            const JsonItem *child = elementAt(item, i, &tmp);
+            if (isTombstone(child)) {
+                continue;
+            }
+            if (!first) {
+                textAppend(b, ",", 1);
+            }
+            first = false;
+            if (item->type == JsonTypeObject) {
+                textAppend(b, "\"", 1);
+                textAppend(b, child->key, child->keyLen);
+                textAppend(b, "\":", 2);
+            }
+            textAppendItem(b, child);
+        }
+        textAppend(b, item->type == JsonTypeObject ? "}" : "]", 1);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void freeJsonText(char *text) {
+    if (text) {
+        jsonFree(jsonCurrentAllocator(), text, strlen(text) + 1);
+    }
+}
+
+// Patch
+
+/*!
+ * \brief Количество потомков без помеченных удаленными.
+ */
+static size_t liveChildrenCount(const JsonItem *item) {
+    if (!(item->_flags & ITEM_HAS_TOMBSTONES)) {
+        return item->childrenCount;
+    }
+    size_t r = 0;
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        r += !isTombstone(childAt(item, i));
+    }
+    return r;
+}
+
+/*!
+ * \brief Номер вхождения ключа потомка index среди живых потомков объекта.
+ */
+static size_t keyOccurrence(const JsonItem *obj, size_t index) {
+    const JsonItem *item = childAt(obj, index);
+    size_t n = 0;
+    for (size_t i = 0; i < index; ++i) {
+        const JsonItem *child = childAt(obj, i);
+        if (!isTombstone(child) && child->keyLen == item->keyLen
+                && memcmp(child->key, item->key, item->keyLen) == 0) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+/*!
+ * \brief Находит n-е (с 0) живое вхождение ключа в объекте.
+ */
+static const JsonItem *findChildKeyNth(const JsonItem *obj, const char *key, size_t keyLen,
+                                       size_t n) {
+    for (size_t i = 0; i < obj->childrenCount; ++i) {
+        const JsonItem *child = childAt(obj, i);
+        if (!isTombstone(child) && child->keyLen == keyLen
+                && memcmp(child->key, key, keyLen) == 0 && n-- == 0) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * \brief Сравнивает значения элементов (ключи самих a и b не сравниваются).
+ *
+ * Порядок ключей объектов не важен, строки сравниваются побайтно.
+ * Повторяющиеся ключи сопоставляются по номеру вхождения.
+ */
+static bool itemsEqual(const JsonItem *a, const JsonItem *b) {
+    if (a == b) {
+        return true;
+    }
+    if (a->type != b->type) {
+        return false;
+    }
+    if ((a->_flags & b->_flags & ITEM_HASHED) && cachedHash(a) != cachedHash(b)) {
+        return false;
+    }
+    switch (a->type) {
+    case JsonTypeNull:
+        return true;
+    case JsonTypeBool:
+        return (a->number != 0) == (b->number != 0);
+    case JsonTypeNumber:
+        return a->number == b->number;
+    case JsonTypeString:
+        return a->strLen == b->strLen && memcmp(a->str, b->str, a->strLen) == 0;
+    case JsonTypeArray: {
+        if (liveChildrenCount(a) != liveChildrenCount(b)) {
+            return false;
+        }
+        size_t j = 0;
+        JsonItem tmpA;
+        JsonItem tmpB;
+        for (size_t i = 0; i < a->childrenCount; ++i) {
+            const JsonItem *ca = elementAt(a, i, &tmpA);
+            if (isTombstone(ca)) {
+                continue;
+            }
+            const JsonItem *cb = elementAt(b, j++, &tmpB);
+            while (isTombstone(cb)) {
+                cb = elementAt(b, j++, &tmpB);
+            }
+            if (!itemsEqual(ca, cb)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case JsonTypeObject: {
+        if (liveChildrenCount(a) != liveChildrenCount(b)) {
+            return false;
+        }
+        for (size_t i = 0; i < a->childrenCount; ++i) {
+            const JsonItem *ca = childAt(a, i);
+            if (isTombstone(ca)) {
+                continue;
+            }
+            const JsonItem *cb = findChildKeyLen(b, ca->key, ca->keyLen);
+            if (cb && findChildKeyLen(a, ca->key, ca->keyLen) != ca) {
+                // Повторяющийся ключ: сравнивается вхождение с тем же номером.
+                cb = findChildKeyNth(b, ca->key, ca->keyLen, keyOccurrence(a, i));
+            }
+            if (!cb || !itemsEqual(ca, cb)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief Копирует значение src в dst (глубоко), key и parent dst не меняются.
+ *
+ * Строки и ключи не копируются, а ссылаются на текст src. Под потомков
+ * память выделяется один раз.
+ */
+static bool copyItemValue(const JsonAllocator *a, JsonItem *dst, const JsonItem *src) {
+    freeJsonItemChild(a, dst);
+    dst->childrenList = NULL;
+    dst->childrenCount = 0;
+    dst->_childrenReserve = 0;
+    dst->_flags &= ~(ITEM_CHUNKED | ITEM_PACKED | ITEM_FROZEN | ITEM_HAS_TOMBSTONES | ITEM_HAS_SPAN
+                     | ITEM_STR_INTERNED);
+    dst->_flags |= src->_flags & ITEM_STR_INTERNED;
+    if (!(src->_flags & ITEM_DIRTY)) {
+        dst->_flags |= src->_flags & ITEM_HAS_SPAN;
+    }
+    dst->type = src->type;
+    dst->number = src->number;
+    dst->str = src->str;
+    dst->strLen = src->strLen;
+    if (src->type != JsonTypeObject && src->type != JsonTypeArray) {
+        return true;
+    }
+    if (src->_flags & ITEM_PACKED) {
+        // Упакованный массив копируется одним блоком.
+        double *numbers = jsonAlloc(a, src->childrenCount * sizeof(double));
+        if (!numbers) {
+            return false;
+        }
+        memcpy(numbers, packedNumbers(src), src->childrenCount * sizeof(double));
+        dst->childrenList = (JsonItem*)numbers;
+        dst->childrenCount = src->childrenCount;
+        dst->_childrenReserve = src->childrenCount;
+        dst->_flags |= ITEM_PACKED;
+        return true;
+    }
+    if (!reserveChildCountAlloc(a, dst, liveChildrenCount(src))) {
+        return false;
+    }
+    for (size_t i = 0; i < src->childrenCount; ++i) {
+        const JsonItem *srcChild = childAt(src, i);
+        if (isTombstone(srcChild)) {
+            continue;
+        }
+        JsonItem *child = addChildAlloc(a, dst);
+        if (!copyChildKey(a, child, srcChild) || !copyItemValue(a, child, srcChild)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief Переносит значение src в dst без копирования потомков.
+ *
+ * После переноса src становится null без потомков.
+ */
+static void moveItemValue(const JsonAllocator *a, JsonItem *dst, JsonItem *src) {
+    freeJsonItemChild(a, dst);
+    const uint32_t keep = ITEM_CHUNKED | ITEM_PACKED | ITEM_FROZEN | ITEM_HAS_TOMBSTONES | ITEM_HAS_SPAN
+            | ITEM_STR_INTERNED;
+    dst->_flags = (dst->_flags & ~keep) | (src->_flags & keep);
+    dst->type = src->type;
+    dst->number = src->number;
+    dst->str = src->str;
+    dst->strLen = src->strLen;
+    dst->childrenList = src->childrenList;
+    dst->childrenCount = src->childrenCount;
+    dst->_childrenReserve = src->_childrenReserve;
+    fixChildrenParent(dst);
+    src->_flags &= ~keep;
+    src->type = JsonTypeNull;
+    src->childrenList = NULL;
+    src->childrenCount = 0;
+    src->_childrenReserve = 0;
+}
+
+/*!
+ * \brief Вставляет нового потомка на позицию index.
+ *
+ * Потомки после index сдвигаются, их внукам исправляется parent.
+ */
+static JsonItem *insertChildAt(const JsonAllocator *a, JsonItem *parent, size_t index) {
+    if (index > parent->childrenCount || !addChildAlloc(a, parent)) {
+        return NULL;
+    }
+    for (size_t i = parent->childrenCount - 1; i > index; --i) {
+        JsonItem *dst = childAt(parent, i);
+        *dst = *childAt(parent, i - 1);
+        fixChildrenParent(dst);
+    }
+    JsonItem *r = childAt(parent, index);
+    initJsonItem(r);
+    r->parent = parent;
+    return r;
+}
+
+/*!
+ * \brief Читает следующий токен JSON Pointer.
+ *
+ * Токены с экранированием "~0"/"~1" раскрываются в buf.
+ * \param it - указатель на '/' перед токеном, сдвигается на следующий '/'.
+ * \param end - конец пути.
+ * \param buf - буфер для раскрытого токена.
+ * \param bufSize - размер буфера.
+ * \param tokLen - выходная длина токена.
+ * \return токен или NULL при ошибке.
+ */
+static const char *nextPointerToken(const char **it, const char *end,
+                                    char *buf, size_t bufSize, size_t *tokLen) {
+    const char *tok = *it + 1;
+    const char *tokEnd = tok;
+    bool escaped = false;
+    while (tokEnd < end && *tokEnd != '/') {
+        escaped |= *tokEnd == '~';
+        ++tokEnd;
+    }
+    *it = tokEnd;
+    if (!escaped) {
+        *tokLen = tokEnd - tok;
+        return tok;
+    }
+    size_t n = 0;
+    for (const char *c = tok; c < tokEnd; ++c) {
+        if (n == bufSize) {
+            return NULL;
+        }
+        if (*c == '~') {
+            if (c + 1 == tokEnd || (c[1] != '0' && c[1] != '1')) {
+                return NULL;
+            }
+            buf[n++] = c[1] == '0' ? '~' : '/';
+            ++c;
+        } else {
+            buf[n++] = *c;
+        }
+    }
+    *tokLen = n;
+    return buf;
+}
+
+/*!
+ * \brief Переводит токен в индекс массива.
+ * \return индекс или SIZE_MAX, если токен не число.
+ */
+static size_t pointerIndex(const char *tok, size_t tokLen) {
+    if (tokLen == 0 || (tokLen > 1 && tok[0] == '0')) {
+        return SIZE_MAX;
+    }
+    size_t r = 0;
+    for (size_t i = 0; i < tokLen; ++i) {
+        if (!isNumeric(tok[i]) || r > (SIZE_MAX - 9) / 10) {
+            return SIZE_MAX;
+        }
+        r = r * 10 + (tok[i] - '0');
+    }
+    return r;
+}
+
+/// Максимальная длина раскрытого токена JSON Pointer.
+#define POINTER_TOKEN_MAX 256
+
+/*!
+ * \brief Находит потомка по токену, как findChildKeyLen()/findChildIndex().
+ *
+ * Применение патча меняет дерево, поэтому упакованный массив на пути
+ * распаковывается.
+ */
+static JsonItem *findChildToken(const JsonAllocator *a, JsonItem *root,
+                                const char *tok, size_t tokLen) {
+    if (root->type == JsonTypeArray) {
+        if (!unpackChildren(a, root)) {
+            return NULL;
+        }
+        return findChildIndex(root, pointerIndex(tok, tokLen));
+    }
+    return findChildKeyLen(root, tok, tokLen);
+}
+
+/*!
+ * \brief Находит элемент по JSON Pointer (RFC 6901).
+ * \param a - аллокатор дерева.
+ * \param root - корень.
+ * \param path - путь, "" - сам корень.
+ * \param pathLen - длина пути.
+ * \return элемент или NULL.
+ */
+static JsonItem *resolvePointer(const JsonAllocator *a, JsonItem *root, const char *path,
+                                size_t pathLen) {
+    const char *it = path;
+    const char *end = path + pathLen;
+    char buf[POINTER_TOKEN_MAX];
+    while (root && it < end) {
+        if (*it != '/') {
+            return NULL;
+        }
+        size_t tokLen;
+        const char *tok = nextPointerToken(&it, end, buf, sizeof(buf), &tokLen);
+        if (!tok) {
+            return NULL;
+        }
+        root = findChildToken(a, root, tok, tokLen);
+    }
+    return root;
+}
+
+/*!
+ * \brief Находит родителя по JSON Pointer и последний токен.
+ * \param a - аллокатор дерева.
+ * \param root - корень.
+ * \param path - путь, не пустой.
+ * \param pathLen - длина пути.
+ * \param buf - буфер на POINTER_TOKEN_MAX символов для токена.
+ * \param tok - выходной последний токен.
+ * \param tokLen - длина последнего токена.
+ * \return родитель (объект или массив) или NULL.
+ */
+static JsonItem *resolvePointerParent(const JsonAllocator *a, JsonItem *root, const char *path,
+                                      size_t pathLen, char *buf, const char **tok,
+                                      size_t *tokLen) {
+    if (pathLen == 0) {
+        return NULL;
+    }
+    const char *last = path + pathLen;
+    while (last > path && last[-1] != '/') {
+        --last;
+    }
+    if (last == path) {
+        return NULL;
+    }
+    --last;
+    JsonItem *parent = resolvePointer(a, root, path, last - path);
+    if (!parent || (parent->type != JsonTypeObject
+                    && parent->type != JsonTypeArray)) {
+        return NULL;
+    }
+    const char *it = last;
+    *tok = nextPointerToken(&it, path + pathLen, buf, POINTER_TOKEN_MAX, tokLen);
+    return *tok ? parent : NULL;
+}
+
+/*!
+ * \brief Сравнивает строковое значение с литералом.
+ */
+static bool strEquals(const JsonItem *item, const char *literal) {
+    const size_t len = strlen(literal);
+    return item->strLen == len && memcmp(item->str, literal, len) == 0;
+}
+
+/*!
+ * \brief Поле объекта операции патча.
+ */
+static const JsonItem *patchField(const JsonItem *op, const char *key, JsonTypeEnum type) {
+    const JsonItem *r = findChildKey(op, key);
+    return r && r->type == type ? r : NULL;
+}
+
+/*!
+ * \brief Задает ключ, раскрытый из токена пути во временный буфер.
+ *
+ * Ключ интернируется в таблицу потока (см. jsonSetThreadInternTable()), а без
+ * нее копируется в память аллокатора.
+ * \return false, если не хватило памяти.
+ */
+static bool setPatchKey(const JsonAllocator *a, JsonItem *item, const char *key, size_t keyLen) {
+    if (threadInternTable) {
+        const char *interned = jsonIntern(threadInternTable, key, keyLen);
+        if (!interned) {
+            return false;
+        }
+        item->key = interned;
+        item->keyLen = keyLen;
+        item->_flags |= ITEM_KEY_INTERNED;
+        return true;
+    }
+    return setOwnedKey(a, item, key, keyLen);
+}
+
+/*!
+ * \brief Добавляет (или заменяет) значение по пути, как операция "add".
+ * \param root - корень.
+ * \param path - путь.
+ * \param pathLen - длина пути.
+ * \param value - копируемое значение, если move == NULL.
+ * \param move - переносимое значение, если не NULL.
+ * \return результат.
+ */
+static JsonErrorEnum patchAdd(const JsonAllocator *a, JsonItem *root, const char *path,
+                              size_t pathLen, const JsonItem *value, JsonItem *move) {
+    JsonItem *target = NULL;
+    if (pathLen == 0) {
+        target = root;
+    } else {
+        char buf[POINTER_TOKEN_MAX];
+        const char *tok;
+        size_t tokLen;
+        JsonItem *parent = resolvePointerParent(a, root, path, pathLen, buf, &tok, &tokLen);
+        if (!parent) {
+            return JsonErrorPath;
+        }
+        if (parent->type == JsonTypeArray) {
+            compactChildren(parent);
+            const size_t index = tokLen == 1 && tok[0] == '-' ?
+                        parent->childrenCount : pointerIndex(tok, tokLen);
+            target = insertChildAt(a, parent, index);
+        } else if (!(target = findChildKeyLen(parent, tok, tokLen))) {
+            target = addChildAlloc(a, parent);
+            if (target && tok != buf) {
+                target->key = tok;
+                target->keyLen = tokLen;
+            } else if (target && !setPatchKey(a, target, tok, tokLen)) {
+                // Новый элемент еще пуст, его можно просто отбросить.
+                --parent->childrenCount;
+                return JsonErrorUnknow;
+            }
+        }
+        if (!target) {
+            return JsonErrorPath;
+        }
+        markItemDirty(parent);
+    }
+    if (move) {
+        moveItemValue(a, target, move);
+    } else if (!copyItemValue(a, target, value)) {
+        return JsonErrorUnknow;
+    }
+    markItemDirty(target);
+    return JsonSuccess;
+}
+
+/*!
+ * \brief Контейнер и число добавлений в него, для резервирования памяти.
+ */
+typedef struct {
+    JsonItem *container;
+    size_t depth;
+    size_t adds;
+} PatchReserve;
+
+static size_t itemDepth(const JsonItem *item) {
+    size_t r = 0;
+    for (; item->parent; item = item->parent) {
+        ++r;
+    }
+    return r;
+}
+
+static int comparePatchReserve(const void *l, const void *r) {
+    const PatchReserve *a = l;
+    const PatchReserve *b = r;
+    return a->depth < b->depth ? 1 : a->depth > b->depth ? -1 : 0;
+}
+
+/*!
+ * \brief Проверяет, что prefix - путь prefix или его предок (по токенам).
+ */
+static bool pointerPrefix(const char *prefix, size_t prefixLen, const char *path,
+                          size_t pathLen) {
+    return prefixLen <= pathLen && memcmp(prefix, path, prefixLen) == 0
+            && (prefixLen == pathLen || path[prefixLen] == '/');
+}
+
+/*!
+ * \brief Проверяет, что изменение по пути changed может повлиять на поиск path.
+ *
+ * Влияет изменение внутри path и изменение над path. Если последний токен
+ * changed - индекс массива, сдвигаются и соседи, тогда влияет изменение
+ * всего родителя.
+ */
+static bool pointerAffects(const JsonItem *changed, const char *path, size_t pathLen) {
+    size_t prefixLen = changed->strLen;
+    while (prefixLen > 0 && changed->str[prefixLen - 1] != '/') {
+        --prefixLen;
+    }
+    const char *tok = changed->str + prefixLen;
+    const size_t tokLen = changed->strLen - prefixLen;
+    if (prefixLen > 0 && ((tokLen == 1 && tok[0] == '-')
+                          || pointerIndex(tok, tokLen) != SIZE_MAX)) {
+        prefixLen -= 1;
+    } else {
+        prefixLen = changed->strLen;
+    }
+    return pointerPrefix(changed->str, prefixLen, path, pathLen)
+            || pointerPrefix(path, pathLen, changed->str, changed->strLen);
+}
+
+/*!
+ * \brief Проверяет синтаксис JSON Pointer.
+ */
+static bool pointerValid(const char *path, size_t pathLen) {
+    const char *it = path;
+    const char *end = path + pathLen;
+    char buf[POINTER_TOKEN_MAX];
+    while (it < end) {
+        size_t tokLen;
+        if (*it != '/' || !nextPointerToken(&it, end, buf, sizeof(buf), &tokLen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief Находит контейнер, куда "add" положит значение по пути path.
+ * \param path - непустой путь.
+ * \return контейнер или NULL, если путь не найден или индекс массива вне
+ * [0, размер].
+ */
+static JsonItem *patchAddParent(const JsonAllocator *a, JsonItem *root, const JsonItem *path) {
+    char buf[POINTER_TOKEN_MAX];
+    const char *tok;
+    size_t tokLen;
+    JsonItem *parent = resolvePointerParent(a, root, path->str, path->strLen,
+                                            buf, &tok, &tokLen);
+    if (parent && parent->type == JsonTypeArray && !(tokLen == 1 && tok[0] == '-')
+            && pointerIndex(tok, tokLen) > liveChildrenCount(parent)) {
+        return NULL;
+    }
+    return parent;
+}
+
+/*!
+ * \brief Проверяет операцию патча до применения всего патча.
+ *
+ * Имя, обязательные поля и синтаксис путей проверяются всегда. Поиск путей
+ * (и сравнение "test") - только если более ранние операции не меняют
+ * ничего, от чего он зависит.
+ * \param a - аллокатор дерева.
+ * \param root - корень.
+ * \param patch - массив операций.
+ * \param index - номер операции.
+ * \param parent - выходной контейнер для добавления или NULL.
+ * \return JsonSuccess, JsonErrorValue или JsonErrorPath.
+ */
+static JsonErrorEnum checkPatchOp(const JsonAllocator *a, JsonItem *root,
+                                  const JsonItem *patch, size_t index, JsonItem **parent) {
+    *parent = NULL;
+    const JsonItem *op = childAt(patch, index);
+    const JsonItem *opName = patchField(op, "op", JsonTypeString);
+    const JsonItem *path = patchField(op, "path", JsonTypeString);
+    const JsonItem *value = findChildKey(op, "value");
+    if (!opName || !path) {
+        return JsonErrorValue;
+    }
+    const bool isAdd = strEquals(opName, "add");
+    const bool isMove = strEquals(opName, "move");
+    const bool isCopy = strEquals(opName, "copy");
+    const bool isTest = strEquals(opName, "test");
+    const bool isRemove = strEquals(opName, "remove");
+    if (!isAdd && !isMove && !isCopy && !isTest && !isRemove
+            && !strEquals(opName, "replace")) {
+        return JsonErrorValue;
+    }
+    const JsonItem *from = isMove || isCopy ? patchField(op, "from", JsonTypeString) : NULL;
+    if (((isMove || isCopy) && !from) || (!isMove && !isCopy && !isRemove && !value)) {
+        return JsonErrorValue;
+    }
+    if (!pointerValid(path->str, path->strLen) || (isRemove && path->strLen == 0)
+            || (from && !pointerValid(from->str, from->strLen))) {
+        return JsonErrorPath;
+    }
+    bool pathDepends = false;
+    bool fromDepends = false;
+    for (size_t i = 0; i < index && !(pathDepends && (fromDepends || !from)); ++i) {
+        const JsonItem *prev = childAt(patch, i);
+        const JsonItem *prevName = patchField(prev, "op", JsonTypeString);
+        if (isTombstone(prev) || strEquals(prevName, "test")) {
+            continue;
+        }
+        const JsonItem *prevPath = patchField(prev, "path", JsonTypeString);
+        const JsonItem *prevFrom = strEquals(prevName, "move") ?
+                    patchField(prev, "from", JsonTypeString) : NULL;
+        pathDepends = pathDepends || pointerAffects(prevPath, path->str, path->strLen)
+                || (prevFrom && pointerAffects(prevFrom, path->str, path->strLen));
+        fromDepends = fromDepends || (from && (pointerAffects(prevPath, from->str, from->strLen)
+                || (prevFrom && pointerAffects(prevFrom, from->str, from->strLen))));
+    }
+    if (from && !fromDepends && !resolvePointer(a, root, from->str, from->strLen)) {
+        return JsonErrorPath;
+    }
+    if (isMove && pointerPrefix(from->str, from->strLen, path->str, path->strLen)) {
+        // Перенос в себя ничего не меняет, в своего потомка - ошибка.
+        return path->strLen == from->strLen ? JsonSuccess : JsonErrorPath;
+    }
+    // Удаление источника "move" сдвигает его соседей.
+    pathDepends = pathDepends || (isMove && pointerAffects(from, path->str, path->strLen));
+    if (pathDepends || (path->strLen == 0 && !isRemove && !isTest)) {
+        return JsonSuccess;
+    }
+    if (isAdd || isMove || isCopy) {
+        *parent = patchAddParent(a, root, path);
+        return *parent ? JsonSuccess : JsonErrorPath;
+    }
+    JsonItem *target = resolvePointer(a, root, path->str, path->strLen);
+    if (!target || (isRemove && !target->parent) || (isTest && !itemsEqual(target, value))) {
+        return JsonErrorPath;
+    }
+    return JsonSuccess;
+}
+
+/*!
+ * \brief Проверяет патч и резервирует память во всех контейнерах, куда он
+ * добавляет.
+ *
+ * Резервирование идет от глубоких контейнеров к корню: перевыделение
+ * родителя переносит уже расширенные списки потомков вместе с ними.
+ * \return JsonSuccess или ошибка первой неверной операции (дерево не
+ * изменено).
+ */
+static JsonErrorEnum reservePatch(const JsonAllocator *a, JsonItem *root, const JsonItem *patch) {
+    // Без памяти под список патч только проверяется.
+    PatchReserve *list = jsonAlloc(a, patch->childrenCount * sizeof(PatchReserve));
+    size_t count = 0;
+    for (size_t i = 0; i < patch->childrenCount; ++i) {
+        if (isTombstone(childAt(patch, i))) {
+            continue;
+        }
+        JsonItem *parent;
+        const JsonErrorEnum err = checkPatchOp(a, root, patch, i, &parent);
+        if (err != JsonSuccess) {
+            jsonFree(a, list, patch->childrenCount * sizeof(PatchReserve));
+            return err;
+        }
+        if (!list || !parent) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < count && list[j].container != parent) {
+            ++j;
+        }
+        if (j == count) {
+            list[count].container = parent;
+            list[count].depth = itemDepth(parent);
+            list[count].adds = 0;
+            ++count;
+        }
+        ++list[j].adds;
+    }
+    if (!list) {
+        return JsonSuccess;
+    }
+    qsort(list, count, sizeof(PatchReserve), comparePatchReserve);
+    for (size_t i = 0; i < count; ++i) {
+        JsonItem *c = list[i].container;
+        if (c->childrenCount + list[i].adds > c->_childrenReserve) {
+            reserveChildCountAlloc(a, c, c->childrenCount + list[i].adds);
+        }
+    }
+    jsonFree(a, list, patch->childrenCount * sizeof(PatchReserve));
+    return JsonSuccess;
+}
+
+JsonErrorEnum applyJsonPatch(JsonItem *root, const JsonItem *patch) {
+    if (!root || !patch || patch->type != JsonTypeArray) {
+        return JsonErrorValue;
+    }
+    if (patch->_flags & ITEM_PACKED) {
+        // Массив чисел: операции должны быть объектами.
+        return JsonErrorValue;
+    }
+    const JsonAllocator *a = jsonCurrentAllocator();
+    const JsonErrorEnum checked = reservePatch(a, root, patch);
+    if (checked != JsonSuccess) {
+        return checked;
+    }
+    for (size_t i = 0; i < patch->childrenCount; ++i) {
+        const JsonItem *op = childAt(patch, i);
+        if (isTombstone(op)) {
+            continue;
+        }
+        const JsonItem *opName = patchField(op, "op", JsonTypeString);
+        const JsonItem *path = patchField(op, "path", JsonTypeString);
+        const JsonItem *value = findChildKey(op, "value");
+        const JsonItem *from = patchField(op, "from", JsonTypeString);
+        if (!opName || !path) {
+            return JsonErrorValue;
+        }
+        JsonErrorEnum err = JsonSuccess;
+        if (strEquals(opName, "add")) {
+            err = value ? patchAdd(a, root, path->str, path->strLen, value, NULL)
+                        : JsonErrorValue;
+        } else if (strEquals(opName, "remove")) {
+            JsonItem *target = resolvePointer(a, root, path->str, path->strLen);
+            err = target && target->parent && removeChild(target) ?
+                        JsonSuccess : JsonErrorPath;
+        } else if (strEquals(opName, "replace")) {
+            JsonItem *target = resolvePointer(a, root, path->str, path->strLen);
+            if (!value) {
+                err = JsonErrorValue;
+            } else if (!target) {
+                err = JsonErrorPath;
+            } else if (!copyItemValue(a, target, value)) {
+                err = JsonErrorUnknow;
+            } else {
+                markItemDirty(target);
+            }
+        } else if (strEquals(opName, "copy") || strEquals(opName, "move")) {
+            const bool isMove = strEquals(opName, "move");
+            JsonItem *source = from ? resolvePointer(a, root, from->str, from->strLen) : NULL;
+            if (!source) {
+                err = JsonErrorPath;
+            } else if (isMove && pointerPrefix(from->str, from->strLen,
+                                               path->str, path->strLen)) {
+                // Перенос в себя или в своего потомка.
+                err = path->strLen == from->strLen ? JsonSuccess : JsonErrorPath;
+            } else if (isMove) {
+                JsonItem tmp;
+                initJsonItem(&tmp);
+                moveItemValue(a, &tmp, source);
+                removeChild(source);
+                err = patchAdd(a, root, path->str, path->strLen, NULL, &tmp);
+                freeJsonItemChild(a, &tmp);
+            } else {
+                // Копия во временный элемент: добавление может сдвинуть source.
+                JsonItem tmp;
+                initJsonItem(&tmp);
+                err = copyItemValue(a, &tmp, source) ?
+                            patchAdd(a, root, path->str, path->strLen, NULL, &tmp) :
+                            JsonErrorUnknow;
+                freeJsonItemChild(a, &tmp);
+            }
+        } else if (strEquals(opName, "test")) {
+            JsonItem *target = resolvePointer(a, root, path->str, path->strLen);
+            err = !value ? JsonErrorValue :
+                  target && itemsEqual(target, value) ? JsonSuccess : JsonErrorPath;
+        } else {
+            err = JsonErrorValue;
+        }
+        if (err != JsonSuccess) {
+            return err;
+        }
+    }
+    return JsonSuccess;
+}
+
+/*!
+ * \brief Рекурсивная часть applyJsonMergePatch().
+ */
+static bool mergePatch(const JsonAllocator *a, JsonItem *target, const JsonItem *patch) {
+    if (patch->type != JsonTypeObject) {
+        markItemDirty(target);
+        return copyItemValue(a, target, patch);
+    }
+    if (target->type != JsonTypeObject) {
+        resetItemValue(target, JsonTypeObject);
+    }
+    // Сначала удаления и подсчет новых ключей, затем одно резервирование.
+    size_t adds = 0;
+    for (size_t i = 0; i < patch->childrenCount; ++i) {
+        const JsonItem *p = childAt(patch, i);
+        if (isTombstone(p)) {
+            continue;
+        }
+        JsonItem *t = findChildKeyLen(target, p->key, p->keyLen);
+        if (p->type == JsonTypeNull) {
+            if (t) {
+                markChildRemoved(t);
+            }
+        } else if (!t) {
+            ++adds;
+        }
+    }
+    compactChildren(target);
+    if (adds && !reserveChildCountAlloc(a, target, target->childrenCount + adds)) {
+        return false;
+    }
+    for (size_t i = 0; i < patch->childrenCount; ++i) {
+        const JsonItem *p = childAt(patch, i);
+        if (isTombstone(p) || p->type == JsonTypeNull) {
+            continue;
+        }
+        JsonItem *t = findChildKeyLen(target, p->key, p->keyLen);
+        if (!t) {
+            t = addChildAlloc(a, target);
+            if (!copyChildKey(a, t, p)) {
+                return false;
+            }
+            t->type = JsonTypeNull;
+            markItemDirty(target);
+        }
+        if (!mergePatch(a, t, p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+JsonErrorEnum applyJsonMergePatch(JsonItem *root, const JsonItem *patch) {
+    if (!root || !patch) {
+        return JsonErrorValue;
+    }
+    return mergePatch(jsonCurrentAllocator(), root, patch) ?
+                JsonSuccess : JsonErrorUnknow;
+}
+
+/*!
+ * \brief Дописывает к пути токен с экранированием '~' и '/'.
+ */
+static void appendPointerToken(TextBuffer *path, const char *tok, size_t tokLen) {
+    textAppend(path, "/", 1);
+    for (size_t i = 0; i < tokLen; ++i) {
+        if (tok[i] == '~') {
+            textAppend(path, "~0", 2);
+        } else if (tok[i] == '/') {
+            textAppend(path, "~1", 2);
+        } else {
+            textAppend(path, tok + i, 1);
+        }
+    }
+}
+
+/*!
+ * \brief Записывает одну операцию патча.
+ */
+static void appendPatchOp(TextBuffer *out, bool *first, const char *op,
+                          const TextBuffer *path, const JsonItem *value) {
+    textAppendStr(out, *first ? "[" : ",");
+    *first = false;
+    textAppendStr(out, "{\"op\":\"");
+    textAppendStr(out, op);
+    textAppendStr(out, "\",\"path\":\"");
+    textAppend(out, path->data ? path->data : "", path->len);
+    textAppendStr(out, "\"");
+    if (value) {
+        textAppendStr(out, ",\"value\":");
+        textAppendItem(out, value);
+    }
+    textAppendStr(out, "}");
+}
+
+/*!
+ * \brief Рекурсивная часть createJsonPatch().
+ */
+static void diffItems(TextBuffer *out, bool *first, TextBuffer *path,
+                      const JsonItem *from, const JsonItem *to) {
+    if (from->type != to->type
+            || (from->type != JsonTypeObject && from->type != JsonTypeArray)) {
+        if (!itemsEqual(from, to)) {
+            appendPatchOp(out, first, "replace", path, to);
+        }
+        return;
+    }
+    const size_t pathLen = path->len;
+    if (from->type == JsonTypeObject) {
+        for (size_t i = 0; i < from->childrenCount; ++i) {
+            const JsonItem *f = childAt(from, i);
+            if (isTombstone(f) || findChildKeyLen(to, f->key, f->keyLen)) {
+                continue;
+            }
+            appendPointerToken(path, f->key, f->keyLen);
+            appendPatchOp(out, first, "remove", path, NULL);
+            path->len = pathLen;
+        }
+        for (size_t i = 0; i < to->childrenCount; ++i) {
+            const JsonItem *t = childAt(to, i);
+            if (isTombstone(t)) {
+                continue;
+            }
+            const JsonItem *f = findChildKeyLen(from, t->key, t->keyLen);
+            appendPointerToken(path, t->key, t->keyLen);
+            if (f) {
+                diffItems(out, first, path, f, t);
+            } else {
+                appendPatchOp(out, first, "add", path, t);
+            }
+            path->len = pathLen;
+        }
+        return;
+    }
+    // Массивы: общая часть по индексам, лишнее удаляется с конца.
+    const size_t fromCount = liveChildrenCount(from);
+    const size_t toCount = liveChildrenCount(to);
+    size_t fi = 0;
+    size_t ti = 0;
+    JsonItem tmpF;
+    JsonItem tmpT;
+    for (size_t index = 0; index < fromCount || index < toCount; ++index) {
+        const JsonItem *f = NULL;
+        const JsonItem *t = NULL;
+        while (index < fromCount && isTombstone(f = elementAt(from, fi++, &tmpF))) {}
+        while (index < toCount && isTombstone(t = elementAt(to, ti++, &tmpT))) {}
+        if (index >= fromCount) {
+            textAppendStr(path, "/-");
+            appendPatchOp(out, first, "add", path, t);
+        } else if (index < toCount) {
+            char buf[24];
+            int n = snprintf(buf, sizeof(buf), "%zu", index);
+            appendPointerToken(path, buf, (size_t)n);
+            diffItems(out, first, path, f, t);
+        }
+        path->len = pathLen;
+    }
+    for (size_t index = fromCount; index > toCount; --index) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%zu", index - 1);
+        appendPointerToken(path, buf, (size_t)n);
+        appendPatchOp(out, first, "remove", path, NULL);
+        path->len = pathLen;
+    }
+}
+
+char *createJsonPatch(const JsonItem *from, const JsonItem *to, size_t *len) {
+    if (!from || !to) {
+        return NULL;
+    }
+    const JsonAllocator *a = jsonCurrentAllocator();
+    TextBuffer out;
+    TextBuffer path;
+    initTextBuffer(&out, a);
+    initTextBuffer(&path, a);
+    bool first = true;
+    diffItems(&out, &first, &path, from, to);
+    textAppendStr(&out, first ? "[]" : "]");
+    const bool failed = path.failed;
+    freeTextBuffer(&path);
+    if (failed) {
+        freeTextBuffer(&out);
+        return NULL;
+    }
+    return textRelease(&out, len);
+}
+
+// Freeze
+
+/*!
+ * \brief Потомок и его исходная позиция, для устойчивой сортировки.
+ */
+typedef struct {
+    const JsonItem *item;
+    size_t index;
+} SortEntry;
+
+static int compareSortEntries(const void *l, const void *r) {
+    const SortEntry *a = l;
+    const SortEntry *b = r;
+    const int c = compareKeys(a->item->key, a->item->keyLen, b->item->key, b->item->keyLen);
+    return c ? c : (a->index > b->index) - (a->index < b->index);
+}
+
+/*!
+ * \brief Упорядочивает потомков объекта по ключу.
+ *
+ * Сортировка устойчивая: из одинаковых ключей первым остается тот же, что
+ * находил линейный поиск.
+ * \param item - объект.
+ * \param entries - выход: указатели на потомков по порядку ключей, массив
+ * на item->childrenCount элементов.
+ */
+static void sortEntries(const JsonItem *item, SortEntry *entries) {
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        entries[i].item = childAt(item, i);
+        entries[i].index = i;
+    }
+    qsort(entries, item->childrenCount, sizeof(SortEntry), compareSortEntries);
+}
+
+/*!
+ * \brief Сортирует потомков объекта по ключу на месте.
+ *
+ * parent у внуков исправляется один раз на перемещенного потомка.
+ */
+static bool sortChildren(const JsonAllocator *a, JsonItem *item) {
+    const size_t n = item->childrenCount;
+    size_t i = 1;
+    while (i < n && compareKeys(childAt(item, i - 1)->key, childAt(item, i - 1)->keyLen,
+                                childAt(item, i)->key, childAt(item, i)->keyLen) <= 0) {
+        ++i;
+    }
+    if (i >= n) {
+        return true;
+    }
+    SortEntry *entries = jsonAlloc(a, n * sizeof(SortEntry));
+    JsonItem *sorted = jsonAlloc(a, n * sizeof(JsonItem));
+    if (!entries || !sorted) {
+        jsonFree(a, entries, n * sizeof(SortEntry));
+        jsonFree(a, sorted, n * sizeof(JsonItem));
+        return false;
+    }
+    sortEntries(item, entries);
+    for (i = 0; i < n; ++i) {
+        sorted[i] = *entries[i].item;
+    }
+    for (i = 0; i < n; ++i) {
+        JsonItem *dst = childAt(item, i);
+        *dst = sorted[i];
+        fixChildrenParent(dst);
+    }
+    jsonFree(a, entries, n * sizeof(SortEntry));
+    jsonFree(a, sorted, n * sizeof(JsonItem));
+    markItemDirty(item);
+    return true;
+}
+
+static bool freezeItem(const JsonAllocator *a, JsonItem *item) {
+    if ((item->type != JsonTypeObject && item->type != JsonTypeArray)
+            || (item->_flags & ITEM_PACKED)) {
+        return true;
+    }
+    compactChildren(item);
+    if (item->type == JsonTypeObject) {
+        if (!sortChildren(a, item)) {
+            return false;
+        }
+        item->_flags |= ITEM_FROZEN;
+    }
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        if (!freezeItem(a, childAt(item, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool jsonFreeze(JsonItem *root) {
+    if (!root) {
+        return false;
+    }
+    return freezeItem(jsonCurrentAllocator(), root);
+}
+
+bool isItemFrozen(const JsonItem *item) {
+    return item && (item->_flags & ITEM_FROZEN);
+}
+
+/*!
+ * \brief Канонический компактный вывод: ключи по порядку jsonFreeze().
+ *
+ * Замороженные объекты выводятся как есть, остальные сортируются во
+ * временном буфере.
+ */
+static void textAppendCanonical(TextBuffer *b, const JsonItem *item) {
+    if (item->type != JsonTypeObject && item->type != JsonTypeArray) {
+        textAppendItem(b, item);
+        return;
+    }
+    const bool sorted = item->type == JsonTypeArray || (item->_flags & ITEM_FROZEN);
+    const size_t n = item->childrenCount;
+    SortEntry *entries = NULL;
+    if (!sorted && n) {
+        entries = jsonAlloc(b->allocator, n * sizeof(SortEntry));
+        if (!entries) {
+            b->failed = true;
+            return;
+        }
+        sortEntries(item, entries);
+    }
+    textAppend(b, item->type == JsonTypeObject ? "{" : "[", 1);
+    bool first = true;
+    JsonItem tmp;
+    for (size_t i = 0; i < n; ++i) {
+        const JsonItem *child = entries ? entries[i].item : elementAt(item, i, &tmp);
+        if (isTombstone(child)) {
+            continue;
+        }
+        if (!first) {
+            textAppend(b, ",", 1);
+        }
+        first = false;
+        if (item->type == JsonTypeObject) {
+            textAppend(b, "\"", 1);
+            textAppend(b, child->key, child->keyLen);
+            textAppend(b, "\":", 2);
+        }
+        textAppendCanonical(b, child);
+    }
+    textAppend(b, item->type == JsonTypeObject ? "}" : "]", 1);
+    jsonFree(b->allocator, entries, n * sizeof(SortEntry));
+}
+
+char *createJsonCanonical(const JsonItem *item, size_t *len) {
+    if (!item) {
+        return NULL;
+    }
+    TextBuffer b;
+    initTextBuffer(&b, jsonCurrentAllocator());
+    textAppendCanonical(&b, item);
+    return textRelease(&b, len);
+}
+
+// Writer
+
+/// Максимальная вложенность JsonWriter.
+#define WRITER_MAX_DEPTH 1024
+
+struct JsonWriterTypeDef {
+    /// Копия аллокатора, действовавшего при создании.
+    JsonAllocator allocator;
+    bool pretty;
+    /// Первая ошибка, после нее записи игнорируются.
+    JsonErrorEnum error;
+    /// Количество открытых объектов и массивов.
+    size_t depth;
+    /// В текущем контейнере еще нет элементов.
+    bool first;
+    /// В объекте записан ключ, ожидается значение.
+    bool hasKey;
+    /// Корневое значение записано полностью.
+    bool rootDone;
+    /// Бит 1 - объект, 0 - массив, по одному на уровень.
+    uint64_t stack[WRITER_MAX_DEPTH / 64];
+    /// Текст для createJsonWriterText(), иначе не используется.
+    TextBuffer text;
+    SinkBuffer out;
+};
+
+static bool textSinkWrite(void *ctx, const char *data, size_t len) {
+    TextBuffer *b = (TextBuffer*)ctx;
+    textAppend(b, data, len);
+    return !b->failed;
+}
+
+static JsonWriter *allocJsonWriter(bool pretty) {
+    const JsonAllocator *a = jsonCurrentAllocator();
+    JsonWriter *w = jsonAlloc(a, sizeof(JsonWriter));
+    if (!w) {
+        return NULL;
+    }
+    w->allocator = *a;
+    w->pretty = pretty;
+    w->error = JsonSuccess;
+    w->depth = 0;
+    w->first = true;
+    w->hasKey = false;
+    w->rootDone = false;
+    initTextBuffer(&w->text, &w->allocator);
+    return w;
+}
+
+JsonWriter *createJsonWriter(JsonSink sink, bool pretty) {
+    JsonWriter *w = allocJsonWriter(pretty);
+    if (w) {
+        initSinkBuffer(&w->out, sink);
+    }
+    return w;
+}
+
+JsonWriter *createJsonWriterText(bool pretty) {
+    JsonWriter *w = allocJsonWriter(pretty);
+    if (w) {
+        JsonSink sink = { textSinkWrite, &w->text };
+        initSinkBuffer(&w->out, sink);
+    }
+    return w;
+}
+
+void freeJsonWriter(JsonWriter *writer) {
+    if (!writer) {
+        return;
+    }
+    freeTextBuffer(&writer->text);
+    const JsonAllocator a = writer->allocator;
+    jsonFree(&a, writer, sizeof(JsonWriter));
+}
+
+JsonErrorEnum jsonWriterError(const JsonWriter *writer) {
+    return writer ? writer->error : JsonErrorValue;
+}
+
+static bool writerFail(JsonWriter *w, JsonErrorEnum error) {
+    if (w->error == JsonSuccess) {
+        w->error = error;
+    }
+    return false;
+}
+
+static bool writerInObject(const JsonWriter *w) {
+    const size_t level = w->depth - 1;
+    return (w->stack[level / 64] >> (level % 64)) & 1;
+}
+
+/*!
+ * \brief Проверяет, что на текущем месте допустимо значение, и пишет
+ * разделитель и отступ перед ним.
+ */
+static bool writerBeforeValue(JsonWriter *w) {
+    if (w->error != JsonSuccess) {
+        return false;
+    }
+    if (w->depth == 0) {
+        if (w->rootDone) {
+            return writerFail(w, JsonErrorSyntax);
+        }
+        return true;
+    }
+    if (writerInObject(w)) {
+        if (!w->hasKey) {
+            return writerFail(w, JsonErrorSyntax);
+        }
+        w->hasKey = false;
+        return true;
+    }
+    if (!w->first) {
+        sinkAppend(&w->out, ",\n", w->pretty ? 2 : 1);
+    }
+    w->first = false;
+    if (w->pretty) {
+        sinkIndent(&w->out, (uint32_t)w->depth);
+    }
+    return true;
+}
+
+/*!
+ * \brief Отмечает запись значения, проверяет ошибку приемника.
+ */
+static bool writerAfterValue(JsonWriter *w) {
+    if (w->depth == 0) {
+        w->rootDone = true;
+    }
+    if (w->out.failed) {
+        return writerFail(w, JsonErrorFile);
+    }
+    return true;
+}
+
+static bool writerBegin(JsonWriter *w, bool object) {
+    if (!w) {
+        return false;
+    }
+    if (!writerBeforeValue(w)) {
+        return false;
+    }
+    if (w->depth == WRITER_MAX_DEPTH) {
+        return writerFail(w, JsonErrorDepth);
+    }
+    const uint64_t bit = (uint64_t)1 << (w->depth % 64);
+    if (object) {
+        w->stack[w->depth / 64] |= bit;
+    } else {
+        w->stack[w->depth / 64] &= ~bit;
+    }
+    ++w->depth;
+    w->first = true;
+    sinkAppend(&w->out, object ? "{\n" : "[\n", w->pretty ? 2 : 1);
+    return true;
+}
+
+static bool writerEnd(JsonWriter *w, bool object) {
+    if (!w || w->error != JsonSuccess) {
+        return false;
+    }
+    if (w->depth == 0 || writerInObject(w) != object || w->hasKey) {
+        return writerFail(w, JsonErrorSyntax);
+    }
+    --w->depth;
+    w->first = false;
+    if (w->pretty) {
+        sinkAppend(&w->out, "\n", 1);
+        sinkIndent(&w->out, (uint32_t)w->depth);
+    }
+    sinkAppend(&w->out, object ? "}" : "]", 1);
+    return writerAfterValue(w);
+}
+
+bool jsonWriteBeginObject(JsonWriter *writer) {
+    return writerBegin(writer, true);
+}
+
+bool jsonWriteEndObject(JsonWriter *writer) {
+    return writerEnd(writer, true);
+}
+
+bool jsonWriteBeginArray(JsonWriter *writer) {
+    return writerBegin(writer, false);
+}
+
+bool jsonWriteEndArray(JsonWriter *writer) {
+    return writerEnd(writer, false);
+}
+
+bool jsonWriteKeyLen(JsonWriter *writer, const char *key, size_t keyLen) {
+    if (!writer || writer->error != JsonSuccess) {
+        return false;
+    }
+    if (!key) {
+        return writerFail(writer, JsonErrorValue);
+    }
+    if (writer->depth == 0 || !writerInObject(writer) || writer->hasKey) {
+        return writerFail(writer, JsonErrorSyntax);
+    }
+    if (!writer->first) {
+        sinkAppend(&writer->out, ",\n", writer->pretty ? 2 : 1);
+    }
+    writer->first = false;
+    writer->hasKey = true;
+    if (writer->pretty) {
+        sinkIndent(&writer->out, (uint32_t)writer->depth);
+    }
+    sinkAppend(&writer->out, "\"", 1);
+    sinkAppend(&writer->out, key, keyLen);
+    sinkAppend(&writer->out, "\": ", writer->pretty ? 3 : 2);
+    return true;
+}
+
+bool jsonWriteKey(JsonWriter *writer, const char *key) {
+    return jsonWriteKeyLen(writer, key, key ? strlen(key) : 0);
+}
+
+bool jsonWriteNull(JsonWriter *writer) {
+    if (!writer || !writerBeforeValue(writer)) {
+        return false;
+    }
+    sinkAppend(&writer->out, NULL_STR, NULL_STR_LEN);
+    return writerAfterValue(writer);
+}
+
+bool jsonWriteBool(JsonWriter *writer, bool value) {
+    if (!writer || !writerBeforeValue(writer)) {
+        return false;
+    }
+    if (value) {
+        sinkAppend(&writer->out, TRUE_STR, TRUE_STR_LEN);
+    } else {
+        sinkAppend(&writer->out, FALSE_STR, FALSE_STR_LEN);
+    }
+    return writerAfterValue(writer);
+}
+
+bool jsonWriteNumber(JsonWriter *writer, double value) {
+    if (!writer || !writerBeforeValue(writer)) {
+        return false;
+    }
+    sinkAppendNumber(&writer->out, value);
+    return writerAfterValue(writer);
+}
+
+bool jsonWriteStrLen(JsonWriter *writer, const char *str, size_t strLen) {
+    if (!writer) {
+        return false;
+    }
+    if (!str) {
+        return writerFail(writer, JsonErrorValue);
+    }
+    if (!writerBeforeValue(writer)) {
+        return false;
+    }
+    sinkAppend(&writer->out, "\"", 1);
+    sinkAppend(&writer->out, str, strLen);
+    sinkAppend(&writer->out, "\"", 1);
+    return writerAfterValue(writer);
+}
+
+bool jsonWriteStr(JsonWriter *writer, const char *str) {
+    return jsonWriteStrLen(writer, str, str ? strlen(str) : 0);
+}
+
+bool jsonWriteItem(JsonWriter *writer, const JsonItem *item) {
+    if (!writer) {
+        return false;
+    }
+    if (!item) {
+        return writerFail(writer, JsonErrorValue);
+    }
+    if (!writerBeforeValue(writer)) {
+        return false;
+    }
+    if (!printValue(&writer->out, item, (uint32_t)writer->depth, writer->pretty, false)) {
+        return writerFail(writer, JsonErrorValue);
+    }
+    return writerAfterValue(writer);
+}
+
+int64_t finishJsonWriter(JsonWriter *writer) {
+    if (!writer) {
+        return -1;
+    }
+    if (writer->error == JsonSuccess && (writer->depth || !writer->rootDone)) {
+        writerFail(writer, JsonErrorSyntax);
+    }
+    const int64_t total = sinkFinish(&writer->out);
+    if (total < 0) {
+        writerFail(writer, JsonErrorFile);
+    }
+    return writer->error == JsonSuccess ? total : -1;
+}
+
+char *finishJsonWriterText(JsonWriter *writer, size_t *len) {
+    if (finishJsonWriter(writer) < 0) {
+        return NULL;
+    }
+    return textRelease(&writer->text, len);
+}
+
+// Hash
+
+static uint64_t numberHash(double number) {
+    if (number == 0) {
+        number = 0;    // -0 == 0
+    }
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashMix(bits ^ 0x2545f4914f6cdd1du);
+}
+
+/*!
+ * \brief Хеш значения, у объектов и массивов кешируется в number.
+ */
+static uint64_t itemHash(JsonItem *item) {
+    switch (item->type) {
+    case JsonTypeNull:
+        return hashMix(1);
+    case JsonTypeBool:
+        return hashMix(item->number != 0 ? 3 : 2);
+    case JsonTypeNumber:
+        return numberHash(item->number);
+    case JsonTypeString:
+        return hashMix(hashBytes(item->str, item->strLen) + 4);
+    case JsonTypeArray:
+    case JsonTypeObject:
+        break;
+    default:
+        return 0;
+    }
+    if (item->_flags & ITEM_HASHED) {
+        return cachedHash(item);
+    }
+    uint64_t h;
+    size_t count = 0;
+    if (item->_flags & ITEM_PACKED) {
+        h = 5;
+        const double *numbers = packedNumbers(item);
+        for (; count < item->childrenCount; ++count) {
+            h = hashMix(h + numberHash(numbers[count]));
+        }
+    } else if (item->type == JsonTypeArray) {
+        // Порядок элементов важен: хеш накапливается цепочкой.
+        h = 5;
+        for (size_t i = 0; i < item->childrenCount; ++i) {
+            JsonItem *child = childAt(item, i);
+            if (!isTombstone(child)) {
+                h = hashMix(h + itemHash(child));
+                ++count;
+            }
+        }
+    } else {
+        // Порядок ключей не важен: хеши пар складываются.
+        h = 6;
+        for (size_t i = 0; i < item->childrenCount; ++i) {
+            JsonItem *child = childAt(item, i);
+            if (!isTombstone(child)) {
+                h += hashMix(hashBytes(child->key, child->keyLen)
+                             ^ (itemHash(child) * 0x9e3779b97f4a7c15u));
+                ++count;
+            }
+        }
+    }
+    h = hashMix(h ^ ((uint64_t)count << 3) ^ item->type);
+    setCachedHash(item, h);
+    return h;
+}
+
+uint64_t jsonHash(JsonItem *item) {
+    return item ? itemHash(item) : 0;
+}
+
+bool jsonEqual(const JsonItem *a, const JsonItem *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return itemsEqual(a, b);
+}
+
+// Schema
+
+struct JsonSchemaTypeDef {
+    /// Копия аллокатора, действовавшего при создании.
+    JsonAllocator allocator;
+    /// Копия описаний полей.
+    JsonField *fields;
+    size_t *keyLens;
+    size_t count;
+    /// Идеальный хеш: поле ключа key - slots[hashMix(hashBytes(key) ^ seed) & mask].
+    uint64_t seed;
+    size_t mask;
+    /// Номер поля + 1, 0 - пустая ячейка.
+    size_t *slots;
+};
+
+/// Сколько зерен перебирается для одного размера таблицы.
+#define SCHEMA_SEED_TRIES 256
+
+static size_t schemaSlot(const JsonSchema *schema, uint64_t keyHash) {
+    return (size_t)hashMix(keyHash ^ schema->seed) & schema->mask;
+}
+
+/*!
+ * \brief Подбирает зерно, при котором ключи попадают в разные ячейки.
+ * \param hashes - хеши ключей.
+ * \return false, если не хватило памяти.
+ */
+static bool schemaBuildSlots(JsonSchema *schema, const uint64_t *hashes) {
+    // Таблица не меньше чем вдвое больше полей; если зерно не находится,
+    // она растет (при n^2 ячеек подходит почти любое зерно).
+    size_t capacity = 4;
+    while (capacity < 2 * schema->count) {
+        capacity *= 2;
+    }
+    for (; capacity / 4 <= schema->count * schema->count + 16; capacity *= 2) {
+        size_t *slots = jsonAlloc(&schema->allocator, capacity * sizeof(size_t));
+        if (!slots) {
+            return false;
+        }
+        schema->slots = slots;
+        schema->mask = capacity - 1;
+        for (uint64_t seed = 0; seed < SCHEMA_SEED_TRIES; ++seed) {
+            schema->seed = hashMix(seed + 1);
+            memset(slots, 0, capacity * sizeof(size_t));
+            size_t i = 0;
+            for (; i < schema->count; ++i) {
+                size_t *slot = slots + schemaSlot(schema, hashes[i]);
+                if (*slot) {
+                    break;
+                }
+                *slot = i + 1;
+            }
+            if (i == schema->count) {
+                return true;
+            }
+        }
+        jsonFree(&schema->allocator, slots, capacity * sizeof(size_t));
+        schema->slots = NULL;
+    }
+    return false;
+}
+
+void freeJsonSchema(JsonSchema *schema) {
+    if (!schema) {
+        return;
+    }
+    const JsonAllocator a = schema->allocator;
+    jsonFree(&a, schema->slots, (schema->mask + 1) * sizeof(size_t));
+    jsonFree(&a, schema->keyLens, schema->count * sizeof(size_t));
+    jsonFree(&a, schema->fields, schema->count * sizeof(JsonField));
+    jsonFree(&a, schema, sizeof(JsonSchema));
+}
+
+JsonSchema *createJsonSchema(const JsonField *fields, size_t count) {
+    if (!fields && count) {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!fields[i].key || fields[i].type >= JsonFieldTypeCount
+                || (fields[i].type == JsonFieldObject && !fields[i].schema)) {
+            return NULL;
+        }
+    }
+    const JsonAllocator *a = jsonCurrentAllocator();
+    JsonSchema *schema = jsonAlloc(a, sizeof(JsonSchema));
+    if (!schema) {
+        return NULL;
+    }
+    schema->allocator = *a;
+    schema->count = count;
+    schema->seed = 0;
+    schema->mask = 0;
+    schema->slots = NULL;
+    schema->fields = jsonAlloc(a, count * sizeof(JsonField));
+    schema->keyLens = jsonAlloc(a, count * sizeof(size_t));
+    uint64_t *hashes = jsonAlloc(a, count * sizeof(uint64_t));
+    bool ok = count == 0 || (schema->fields && schema->keyLens && hashes);
+    for (size_t i = 0; ok && i < count; ++i) {
+        schema->fields[i] = fields[i];
+        schema->keyLens[i] = strlen(fields[i].key);
+        hashes[i] = hashBytes(fields[i].key, schema->keyLens[i]);
+        for (size_t j = 0; j < i; ++j) {
+            if (hashes[j] == hashes[i] && schema->keyLens[j] == schema->keyLens[i]
+                    && memcmp(fields[j].key, fields[i].key, schema->keyLens[i]) == 0) {
+                ok = false;  // Повторяющийся ключ.
+            }
+        }
+    }
+    ok = ok && schemaBuildSlots(schema, hashes);
+    jsonFree(a, hashes, count * sizeof(uint64_t));
+    if (!ok) {
+        freeJsonSchema(schema);
+        return NULL;
+    }
+    return schema;
+}
+
+/*!
+ * \brief Поле схемы по ключу (одна проверка ячейки).
+ * \return поле или NULL, если ключа нет в схеме.
+ */
+static const JsonField *schemaField(const JsonSchema *schema, const char *key, size_t keyLen) {
+    if (!schema->count) {
+        return NULL;
+    }
+    const size_t index = schema->slots[schemaSlot(schema, hashBytes(key, keyLen))];
+    if (!index || schema->keyLens[index - 1] != keyLen
+            || memcmp(schema->fields[index - 1].key, key, keyLen) != 0) {
+        return NULL;
+    }
+    return schema->fields + index - 1;
+}
+
+/*!
+ * \brief Разбирает число в ограниченном буфере.
+ * \param pos - начало числа, на выходе - символ после него.
+ * \return false при ошибке (err заполнен).
+ */
+static bool decodeNumber(const char **pos, const char *end, double *number, JsonErrorEnum *err) {
+    const char *q;
+    if (!isNumericPlusMinus(**pos) || !(q = validateNumber(*pos, end))) {
+        *err = JsonErrorValue;
+        return false;
+    }
+    if (!textToDouble(jsonCurrentAllocator(), *pos, q - *pos, number)) {
+        *err = JsonErrorUnknow;
+        return false;
+    }
+    *pos = q;
+    return true;
+}
+
+/*!
+ * \brief Разбирает целое число в ограниченном буфере без перевода в double.
+ *
+ * Дробная часть или экспонента - JsonErrorValue, как и выход за
+ * [min, max].
+ * \param pos - начало числа, на выходе - символ после него.
+ * \return false при ошибке (err заполнен).
+ */
+static bool decodeInteger(const char **pos, const char *end, int64_t min, int64_t max,
+                          int64_t *number, JsonErrorEnum *err) {
+    const char *p = *pos;
+    const char *q;
+    if (!isNumericPlusMinus(*p) || !(q = validateNumber(p, end))) {
+        *err = JsonErrorValue;
+        return false;
+    }
+    const bool negative = *p == '-';
+    p += *p == '-' || *p == '+';
+    // Модуль предела: для отрицательных -(min + 1) + 1 без переполнения.
+    const uint64_t limit = negative ? (uint64_t)(-(min + 1)) + 1 : (uint64_t)max;
+    uint64_t r = 0;
+    for (; p < q; ++p) {
+        if (!isNumeric(*p) || r > (limit - (uint64_t)(*p - '0')) / 10) {
+            *err = JsonErrorValue;
+            return false;
+        }
+        r = r * 10 + (uint64_t)(*p - '0');
+    }
+    *number = !negative ? (int64_t)r : r == 0 ? 0 : -(int64_t)(r - 1) - 1;
+    *pos = q;
+    return true;
+}
+
+static bool decodeObject(const JsonSchema *schema, char *out,
+                         const char **pos, const char *end, JsonErrorEnum *err);
+
+/*!
+ * \brief Разбирает значение поля в out + field->offset.
+ *
+ * null оставляет поле как есть, значение другого типа - JsonErrorValue.
+ */
+static bool decodeField(const JsonField *field, char *out,
+                        const char **pos, const char *end, JsonErrorEnum *err) {
+    const char *p = *pos;
+    void *dst = out + field->offset;
+    if (validateWord(p, end, NULL_STR, NULL_STR_LEN)) {
+        *pos = p + NULL_STR_LEN;
+        return true;
+    }
+    double number;
+    int64_t integer;
+    switch (field->type) {
+    case JsonFieldBool:
+        if (validateWord(p, end, TRUE_STR, TRUE_STR_LEN)) {
+            *(bool*)dst = true;
+            *pos = p + TRUE_STR_LEN;
+        } else if (validateWord(p, end, FALSE_STR, FALSE_STR_LEN)) {
+            *(bool*)dst = false;
+            *pos = p + FALSE_STR_LEN;
+        } else {
+            *err = JsonErrorValue;
+            return false;
+        }
+        return true;
+    case JsonFieldInt32:
+        if (!decodeInteger(pos, end, INT32_MIN, INT32_MAX, &integer, err)) {
+            return false;
+        }
+        *(int32_t*)dst = (int32_t)integer;
+        return true;
+    case JsonFieldInt64:
+        if (!decodeInteger(pos, end, INT64_MIN, INT64_MAX, &integer, err)) {
+            return false;
+        }
+        *(int64_t*)dst = integer;
+        return true;
+    case JsonFieldDouble:
+        if (!decodeNumber(pos, end, &number, err)) {
+            return false;
+        }
+        *(double*)dst = number;
+        return true;
+    case JsonFieldStr: {
+        const char *q;
+        if (*p != '"' || !(q = validateString(p, end))) {
+            *err = JsonErrorValue;
+            return false;
+        }
+        JsonStrRef *ref = dst;
+        ref->str = p + 1;
+        ref->len = q - p - 1;
+        *pos = q + 1;
+        return true;
+    }
+    case JsonFieldObject:
+        if (*p != '{') {
+            *err = JsonErrorValue;
+            return false;
+        }
+        return decodeObject(field->schema, dst, pos, end, err);
+    case JsonFieldDoubles: {
+        if (*p != '[') {
+            *err = JsonErrorValue;
+            return false;
+        }
+        size_t count = 0;
+        p = validateSkip(p + 1, end);
+        if (p < end && *p == ']') {
+            ++p;
+        } else {
+            for (;;) {
+                if (p == end) {
+                    *err = JsonErrorEnd;
+                    *pos = p;
+                    return false;
+                }
+                if (count == field->capacity) {
+                    // Массив длиннее буфера поля.
+                    *err = JsonErrorValue;
+                    *pos = p;
+                    return false;
+                }
+                if (!decodeNumber(&p, end, (double*)dst + count, err)) {
+                    *pos = p;
+                    return false;
+                }
+                ++count;
+                p = validateSkip(p, end);
+                if (p < end && *p == ']') {
+                    ++p;
+                    break;
+                }
+                if (p == end || *p != ',') {
+                    *err = JsonErrorSyntax;
+                    *pos = p;
+                    return false;
+                }
+                p = validateSkip(p + 1, end);
+            }
+        }
+        *(size_t*)(out + field->countOffset) = count;
+        *pos = p;
+        return true;
+    }
+    default:
+        *err = JsonErrorUnknow;
+        return false;
+    }
+}
+
+/*!
+ * \brief Разбирает объект по схеме, неизвестные ключи пропускаются.
+ * \param pos - открывающая скобка, на выходе - символ после объекта.
+ */
+static bool decodeObject(const JsonSchema *schema, char *out,
+                         const char **pos, const char *end, JsonErrorEnum *err) {
+    const char *p = validateSkip(*pos + 1, end);
+    const char *q;
+    if (p < end && *p == '}') {
+        *pos = p + 1;
+        return true;
     }
-    r->type = JsonTypeNumber;
-    r->number = number;
-    return r;
+    for (;;) {
+        if (p == end) {
+            *err = JsonErrorEnd;
+            goto error;
+        }
+        if (*p != '"') {
+            *err = JsonErrorSyntax;
+            goto error;
+        }
+        if (!(q = validateString(p, end))) {
+            *err = JsonErrorKey;
+            goto error;
+        }
+        const JsonField *field = schemaField(schema, p + 1, q - p - 1);
+        p = validateSkip(q + 1, end);
+        if (p == end) {
+            *err = JsonErrorEnd;
+            goto error;
+        }
+        if (*p != ':') {
+            *err = JsonErrorSyntax;
+            goto error;
+        }
+        p = validateSkip(p + 1, end);
+        if (p == end) {
+            *err = JsonErrorEnd;
+            goto error;
+        }
+        if (field ? !decodeField(field, out, &p, end, err) : !validateValue(&p, end, err)) {
+            goto error;
+        }
+        p = validateSkip(p, end);
+        if (p == end) {
+            *err = JsonErrorSyntax;
+            goto error;
+        }
+        if (*p == '}') {
+            *pos = p + 1;
+            return true;
+        }
+        if (*p != ',') {
+            *err = JsonErrorSyntax;
+            goto error;
+        }
+        p = validateSkip(p + 1, end);
+    }
+error:
+    *pos = p;
+    return false;
 }
 
-JsonItem *addChildKeyNumber(JsonItem *pCurrent, const char *key, double number) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeNumber;
-    r->key = key;
-    r->keyLen = strlen(key);
-    r->number = number;
-    return r;
+bool parseJsonStruct(const char *buf, size_t len, const JsonSchema *schema, void *out,
+                     JsonErrorInfo *errorInfo) {
+    const char *nul = memchr(buf, END_STR, len);
+    const char * const end = nul ? nul : buf + len;
+    JsonErrorEnum err = JsonSuccess;
+    const char *p = validateSkip(buf, end);
+    if (!schema || !out) {
+        err = JsonErrorValue;
+    } else if (p == end) {
+        err = JsonErrorEnd;
+    } else if (*p != '{') {
+        err = JsonErrorValue;
+    } else if (decodeObject(schema, out, &p, end, &err)
+               && (p = validateSkip(p, end)) != end) {
+        err = JsonErrorSyntax;
+    }
+    setErrorInfo(errorInfo, err, buf, p);
+    return err == JsonSuccess;
 }
 
-JsonItem *addChildKeyLenNumber(JsonItem *pCurrent, const char *key, size_t keyLen, double number) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeNumber;
-    r->key = key;
-    r->keyLen = keyLen;
-    r->number = number;
-    return r;
+/*!
+ * \brief Записывает целое без потери точности (int64 не всегда точен в double).
+ */
+static bool writerInt64(JsonWriter *w, int64_t value) {
+    if (!writerBeforeValue(w)) {
+        return false;
+    }
+    char buf[24];
+    const int n = snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    sinkAppend(&w->out, buf, (size_t)n);
+    return writerAfterValue(w);
 }
 
-JsonItem *addChildStr(JsonItem *pCurrent, const char *str) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->str = str;
-    r->strLen = strlen(str);
-    return r;
+bool jsonWriteStruct(JsonWriter *writer, const JsonSchema *schema, const void *in) {
+    if (!writer) {
+        return false;
+    }
+    if (!schema || !in) {
+        return writerFail(writer, JsonErrorValue);
+    }
+    const char *base = in;
+    bool ok = jsonWriteBeginObject(writer);
+    for (size_t i = 0; ok && i < schema->count; ++i) {
+        const JsonField *field = schema->fields + i;
+        const void *src = base + field->offset;
+        ok = jsonWriteKeyLen(writer, field->key, schema->keyLens[i]);
+        if (!ok) {
+            break;
+        }
+        switch (field->type) {
+        case JsonFieldBool:
+            ok = jsonWriteBool(writer, *(const bool*)src);
+            break;
+        case JsonFieldInt32:
+            ok = writerInt64(writer, *(const int32_t*)src);
+            break;
+        case JsonFieldInt64:
+            ok = writerInt64(writer, *(const int64_t*)src);
+            break;
+        case JsonFieldDouble:
+            ok = jsonWriteNumber(writer, *(const double*)src);
+            break;
+        case JsonFieldStr: {
+            const JsonStrRef *ref = src;
+            ok = ref->str ? jsonWriteStrLen(writer, ref->str, ref->len) : jsonWriteNull(writer);
+            break;
+        }
+        case JsonFieldObject:
+            ok = jsonWriteStruct(writer, field->schema, src);
+            break;
+        case JsonFieldDoubles: {
+            size_t count = *(const size_t*)(base + field->countOffset);
+            if (count > field->capacity) {
+                count = field->capacity;
+            }
+            ok = jsonWriteBeginArray(writer);
+            for (size_t j = 0; ok && j < count; ++j) {
+                ok = jsonWriteNumber(writer, ((const double*)src)[j]);
+            }
+            ok = ok && jsonWriteEndArray(writer);
+            break;
+        }
+        default:
+            ok = writerFail(writer, JsonErrorValue);
+        }
+    }
+    return ok && jsonWriteEndObject(writer);
 }
 
-JsonItem *addChildStrLen(JsonItem *pCurrent, const char *str, size_t strLen) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->str = str;
-    r->strLen = strLen;
-    return r;
-}
+// Shared
 
-JsonItem *addChildKeyStr(JsonItem *pCurrent, const char *key, const char *str) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->key = key;
-    r->keyLen = strlen(key);
-    r->str = str;
-    r->strLen = strlen(str);
-    return r;
-}
+#ifdef JSONC_NO_THREADS
+typedef size_t SharedCounter;
+typedef JsonSnapshot *SharedPointer;
+#define SHARED_LOAD(x) (x)
+#define SHARED_EXCHANGE(x, value) sharedExchange(&(x), (value))
+#define SHARED_FETCH_ADD(x, n) (((x) += (n)) - (n))
+#define SHARED_FETCH_SUB(x, n) (((x) -= (n)) + (n))
 
-JsonItem *addChildKeyStrLen(JsonItem *pCurrent, const char *key, const char *str, size_t strLen) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->key = key;
-    r->keyLen = strlen(key);
-    r->str = str;
-    r->strLen = strLen;
+static JsonSnapshot *sharedExchange(SharedPointer *x, JsonSnapshot *value) {
+    JsonSnapshot *r = *x;
+    *x = value;
     return r;
 }
+#else
+typedef atomic_size_t SharedCounter;
+typedef JsonSnapshot *_Atomic SharedPointer;
+#define SHARED_LOAD(x) atomic_load(&(x))
+#define SHARED_EXCHANGE(x, value) atomic_exchange(&(x), (value))
+#define SHARED_FETCH_ADD(x, n) atomic_fetch_add(&(x), (n))
+#define SHARED_FETCH_SUB(x, n) atomic_fetch_sub(&(x), (n))
+#endif
 
-JsonItem *addChildKeyLenStr(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->key = key;
-    r->keyLen = keyLen;
-    r->str = str;
-    r->strLen = strlen(str);
-    return r;
+#if !defined(JSONC_NO_THREADS) && !defined(_WIN32)
+#define SHARED_WATCH 1
+/// Период опроса stat(), если inotify недоступен.
+#define SHARED_POLL_MS 1000
+/// Наносекунды mtime. Поле st_mtim есть не везде (на macOS с
+/// _POSIX_C_SOURCE его нет), там сравниваются только секунды st_mtime.
+#ifdef __linux__
+#define SHARED_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#else
+#define SHARED_MTIME_NSEC(st) 0
+#endif
+#endif
+
+struct JsonSnapshotTypeDef {
+    /// Документ вместе с текстом файла.
+    JsonCStruct doc;
+    /// Копия аллокатора, им выделены дерево, текст и сам снимок.
+    JsonAllocator allocator;
+    uint64_t version;
+    SharedCounter refs;
+};
+
+struct JsonSharedTypeDef {
+    char *fileName;
+    size_t fileNameSize;
+    /// Параметры разбора, allocator указывает на allocator.
+    JsonParseOptions options;
+    JsonAllocator allocator;
+    /// Текущий снимок, ссылка на него принадлежит JsonShared.
+    SharedPointer current;
+    /// Читатели между загрузкой current и увеличением refs.
+    SharedCounter acquiring;
+    /// Ошибка последней перезагрузки.
+    JsonErrorEnum lastError;
+    uint64_t version;
+#ifndef JSONC_NO_THREADS
+    /// Перезагрузки выполняются по одной.
+    pthread_mutex_t reloadMutex;
+#endif
+#ifdef SHARED_WATCH
+    bool watching;
+    pthread_t thread;
+    /// Запись в wakeFd[1] останавливает поток наблюдения.
+    int wakeFd[2];
+    int inotifyFd;
+    /// Имя файла без каталога (для событий inotify).
+    const char *baseName;
+    struct stat lastStat;
+#endif
+};
+
+void jsonSnapshotRelease(JsonSnapshot *snapshot) {
+    if (!snapshot || SHARED_FETCH_SUB(snapshot->refs, 1) != 1) {
+        return;
+    }
+    const JsonAllocator a = snapshot->allocator;
+    freeJsonCStructFull(snapshot->doc);
+    jsonFree(&a, snapshot, sizeof(JsonSnapshot));
 }
 
-JsonItem *addChildKeyLenStrLen(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str, size_t strLen) {
-    JsonItem *r = addChild(pCurrent);
-    r->type = JsonTypeString;
-    r->key = key;
-    r->keyLen = keyLen;
-    r->str = str;
-    r->strLen = strLen;
-    return r;
+const JsonItem *jsonSnapshotRoot(const JsonSnapshot *snapshot) {
+    return snapshot ? snapshot->doc.rootItem : NULL;
 }
 
-int32_t fprintJsonItem(FILE *file, const JsonItem *item) {
-    return fprintJsonItemOffset(file, item, 0);
+uint64_t jsonSnapshotVersion(const JsonSnapshot *snapshot) {
+    return snapshot ? snapshot->version : 0;
 }
 
-int32_t fprintJsonItemOffset(FILE *file, const JsonItem *item, uint32_t offset) {
-    const char* offsetStr = "    ";
-    int32_t printSize = 0;
-    for (uint32_t i = 0; i < offset; ++i) {
-        printSize += fprintf(file, "%s", offsetStr);
-    }
-    if (item->parent && item->parent->type != JsonTypeArray) {
-        printSize += fprintf(file, "\"%*.*s\": ", (int32_t)item->keyLen, (int32_t)item->keyLen, item->key);
+JsonSnapshot *jsonSharedAcquire(JsonShared *shared) {
+    if (!shared) {
+        return NULL;
     }
-    switch (item->type) {
-    case JsonTypeNull:
-        printSize += fprintf(file, "%s", NULL_STR);
-        break;
-    case JsonTypeBool:
-        printSize += fprintf(file, "%s", item->number ? TRUE_STR : FALSE_STR);
-        break;
-    case JsonTypeNumber:
-        printSize += fprintf(file, "%g", item->number);
-        break;
-    case JsonTypeString:
-        printSize += fprintf(file, "\"%*.*s\"", (int32_t)item->strLen, (int32_t)item->strLen, item->str);
-        break;
-    case JsonTypeObject:
-    case JsonTypeArray:
-        printSize += fprintf(file, item->type == JsonTypeObject ? "{\n" : "[\n");
-        for (uint32_t i = 0; i < item->childrenCount; ++i) {
-            printSize += fprintJsonItemOffset(file, item->childrenList + i, offset + 1);
-            if (i + 1 != item->childrenCount) {
-                printSize += fprintf(file, ",\n");
-            }
-        }
-        printSize += fprintf(file, "\n");
-        for (uint32_t i = 0; i < offset; ++i) {
-            printSize += fprintf(file, "%s", offsetStr);
-        }
-        printSize += fprintf(file, item->type == JsonTypeObject ? "}" : "]");
-        break;
-    default:
-        return INT32_MIN;
+    // Пока acquiring не ноль, публикующий не отпускает старый снимок,
+    // поэтому загруженный указатель жив до увеличения refs.
+    (void)SHARED_FETCH_ADD(shared->acquiring, 1);
+    JsonSnapshot *snapshot = SHARED_LOAD(shared->current);
+    if (snapshot) {
+        (void)SHARED_FETCH_ADD(snapshot->refs, 1);
     }
-    return printSize;
+    (void)SHARED_FETCH_SUB(shared->acquiring, 1);
+    return snapshot;
 }
 
-int32_t fprintJsonStruct(FILE *file, JsonCStruct jStruct) {
-    if (jStruct.error != JsonSuccess) {
-        printf("error = %d\n", jStruct.error);
-        return 0;
+bool jsonSharedRefresh(JsonShared *shared, JsonSnapshot **snapshot) {
+    if (!shared || !snapshot) {
+        return false;
+    }
+    // Быстрый путь: снимок держит ссылку, поэтому сравнение указателей
+    // надежно.
+    if (SHARED_LOAD(shared->current) == *snapshot) {
+        return false;
     }
-    int32_t s = fprintJsonItem(file, jStruct.rootItem);
-    s += fprintf(file, "\n");
-    return s;
+    JsonSnapshot *fresh = jsonSharedAcquire(shared);
+    jsonSnapshotRelease(*snapshot);
+    *snapshot = fresh;
+    return true;
 }
 
-int32_t saveJsonItem(const char *fileName, const JsonItem* root) {
-    FILE *ptrFile = fopen(fileName, "w");
-    if (ptrFile == NULL) {
-        return -1;
+/*!
+ * \brief Публикует снимок и отпускает предыдущий, когда его больше не могут
+ * загрузить читатели.
+ */
+static void sharedPublish(JsonShared *shared, JsonSnapshot *snapshot) {
+    JsonSnapshot *old = SHARED_EXCHANGE(shared->current, snapshot);
+#ifndef JSONC_NO_THREADS
+    while (SHARED_LOAD(shared->acquiring)) {
+        sched_yield();
     }
-    int32_t res = fprintJsonItem(ptrFile, root);
+#endif
+    jsonSnapshotRelease(old);
+}
 
-    fclose(ptrFile);
+/*!
+ * \brief Разбирает файл в новый снимок.
+ * \return снимок с refs == 1 или NULL (ошибка в shared->lastError).
+ */
+static JsonSnapshot *sharedLoad(JsonShared *shared) {
+    JsonSnapshot *snapshot = jsonAlloc(&shared->allocator, sizeof(JsonSnapshot));
+    if (!snapshot) {
+        shared->lastError = JsonErrorUnknow;
+        return NULL;
+    }
+    snapshot->allocator = shared->allocator;
+    JsonParseOptions options = shared->options;
+    options.allocator = &snapshot->allocator;
+    snapshot->doc = openJsonFromFileOpt(shared->fileName, &options);
+    shared->lastError = snapshot->doc.error;
+    if (snapshot->doc.error != JsonSuccess) {
+        freeJsonCStructFull(snapshot->doc);
+        jsonFree(&shared->allocator, snapshot, sizeof(JsonSnapshot));
+        return NULL;
+    }
+    snapshot->version = ++shared->version;
+    snapshot->refs = 1;
+    return snapshot;
+}
 
-    return res;
+bool jsonSharedReload(JsonShared *shared) {
+    if (!shared) {
+        return false;
+    }
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_lock(&shared->reloadMutex);
+#endif
+    JsonSnapshot *snapshot = sharedLoad(shared);
+    if (snapshot) {
+        sharedPublish(shared, snapshot);
+    }
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_unlock(&shared->reloadMutex);
+#endif
+    return snapshot != NULL;
 }
-// KeyPath
 
-const char* const INTO = "->";
-const size_t INTO_SIZE = 2;
+JsonErrorEnum jsonSharedLastError(JsonShared *shared) {
+    if (!shared) {
+        return JsonErrorValue;
+    }
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_lock(&shared->reloadMutex);
+#endif
+    const JsonErrorEnum r = shared->lastError;
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_unlock(&shared->reloadMutex);
+#endif
+    return r;
+}
 
+#ifdef SHARED_WATCH
 /*!
- * \brief Инициализирует KeyItem.
- * \param r - выходная структура.
+ * \brief Изменился ли файл по stat() с прошлой проверки.
  */
-static void initKeyItem(KeyItem *r) {
-    r->keyStr = NULL;
-    r->keyStrLen = INIT_LEN;
-    r->child = NULL;
-    r->index = INIT_LEN;
+static bool sharedStatChanged(JsonShared *shared) {
+    struct stat st;
+    if (stat(shared->fileName, &st) != 0) {
+        return false;
+    }
+    const bool changed = st.st_ino != shared->lastStat.st_ino
+            || st.st_size != shared->lastStat.st_size
+            || st.st_mtime != shared->lastStat.st_mtime
+            || SHARED_MTIME_NSEC(st) != SHARED_MTIME_NSEC(shared->lastStat);
+    shared->lastStat = st;
+    return changed;
 }
 
 /*!
- * \brief Проверка на последовательность INTO.
- * \param str - строка, где происходит проверка.
- * \return NULL - если не совпало, иначе на первый символ после INTO.
+ * \brief Есть ли среди событий inotify событие про наш файл.
  */
-static const char* checkInto(const char *str) {
-    for (size_t i = 0; i < INTO_SIZE; ++i) {
-        if (str[i] != INTO[i]) {
-            return NULL;
+static bool sharedInotifyChanged(JsonShared *shared) {
+    bool changed = false;
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        const ssize_t n = read(shared->inotifyFd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        for (const char *p = buf; p < buf + n;) {
+            const struct inotify_event *event = (const struct inotify_event*)p;
+            if (event->len && strcmp(event->name, shared->baseName) == 0) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
         }
     }
-    return str + INTO_SIZE;
+#else
+    (void)shared;
+#endif
+    return changed;
 }
 
-bool parseKeyPath(const char *keyPath, KeyItem **keyItem) {
-    KeyItem *root = malloc(sizeof(KeyItem));
-    if (root == NULL) { return false; }
-    initKeyItem(root);
-    const char *it = keyPath;
-    if (!(it = parseString(keyPath))) {
-        free(root);
-        return false;
+static void *sharedWatchThread(void *arg) {
+    JsonShared *shared = arg;
+    for (;;) {
+        struct pollfd fds[2] = {
+            { shared->wakeFd[0], POLLIN, 0 },
+            { shared->inotifyFd, POLLIN, 0 }
+        };
+        const bool inotify = shared->inotifyFd >= 0;
+        const int r = poll(fds, inotify ? 2 : 1, inotify ? -1 : SHARED_POLL_MS);
+        if (r < 0 && errno != EINTR) {
+            break;
+        }
+        if (r > 0 && fds[0].revents) {
+            break;
+        }
+        const bool changed = inotify ?
+                    r > 0 && (fds[1].revents & POLLIN) && sharedInotifyChanged(shared) :
+                    r == 0 && sharedStatChanged(shared);
+        if (changed) {
+            jsonSharedReload(shared);
+        }
     }
-    root->keyStr = keyPath + 1;
-    root->keyStrLen = it - root->keyStr;
-    ++it;
-    if (it[0] == END_STR) {
-        *keyItem = root;
-        return true;
+    return NULL;
+}
+
+/*!
+ * \brief Запускает наблюдение: inotify за каталогом файла (ловит и запись,
+ * и замену переименованием), иначе опрос stat().
+ */
+static bool sharedStartWatch(JsonShared *shared) {
+    if (pipe(shared->wakeFd) != 0) {
+        return false;
     }
-    if (it[0] == '[') {
-        int32_t t;
-        it = myAtoi(it + 1, &t);
-        root->index = t;
-        if (it[0] != ']') {
-            free(root);
-            return false;
+    const char *slash = strrchr(shared->fileName, '/');
+    shared->baseName = slash ? slash + 1 : shared->fileName;
+    shared->inotifyFd = -1;
+#ifdef __linux__
+    shared->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (shared->inotifyFd >= 0) {
+        char *dir = slash ? jsonAlloc(&shared->allocator, slash - shared->fileName + 2) : NULL;
+        if (dir) {
+            const size_t dirLen = slash == shared->fileName ? 1 : (size_t)(slash - shared->fileName);
+            memcpy(dir, shared->fileName, dirLen);
+            dir[dirLen] = END_STR;
         }
-        ++it;
-        if (it[0] == END_STR) {
-            *keyItem = root;
-            return true;
+        const int wd = inotify_add_watch(shared->inotifyFd, dir ? dir : ".",
+                                         IN_CLOSE_WRITE | IN_MOVED_TO);
+        jsonFree(&shared->allocator, dir, slash ? slash - shared->fileName + 2 : 0);
+        if (wd < 0) {
+            close(shared->inotifyFd);
+            shared->inotifyFd = -1;
         }
     }
-    it = checkInto(it);
-    if (!it) {
-        free(root);
-        return false;
+#endif
+    if (shared->inotifyFd < 0) {
+        sharedStatChanged(shared);
     }
-    if (!parseKeyPath(it, &root->child)) {
-        free(root);
+    if (pthread_create(&shared->thread, NULL, sharedWatchThread, shared) != 0) {
+        if (shared->inotifyFd >= 0) {
+            close(shared->inotifyFd);
+        }
+        close(shared->wakeFd[0]);
+        close(shared->wakeFd[1]);
         return false;
     }
-    *keyItem = root;
+    shared->watching = true;
     return true;
 }
 
-void freeKeyItem(KeyItem *keyItem) {
-    if (!keyItem) {
+static void sharedStopWatch(JsonShared *shared) {
+    if (!shared->watching) {
         return;
     }
-    if (keyItem->child) {
-        freeKeyItem(keyItem->child);
+    const char stop = 0;
+    while (write(shared->wakeFd[1], &stop, 1) < 0 && errno == EINTR) {
     }
-    free(keyItem);
+    pthread_join(shared->thread, NULL);
+    if (shared->inotifyFd >= 0) {
+        close(shared->inotifyFd);
+    }
+    close(shared->wakeFd[0]);
+    close(shared->wakeFd[1]);
+    shared->watching = false;
 }
+#endif
 
-JsonItem *getItem(const KeyItem *keyItem, const JsonItem *root) {
-    if (!keyItem || !root) {
-        printf("bad param");
+void freeJsonShared(JsonShared *shared) {
+    if (!shared) {
+        return;
+    }
+#ifdef SHARED_WATCH
+    sharedStopWatch(shared);
+#endif
+    jsonSnapshotRelease(SHARED_EXCHANGE(shared->current, NULL));
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_destroy(&shared->reloadMutex);
+#endif
+    const JsonAllocator a = shared->allocator;
+    jsonFree(&a, shared->fileName, shared->fileNameSize);
+    jsonFree(&a, shared, sizeof(JsonShared));
+}
+
+JsonShared *createJsonShared(const char *fileName, const JsonParseOptions *options,
+                             bool watch, JsonErrorEnum *error) {
+    JsonErrorEnum dummy;
+    if (!error) {
+        error = &dummy;
+    }
+    *error = JsonErrorValue;
+    if (!fileName) {
         return NULL;
     }
-    JsonItem *child = NULL;
-    child = findChildKeyLen(root, keyItem->keyStr, keyItem->keyStrLen);
-    if (!child) {
-        printf("could not find key");
+    const JsonAllocator *a = options && options->allocator ?
+                options->allocator : jsonCurrentAllocator();
+    JsonShared *shared = jsonAlloc(a, sizeof(JsonShared));
+    if (!shared) {
+        *error = JsonErrorUnknow;
         return NULL;
     }
-    if (keyItem->index != INIT_LEN) {
-        child = findChildIndex(child, keyItem->index);
-        if (!child) {
-            printf("could not find index");
-            return NULL;
+    shared->allocator = *a;
+    shared->fileNameSize = strlen(fileName) + 1;
+    shared->fileName = jsonAlloc(a, shared->fileNameSize);
+    if (!shared->fileName) {
+        jsonFree(a, shared, sizeof(JsonShared));
+        *error = JsonErrorUnknow;
+        return NULL;
+    }
+    memcpy(shared->fileName, fileName, shared->fileNameSize);
+    // Таблица интернирования и статистика не потокобезопасны, а разбор
+    // идет и в потоке наблюдения.
+    JsonParseOptions opt = { &shared->allocator, NULL,
+                             options && options->packNumberArrays, NULL,
+                             options ? options->maxDepth : 0 };
+    shared->options = opt;
+    shared->current = NULL;
+    shared->acquiring = 0;
+    shared->lastError = JsonSuccess;
+    shared->version = 0;
+#ifndef JSONC_NO_THREADS
+    pthread_mutex_init(&shared->reloadMutex, NULL);
+#endif
+#ifdef SHARED_WATCH
+    shared->watching = false;
+    // Наблюдение начинается до первого разбора, чтобы не пропустить запись
+    // между ними.
+    if (watch && !sharedStartWatch(shared)) {
+        freeJsonShared(shared);
+        *error = JsonErrorFile;
+        return NULL;
+    }
+#else
+    (void)watch;
+#endif
+    if (!jsonSharedReload(shared)) {
+        *error = shared->lastError;
+        freeJsonShared(shared);
+        return NULL;
+    }
+    *error = JsonSuccess;
+    return shared;
+}
+
+// Memory
+
+static void memoryUsage(const JsonItem *item, JsonMemoryUsage *usage) {
+    ++usage->nodeCount;
+    if (item->_flags & ITEM_PACKED) {
+        ++usage->listCount;
+        usage->numberCount += item->childrenCount;
+        usage->usedBytes += item->childrenCount * sizeof(double);
+        usage->reservedBytes += item->_childrenReserve * sizeof(double);
+        return;
+    }
+    if (item->_flags & ITEM_CHUNKED) {
+        const size_t chunkCount = item->_childrenReserve / CHUNK_SIZE;
+        usage->listCount += chunkCount;
+        usage->reservedBytes += chunkDirCapacity(chunkCount) * sizeof(JsonItem*);
+    } else if (item->_childrenReserve) {
+        ++usage->listCount;
+    }
+    usage->reservedBytes += item->_childrenReserve * sizeof(JsonItem);
+    for (size_t i = 0; i < item->childrenCount; ++i) {
+        const JsonItem *child = childAt(item, i);
+        if (isTombstone(child)) {
+            ++usage->tombstoneCount;
+        } else {
+            usage->usedBytes += sizeof(JsonItem);
+            memoryUsage(child, usage);
         }
     }
-    if (keyItem->child) {
-        child = getItem(keyItem->child, child);
+}
+
+JsonMemoryUsage jsonMemoryUsage(const JsonItem *item) {
+    JsonMemoryUsage usage;
+    memset(&usage, 0, sizeof(usage));
+    if (item) {
+        // Сам элемент лежит в списке родителя или выделен отдельно.
+        usage.usedBytes = usage.reservedBytes = sizeof(JsonItem);
+        memoryUsage(item, &usage);
     }
-    return child;
+    return usage;
 }
 
+/*!
+ * \brief Переносит список потомков в новый блок точного размера, затем
+ * потомков (обход в глубину).
+ *
+ * Каждый шаг оставляет дерево целым, поэтому при нехватке памяти часть
+ * дерева может остаться несжатой.
+ */
+static bool shrinkItem(const JsonAllocator *a, JsonItem *item) {
+    if (item->type != JsonTypeObject && item->type != JsonTypeArray) {
+        return true;
+    }
+    compactChildren(item);
+    const size_t n = item->childrenCount;
+    const size_t size = item->_flags & ITEM_PACKED ? sizeof(double) : sizeof(JsonItem);
+    if (!(item->_flags & ITEM_CHUNKED) && (n || item->_childrenReserve)) {
+        void *list = n ? jsonAlloc(a, n * size) : NULL;
+        if (n && !list) {
+            return false;
+        }
+        if (n) {
+            memcpy(list, item->childrenList, n * size);
+        }
+        freeChildrenStorage(a, item);
+        item->childrenList = list;
+        item->_childrenReserve = n;
+        for (size_t i = 0; !(item->_flags & ITEM_PACKED) && i < n; ++i) {
+            fixChildrenParent(item->childrenList + i);
+        }
+    }
+    for (size_t i = 0; !(item->_flags & ITEM_PACKED) && i < n; ++i) {
+        if (!shrinkItem(a, childAt(item, i))) {
+            return false;
+        }
+    }
+    return true;
+}
 
-JsonItem *getItemStr(const char *keyPath, const JsonItem *root) {
-    KeyItem *keyItem = NULL;
-    bool err = parseKeyPath(keyPath, &keyItem);
-    if (err || !keyItem) {
-        return NULL;
+bool jsonShrinkToFit(JsonItem *root) {
+    if (!root) {
+        return false;
     }
-    JsonItem *resultItem = getItem(keyItem, root);
-    freeKeyItem(keyItem);
-    return resultItem;
+    return shrinkItem(jsonCurrentAllocator(), root);
 }
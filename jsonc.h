@@ -21,6 +21,8 @@ typedef enum {
     JsonErrorValue,     // (6) ошибка в значении.
     JsonErrorFile,      // (7) ошибка связана с работой с файлом.
     JsonErrorPath,      // (8) ошибка в keyPath.
+    JsonErrorDepth,     // (9) превышена вложенность (jsonValidate()).
+    JsonErrorCapacity,  // (10) не хватило региона (openJsonFromStrRegion()).
 
     JsonErrorCount
 } JsonErrorEnum;
@@ -45,14 +47,111 @@ typedef struct JsonItemTypeDef {
     const char *key;
     size_t keyLen;
     JsonTypeEnum type;
+    uint32_t _flags; /// Служебные флаги, занимают выравнивание перед number.
     double number;
+    /// Значение строки. У разобранных элементов других типов - исходный
+    /// фрагмент текста элемента (для fprintJsonItemIncremental()).
     const char *str;
     size_t strLen;
+    /// Массив потомков. В блочном режиме (setChildrenChunked()) и у
+    /// упакованных массивов чисел (JsonParseOptions::packNumberArrays) это
+    /// не массив JsonItem, доступ к потомкам через getChildAt() (к числам
+    /// упакованного массива - через getArrayNumberAt()).
     struct JsonItemTypeDef *childrenList;
     size_t childrenCount;
     size_t _childrenReserve; /// Количество выделенной памяти.
 } JsonItem;
 
+/*!
+ * \brief Аллокатор памяти.
+ *
+ * Через него проходят все выделения памяти библиотеки. size - размер блока,
+ * для строк key и str в freeJsonItemFull() он неизвестен и равен 0.
+ */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t oldSize, size_t newSize);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    /// Пользовательский контекст, передается первым параметром.
+    void *ctx;
+} JsonAllocator;
+
+/*!
+ * \brief Задает глобальный аллокатор.
+ *
+ * Структура копируется. Вызывать до начала работы с деревьями, NULL
+ * возвращает malloc/realloc/free.
+ * \param allocator - аллокатор или NULL.
+ */
+void jsonSetAllocator(const JsonAllocator *allocator);
+
+/*!
+ * \brief Задает аллокатор текущего потока (перекрывает глобальный).
+ *
+ * Указатель сохраняется, структура должна жить, пока используется.
+ * \param allocator - аллокатор или NULL для возврата к глобальному.
+ */
+void jsonSetThreadAllocator(const JsonAllocator *allocator);
+
+/*!
+ * \brief Текущий аллокатор: аллокатор потока, иначе глобальный.
+ *
+ * Им пользуются addChild*(), reserveChildCount(), removeChild(),
+ * createJsonParent(), freeJsonParent() и функции KeyPath. Изменять дерево
+ * нужно тем же аллокатором, которым оно создано.
+ */
+const JsonAllocator *jsonCurrentAllocator(void);
+
+/*!
+ * \brief Таблица интернирования ключей и коротких строк.
+ *
+ * Одинаковые ключи (и строки не длиннее strMaxLen) документа хранятся в
+ * таблице один раз, элементы ссылаются на общую копию. findChildKeyLen()
+ * сначала сравнивает указатели, поэтому поиск ключом из jsonIntern() той же
+ * таблицы не сравнивает байты. Таблица заполняется при разборе
+ * (JsonParseOptions::internTable) и в addChild*()/setItemStr*() потока, для
+ * которого задана jsonSetThreadInternTable(). Строки хранятся как есть
+ * (без раскрытия экранирования), freeJsonItemFull() их не освобождает.
+ * Таблица не потокобезопасна и должна жить дольше деревьев, которые на
+ * нее ссылаются.
+ */
+typedef struct JsonInternTableTypeDef JsonInternTable;
+
+/*!
+ * \brief Создает таблицу интернирования текущим аллокатором.
+ * \param strMaxLen - строки-значения не длиннее интернируются, 0 - только
+ * ключи (и пустые строки).
+ * \return таблица или NULL, если не хватило памяти.
+ */
+JsonInternTable *createJsonInternTable(size_t strMaxLen);
+
+/*!
+ * \brief Освобождает таблицу и все ее строки.
+ */
+void freeJsonInternTable(JsonInternTable *table);
+
+/*!
+ * \brief Возвращает общую копию строки, добавляя ее при необходимости.
+ * \param table - таблица.
+ * \param str - строка.
+ * \param len - длина строки.
+ * \return копия с нулевым символом в конце или NULL, если не хватило
+ * памяти.
+ */
+const char *jsonIntern(JsonInternTable *table, const char *str, size_t len);
+
+/*!
+ * \brief Количество разных строк в таблице.
+ */
+size_t jsonInternCount(const JsonInternTable *table);
+
+/*!
+ * \brief Задает таблицу интернирования для построения деревьев в текущем
+ * потоке.
+ * \param table - таблица или NULL, чтобы отключить.
+ */
+void jsonSetThreadInternTable(JsonInternTable *table);
+
 /*!
  * \brief Структура для работы с файлом JSON.
  */
@@ -61,10 +160,74 @@ typedef struct {
     const char *jsonTextFull;
     /// Указатель на корневой элемент.
     JsonItem *rootItem;
+    /// Аллокатор дерева, NULL - текущий (jsonCurrentAllocator()).
+    const JsonAllocator *allocator;
     /// После ф-ций проверять на ошибку.
     JsonErrorEnum error;
+    /// Смещение ошибки от начала jsonTextFull в байтах.
+    size_t errorOffset;
+    /// Строка ошибки (с 1), 0 если ошибки не было.
+    size_t errorLine;
+    /// Столбец ошибки (с 1), 0 если ошибки не было.
+    size_t errorColumn;
 } JsonCStruct;
 
+/*!
+ * \brief Статистика разбора.
+ *
+ * Заполняется функциями *Stats(). Счетчики можно полностью убрать из сборки
+ * макросом JSONC_NO_STATS, иначе при stats == NULL их стоимость - одна
+ * проверка указателя. Время по фазам собирается только при сборке с
+ * JSONC_STATS_TIMING, иначе поля *Ns остаются нулевыми.
+ */
+typedef struct {
+    /// Длина входного текста в байтах.
+    size_t byteCount;
+    /// Количество элементов каждого типа.
+    size_t nodeCount[JsonTypeCount];
+    /// Максимальная глубина вложенности объектов и массивов.
+    size_t maxDepth;
+    /// Количество перевыделений childrenList (reserveChildCount()).
+    size_t reallocCount;
+    /// Суммарный объем выделенной памяти.
+    size_t bytesAllocated;
+    /// Пиковый объем памяти под дерево.
+    size_t peakMemory;
+    /// Время пропуска пробелов и комментариев.
+    uint64_t whitespaceNs;
+    /// Время разбора строк и ключей.
+    uint64_t stringNs;
+    /// Время разбора чисел.
+    uint64_t numberNs;
+    /// Время построения дерева (addChild()).
+    uint64_t buildNs;
+} JsonParseStats;
+
+/*!
+ * \brief Параметры разбора.
+ */
+typedef struct {
+    /// Аллокатор дерева, NULL - jsonCurrentAllocator().
+    const JsonAllocator *allocator;
+    /// Статистика разбора, может быть NULL.
+    JsonParseStats *stats;
+    /// Непустые массивы из одних чисел хранить как double[] без JsonItem на
+    /// каждый элемент. Такие массивы читают getArrayNumberAt(),
+    /// jsonArrayTo*(), вывод и сравнение; findChildIndex() и getChildAt()
+    /// для них возвращают NULL, чтение дерево не меняет. Добавление,
+    /// удаление потомков и применение патча сначала превращают массив в
+    /// обычный (unpackNumberArray()) аллокатором jsonCurrentAllocator(),
+    /// как и остальные изменения дерева. В openJsonFromStrRegion() и
+    /// openJsonFromStrParser() не действует.
+    bool packNumberArrays;
+    /// Интернировать ключи и короткие строки в эту таблицу, может быть NULL.
+    /// В openJsonFromFilesOpt() игнорируется.
+    JsonInternTable *internTable;
+    /// Максимальная вложенность объектов и массивов (JsonErrorDepth),
+    /// 0 - без ограничения.
+    size_t maxDepth;
+} JsonParseOptions;
+
 /*!
  * \brief Парсит JSON строку.
  *
@@ -74,14 +237,262 @@ typedef struct {
  */
 JsonCStruct openJsonFromStr(const char *jsonTextFull);
 
+/*!
+ * \brief Парсит JSON строку и заполняет статистику разбора.
+ * \param jsonTextFull - строка JSON файла.
+ * \param stats - выходная статистика, может быть NULL.
+ * \return структуру JsonCStruct.
+ */
+JsonCStruct openJsonFromStrStats(const char *jsonTextFull, JsonParseStats *stats);
+
+/*!
+ * \brief Парсит JSON строку с параметрами.
+ *
+ * Аллокатор сохраняется в JsonCStruct.allocator и используется в
+ * freeJsonCStruct(), поэтому должен жить вместе с деревом.
+ * \param jsonTextFull - строка JSON файла.
+ * \param options - параметры разбора, может быть NULL.
+ * \return структуру JsonCStruct.
+ */
+JsonCStruct openJsonFromStrOpt(const char *jsonTextFull, const JsonParseOptions *options);
+
+/*!
+ * \brief Парсит JSON строку в дерево прошлого документа той же формы.
+ *
+ * Для потоков однотипных сообщений: если у нового текста те же объекты и
+ * массивы, с тем же количеством потомков и теми же ключами в том же
+ * порядке, значения перезаписываются на месте, ключи только сравниваются,
+ * память не выделяется и списки потомков не строятся. Скаляры могут менять
+ * тип. Иначе (в том числе при ошибке в тексте или если дерево изменялось
+ * через API) дерево освобождается и текст разбирается заново
+ * openJsonFromStrOpt() тем же аллокатором, ошибка - в jStruct->error.
+ * Ключи шаблона сравниваются с новым текстом, поэтому текст прошлого
+ * документа должен быть жив во время вызова; с options->internTable ключи
+ * интернированы и буфер текста можно переиспользовать. Дальше, как и после
+ * обычного разбора, дерево ссылается на новый текст. Кеш хеша сбрасывается,
+ * packNumberArrays действует только при повторном разборе, упакованные
+ * массивы шаблона заполняются на месте.
+ * \param jStruct - результат прошлого разбора, заменяется.
+ * \param jsonTextFull - строка JSON файла.
+ * \param options - параметры разбора, может быть NULL.
+ * \return true, если дерево переиспользовано.
+ */
+bool reparseJsonFromStr(JsonCStruct *jStruct, const char *jsonTextFull);
+bool reparseJsonFromStrOpt(JsonCStruct *jStruct, const char *jsonTextFull,
+                           const JsonParseOptions *options);
+
 /*!
  * \brief Парсит JSON файл.
  *
  * Не забыть, для освобождения этой структуры вызвать freeJsonCStructFull().
+ * Сжатый файл определяется по сигнатуре. При сборке с JSONC_WITH_ZLIB
+ * (и -lz) gzip распаковывается блоками прямо в текст документа, без
+ * временного файла и без копии сжатых данных в памяти; текст остается в
+ * памяти, так как дерево ссылается на него. Без JSONC_WITH_ZLIB gzip, а
+ * также zstd - JsonErrorFile.
  * \param fileName - имя файла для чтения.
  * \return структуру JsonCStruct.
  */
 JsonCStruct openJsonFromFile(const char *fileName);
+JsonCStruct openJsonFromFileStats(const char *fileName, JsonParseStats *stats);
+JsonCStruct openJsonFromFileOpt(const char *fileName, const JsonParseOptions *options);
+
+/*!
+ * \brief Парсит несколько файлов параллельно.
+ *
+ * Потоки (вместе с вызывающим) берут следующий файл из общего счетчика,
+ * чтение и разбор разных файлов перекрываются. results[i] заполняется
+ * как openJsonFromFileOpt(paths[i]), ошибки - в results[i].error; каждый
+ * результат освобождать freeJsonCStructFull(). Аллокатор (options или
+ * jsonCurrentAllocator() вызывающего потока) используется из всех потоков
+ * и должен быть потокобезопасным, options->stats и options->internTable
+ * игнорируются. При сборке с JSONC_NO_THREADS (по умолчанию в MSVC, см.
+ * jsonc.pri) файлы разбираются последовательно.
+ * \param paths - имена файлов.
+ * \param count - количество файлов.
+ * \param results - выходной массив на count элементов.
+ * \param threads - количество потоков, 0 - по числу процессоров.
+ * \param options - параметры разбора, может быть NULL.
+ * \return количество успешно разобранных файлов.
+ */
+size_t openJsonFromFiles(const char * const *paths, size_t count,
+                         JsonCStruct *results, size_t threads);
+size_t openJsonFromFilesOpt(const char * const *paths, size_t count,
+                            JsonCStruct *results, size_t threads,
+                            const JsonParseOptions *options);
+
+/*!
+ * \brief Парсер, переиспользующий память между документами.
+ *
+ * Владеет ареной, из которой выделяются все элементы дерева. Каждый вызов
+ * openJsonFromStrParser() сбрасывает арену, поэтому дерево прошлого
+ * документа становится недействительным. После прогрева разбор не выделяет
+ * память в куче. Изменять такое дерево через addChild*() нельзя.
+ */
+typedef struct JsonParserTypeDef JsonParser;
+
+/*!
+ * \brief Создает парсер.
+ *
+ * Память арены берется у jsonCurrentAllocator().
+ * \param capacity - начальный размер арены в байтах, 0 - по умолчанию.
+ * \return парсер или NULL при нехватке памяти.
+ */
+JsonParser *createJsonParser(size_t capacity);
+
+/*!
+ * \brief Сбрасывает арену парсера за O(1).
+ *
+ * Если прошлый документ занял несколько блоков, они один раз заменяются
+ * одним блоком общего размера.
+ * \param parser - парсер.
+ */
+void resetJsonParser(JsonParser *parser);
+
+/*!
+ * \brief Освобождает парсер и всю его память.
+ * \param parser - парсер.
+ */
+void freeJsonParser(JsonParser *parser);
+
+/*!
+ * \brief Парсит JSON строку в арену парсера.
+ *
+ * freeJsonCStruct() для результата вызывать не обязательно.
+ * \param parser - парсер.
+ * \param jsonTextFull - строка JSON файла.
+ * \return структуру JsonCStruct.
+ */
+JsonCStruct openJsonFromStrParser(JsonParser *parser, const char *jsonTextFull);
+
+/*!
+ * \brief Парсит JSON строку в регион памяти вызывающего, без выделения памяти.
+ *
+ * Все элементы дерева, служебные данные и временные строки размещаются в
+ * region с проверкой границ, malloc и аллокаторы не вызываются, поэтому
+ * разбор можно вызывать из потоков реального времени. Время разбора
+ * линейно по длине текста. Если места не хватило - JsonErrorCapacity (с
+ * позицией), нужный размер сообщает jsonRegionSize(). Вложенность
+ * ограничена options->maxDepth, по умолчанию 1024 (глубина рекурсии).
+ * options->allocator, options->internTable и options->packNumberArrays
+ * игнорируются.
+ * Дерево живет, пока жив и не переиспользован регион; freeJsonCStruct()
+ * вызывать не обязательно. Изменять дерево нельзя.
+ * \param region - память, выравнивание любое (лучше на 16).
+ * \param size - размер region в байтах.
+ * \param jsonTextFull - строка JSON файла, должна жить вместе с деревом.
+ * \param options - параметры разбора, может быть NULL.
+ * \return структуру JsonCStruct.
+ */
+JsonCStruct openJsonFromStrRegion(void *region, size_t size, const char *jsonTextFull,
+                                  const JsonParseOptions *options);
+
+/*!
+ * \brief Точный размер региона для openJsonFromStrRegion().
+ *
+ * Разбирает текст обычным аллокатором (вызывать не из потока реального
+ * времени) и повторяет раскладку региона. Для региона, выровненного на 16,
+ * размер точный: с ним разбор успешен, с меньшим - JsonErrorCapacity.
+ * Иначе нужно добавить 15 байт.
+ * \param jsonTextFull - строка JSON файла.
+ * \param options - те же параметры, что для openJsonFromStrRegion().
+ * \return размер в байтах или SIZE_MAX, если текст с ошибкой.
+ */
+size_t jsonRegionSize(const char *jsonTextFull, const JsonParseOptions *options);
+
+/*!
+ * \brief Ошибка и ее позиция.
+ */
+typedef struct {
+    JsonErrorEnum error;
+    /// Смещение от начала текста в байтах.
+    size_t offset;
+    /// Строка (с 1), 0 если ошибки нет.
+    size_t line;
+    /// Столбец (с 1), 0 если ошибки нет.
+    size_t column;
+} JsonErrorInfo;
+
+/*!
+ * \brief Проверяет JSON без построения дерева.
+ *
+ * Грамматика та же, что у openJsonFromStr(), включая комментарии "//".
+ * Память не выделяется, вложенность ограничена 1024 уровнями
+ * (JsonErrorDepth). Текст заканчивается на len или на первом нулевом
+ * символе. Коды и позиции ошибок совпадают с openJsonFromStr().
+ * \param buf - текст.
+ * \param len - длина текста.
+ * \param errorInfo - первая ошибка, может быть NULL.
+ * \return true, если текст корректен.
+ */
+bool jsonValidate(const char *buf, size_t len, JsonErrorInfo *errorInfo);
+
+// Numeric arrays
+
+/*!
+ * \brief Копирует числовой массив в непрерывный буфер.
+ *
+ * Все элементы должны быть числами, помеченные удаленными пропускаются.
+ * Копируется не больше n элементов, но проверяется весь массив, поэтому
+ * размер можно узнать вызовом с n = 0. При ошибке out может быть частично
+ * заполнен. Упакованный массив (JsonParseOptions::packNumberArrays)
+ * копируется одним memcpy().
+ * \param item - массив.
+ * \param out - выходной буфер, может быть NULL при n = 0.
+ * \param n - размер out в элементах.
+ * \return количество элементов массива или SIZE_MAX, если item не массив
+ * или элемент не число.
+ */
+size_t jsonArrayToDoubles(const JsonItem *item, double *out, size_t n);
+size_t jsonArrayToFloats(const JsonItem *item, float *out, size_t n);
+
+/*!
+ * \brief Как jsonArrayToDoubles(), но числа должны быть целыми и
+ * помещаться в тип, иначе SIZE_MAX.
+ */
+size_t jsonArrayToInt32(const JsonItem *item, int32_t *out, size_t n);
+size_t jsonArrayToInt64(const JsonItem *item, int64_t *out, size_t n);
+
+/*!
+ * \brief Хранится ли массив упакованным (JsonParseOptions::packNumberArrays).
+ */
+bool isArrayPacked(const JsonItem *item);
+
+/*!
+ * \brief Читает число массива по индексу, не меняя дерево.
+ *
+ * Работает для упакованных и обычных массивов.
+ * \param item - массив.
+ * \param index - индекс.
+ * \param number - выходное число.
+ * \return false, если item не массив, индекс вне массива, потомок помечен
+ * удаленным или не число.
+ */
+bool getArrayNumberAt(const JsonItem *item, size_t index, double *number);
+
+/*!
+ * \brief Превращает упакованный массив чисел в обычных потомков.
+ *
+ * Память берется у jsonCurrentAllocator(), это должен быть аллокатор
+ * дерева. Для остальных элементов ничего не делает.
+ * \return false, если не хватило памяти (массив остается упакованным).
+ */
+bool unpackNumberArray(JsonItem *item);
+
+/*!
+ * \brief Разбирает числовой массив из текста сразу в буфер, без дерева.
+ *
+ * Текст - один массив чисел, грамматика как у openJsonFromStr(), включая
+ * комментарии "//". Текст заканчивается на len или на первом нулевом
+ * символе. Записывается не больше n чисел, но проверяется весь текст.
+ * \param buf - текст.
+ * \param len - длина текста.
+ * \param out - выходной буфер, может быть NULL при n = 0.
+ * \param n - размер out в элементах.
+ * \param errorInfo - ошибка, может быть NULL.
+ * \return количество чисел в массиве или SIZE_MAX при ошибке.
+ */
+size_t parseJsonDoubles(const char *buf, size_t len, double *out, size_t n, JsonErrorInfo *errorInfo);
 
 /*!
  * \brief Сохраняет в JSON формате.
@@ -90,7 +501,7 @@ JsonCStruct openJsonFromFile(const char *fileName);
  * \return отрицательное число при ошибке, иначе количество записанных
  * символов.
  */
-int32_t saveJsonCStruct(const char *fileName, JsonCStruct jStruct);
+int64_t saveJsonCStruct(const char *fileName, JsonCStruct jStruct);
 
 /*!
  * \brief Освобождает память parentItem и потомков.
@@ -100,6 +511,8 @@ void freeJsonCStruct(JsonCStruct jStruct);
 
 /*!
  * \brief Освобождает не только parentItem но и jsonTextFull.
+ *
+ * jsonTextFull освобождается аллокатором jStruct.allocator.
  * \param jStruct - структура, которую возвращает openJsonFile.
  */
 void freeJsonCStructFull(JsonCStruct jStruct);
@@ -138,7 +551,9 @@ JsonItem *findChildKeyLen(const JsonItem *root, const char *key, size_t keyLen);
 /*!
  * \brief Находит дочерний элемент по индексу.
  *
- * Важно, root должен иметь тип массив.
+ * Важно, root должен иметь тип массив. Дерево не меняется: у упакованного
+ * массива чисел (isArrayPacked()) нет JsonItem потомков, для него NULL,
+ * числа читает getArrayNumberAt().
  * \param root - элемент поиска.
  * \param index - индекс дочернего элемента.
  * \return NULL если root не массив или index > root.childrenCount, иначе
@@ -146,6 +561,18 @@ JsonItem *findChildKeyLen(const JsonItem *root, const char *key, size_t keyLen);
  */
 JsonItem *findChildIndex(JsonItem *root, size_t index);
 
+/*!
+ * \brief Находит дочерний элемент по индексу для массива и объекта.
+ *
+ * Работает в обычном и блочном режимах хранения потомков, дерево не
+ * меняется. Для упакованного массива чисел (isArrayPacked()) - NULL, см.
+ * getArrayNumberAt().
+ * \param root - элемент поиска.
+ * \param index - индекс дочернего элемента.
+ * \return NULL если index >= root.childrenCount, иначе дочерний элемент.
+ */
+JsonItem *getChildAt(const JsonItem *root, size_t index);
+
 /*!
  * \brief Находит индекс элемента child у родителя.
  * \param child - потомок.
@@ -163,15 +590,85 @@ size_t indexOfChild(JsonItem* pChild);
  */
 bool reserveChildCount(JsonItem *pCurrent, size_t childrenReserve);
 
+/*!
+ * \brief Переводит хранение потомков в блочный режим.
+ *
+ * Потомки хранятся блоками фиксированного размера, связанными через
+ * каталог. addChild*() и reserveChildCount() добавляют блоки без
+ * копирования, поэтому указатели на существующих потомков не меняются.
+ * Уже добавленные потомки один раз переносятся в блоки.
+ * \param pCurrent - элемент родитель. Должен иметь тип Object | Array.
+ * \return true при удаче, иначе false.
+ */
+bool setChildrenChunked(JsonItem *pCurrent);
+
+/*!
+ * \brief Проверяет, хранятся ли потомки блоками.
+ */
+bool isChildrenChunked(const JsonItem *item);
+
 /*!
  * \brief Удаляет потомка у родителя.
  *
- * Внимание, возможно смещение указателей у "братьев".
+ * Внимание, возможно смещение указателей у "братьев". Для удаления многих
+ * потомков быстрее removeChildrenIf() или removeChildrenIndexes().
  * \param pChild - указатель на потомка.
  * \return true при удаче, иначе false.
  */
 bool removeChild(JsonItem *pChild);
 
+/*!
+ * \brief Условие удаления для removeChildrenIf().
+ * \param child - потомок.
+ * \param index - индекс потомка.
+ * \param ctx - пользовательский контекст.
+ * \return true, если потомка нужно удалить.
+ */
+typedef bool (*JsonChildPredicate)(const JsonItem *child, size_t index, void *ctx);
+
+/*!
+ * \brief Удаляет всех потомков, для которых predicate вернул true.
+ *
+ * Уплотнение идет одним проходом, parent внуков исправляется один раз.
+ * Внимание, возможно смещение указателей у "братьев".
+ * \param parent - элемент родитель.
+ * \param predicate - условие удаления.
+ * \param ctx - передается в predicate.
+ * \return количество удаленных потомков.
+ */
+size_t removeChildrenIf(JsonItem *parent, JsonChildPredicate predicate, void *ctx);
+
+/*!
+ * \brief Удаляет потомков по набору индексов (в любом порядке).
+ *
+ * Индексы относятся к состоянию до удаления, неверные пропускаются.
+ * \param parent - элемент родитель.
+ * \param indexes - индексы потомков.
+ * \param count - количество индексов.
+ * \return количество удаленных потомков.
+ */
+size_t removeChildrenIndexes(JsonItem *parent, const size_t *indexes, size_t count);
+
+/*!
+ * \brief Помечает потомка удаленным без сдвига "братьев".
+ *
+ * Потомки pChild освобождаются сразу, сам элемент остается на месте до
+ * compactChildren(). Поиск, обход и запись помеченные элементы пропускают,
+ * но childrenCount их учитывает.
+ * \param pChild - указатель на потомка.
+ * \return true при удаче, иначе false.
+ */
+bool markChildRemoved(JsonItem *pChild);
+
+/*!
+ * \brief Убирает помеченных удаленными потомков за один проход.
+ *
+ * Внимание, возможно смещение указателей у "братьев".
+ * \param parent - элемент родитель.
+ * \return количество убранных потомков.
+ */
+size_t compactChildren(JsonItem *parent);
+
 /*!
  * \brief Добавляет вложенный элемент с инициализированным родителем.
  *
@@ -237,30 +734,121 @@ JsonItem *addChildKeyStrLen(JsonItem *pCurrent, const char *key, const char *str
 JsonItem *addChildKeyLenStr(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str);
 JsonItem *addChildKeyLenStrLen(JsonItem *pCurrent, const char *key, size_t keyLen, const char *str, size_t strLen);
 
+/*!
+ * \brief Задает значение элемента.
+ *
+ * Потомки элемента освобождаются, элемент помечается измененным.
+ * \param item - элемент.
+ */
+void setItemNull(JsonItem *item);
+void setItemBool(JsonItem *item, bool boolValue);
+void setItemNumber(JsonItem *item, double number);
+void setItemStr(JsonItem *item, const char *str);
+void setItemStrLen(JsonItem *item, const char *str, size_t strLen);
+
+/*!
+ * \brief Помечает элемент и его предков измененными.
+ *
+ * addChild*(), removeChild*() и setItem*() делают это сами, вызывать
+ * нужно после прямой записи в поля JsonItem. Заодно сбрасывает кеш
+ * jsonHash() у элемента и предков.
+ * \param item - измененный элемент.
+ */
+void markItemDirty(JsonItem *item);
+
+/*!
+ * \brief Проверяет, изменен ли элемент или его потомки.
+ */
+bool isItemDirty(const JsonItem *item);
+
+/*!
+ * \brief Снимает отметку изменения с элемента и потомков.
+ * \param root - элемент.
+ */
+void clearItemDirty(JsonItem *root);
+
+/*!
+ * \brief Приемник потокового вывода.
+ *
+ * Функции вывода копят текст в буфере фиксированного размера на стеке и
+ * отдают его write() кусками, поэтому память не зависит от размера
+ * документа.
+ */
+typedef struct {
+    /// Записывает len байт, false - ошибка (вывод прекращается).
+    bool (*write)(void *ctx, const char *data, size_t len);
+    void *ctx;
+} JsonSink;
+
+/*!
+ * \brief Приемник в открытый FILE.
+ */
+JsonSink jsonFileSink(FILE *file);
+
+/*!
+ * \brief Приемник в файловый дескриптор (write()).
+ */
+JsonSink jsonFdSink(int fd);
+
+/*!
+ * \brief Записывает Json в приемник.
+ * \param sink - приемник.
+ * \param item - ключ и значение JSON в том числе вложенные.
+ * \param pretty - с отступами как fprintJsonItem(), иначе компактно.
+ * \return -1 при ошибке, иначе количество записанных байт.
+ */
+int64_t writeJsonItem(JsonSink sink, const JsonItem *item, bool pretty);
+
+/*!
+ * \brief fprintJsonItemIncremental() в приемник.
+ */
+int64_t writeJsonItemIncremental(JsonSink sink, const JsonItem *item);
+
 /*!
  * \brief Записывает Json в файл.
+ *
+ * Числа записываются кратчайшей строкой, которая читается обратно без
+ * потерь, NaN и бесконечности - как null.
  * \param file - (стандартный си) открытый файл.
  * \param item - ключ и значение JSON в том числе вложенные.
- * \return количество записанных символов.
+ * \return отрицательное число при ошибке, иначе количество записанных
+ * символов.
  */
-int32_t fprintJsonItem(FILE *file, const JsonItem *item);
+int64_t fprintJsonItem(FILE *file, const JsonItem *item);
+
+/*!
+ * \brief Записывает Json, копируя неизмененные поддеревья из исходного текста.
+ *
+ * Разобранные и не измененные элементы (вместе с комментариями внутри)
+ * записываются как есть. В измененном разобранном контейнере текст между
+ * оставшимися потомками (запятые, пробелы, комментарии) тоже копируется,
+ * заново форматируются только новые потомки и измененные значения. Исходный
+ * текст должен быть жив.
+ * \param file - (стандартный си) открытый файл.
+ * \param item - ключ и значение JSON в том числе вложенные.
+ * \return отрицательное число при ошибке, иначе количество записанных
+ * символов.
+ */
+int64_t fprintJsonItemIncremental(FILE *file, const JsonItem *item);
 
 /*!
  * \brief Записывает Json в файл.
  * \param file - (стандартный си) открытый файл.
  * \param item - ключ и значение JSON в том числе вложенные.
  * \param offset - добавление 4 * offset пробелов вначале каждой строки.
- * \return количество записанных символов.
+ * \return отрицательное число при ошибке, иначе количество записанных
+ * символов.
  */
-int32_t fprintJsonItemOffset(FILE *file, const JsonItem *item, uint32_t offset);
+int64_t fprintJsonItemOffset(FILE *file, const JsonItem *item, uint32_t offset);
 
 /*!
  * \brief Проверяет на ошибку и если ошибок нет, записывает в file.
  * \param file - (стандартный си) открытый файл.
  * \param jStruct - структура после вызова openJsonFile().
- * \return количество записанных символов.
+ * \return отрицательное число при ошибке, иначе количество записанных
+ * символов.
  */
-int32_t fprintJsonStruct(FILE *file, JsonCStruct jStruct);
+int64_t fprintJsonStruct(FILE *file, JsonCStruct jStruct);
 
 /*!
  * \brief Сохраняет в JSON формате.
@@ -271,7 +859,18 @@ int32_t fprintJsonStruct(FILE *file, JsonCStruct jStruct);
  * \return отрицательное число при ошибке, иначе количество записанных
  * символов.
  */
-int32_t saveJsonItem(const char *fileName, const JsonItem* root);
+int64_t saveJsonItem(const char *fileName, const JsonItem* root);
+
+/*!
+ * \brief Сохраняет в JSON формате через fprintJsonItemIncremental().
+ *
+ * Текст до и после корневого элемента (комментарии) тоже сохраняется.
+ * \param fileName - имя файла.
+ * \param jStruct - структура JSON.
+ * \return отрицательное число при ошибке, иначе количество записанных
+ * символов.
+ */
+int64_t saveJsonCStructIncremental(const char *fileName, JsonCStruct jStruct);
 
 // KeyPath
 
@@ -317,6 +916,9 @@ void freeKeyItem(KeyItem *keyItem);
 
 /*!
  * \brief Поиск элемента по KeyItem.
+ *
+ * Элементы упакованного массива чисел не найти (NULL), их читает
+ * getItemNumber().
  * \param keyItem - инициализированный ключ.
  * \param root - элемент, с которого начинается поиск.
  * \return найденный элемент.
@@ -324,7 +926,7 @@ void freeKeyItem(KeyItem *keyItem);
 JsonItem *getItem(const KeyItem *keyItem, const JsonItem *root);
 
 /*!
- * \brief Поиск элемента по строке.
+ * \brief Поиск элемента по строке, как getItem().
  *
  * Пример keyPath: "\"pins\"[3]->\"position\"[1]->\"slot\"\0".
  * \param keyPath - строка поиска.
@@ -333,6 +935,470 @@ JsonItem *getItem(const KeyItem *keyItem, const JsonItem *root);
  */
 JsonItem *getItemStr(const char *keyPath, const JsonItem *root);
 
+/*!
+ * \brief Читает число по KeyItem.
+ *
+ * Индекс последнего шага в упакованном массиве читается через
+ * getArrayNumberAt(), дерево не меняется.
+ * \param keyItem - инициализированный ключ.
+ * \param root - элемент, с которого начинается поиск.
+ * \param number - выходное число.
+ * \return false, если элемент не найден или не число.
+ */
+bool getItemNumber(const KeyItem *keyItem, const JsonItem *root, double *number);
+
+/*!
+ * \brief getItemNumber() по строке пути.
+ */
+bool getItemNumberStr(const char *keyPath, const JsonItem *root, double *number);
+
+// Patch
+
+/*!
+ * \brief Применяет JSON Patch (RFC 6902) к дереву.
+ *
+ * Пути (JSON Pointer, RFC 6901) ищутся через findChildKeyLen() и
+ * findChildIndex(). Перед применением в каждом контейнере, куда патч
+ * добавляет элементы, память резервируется один раз. Значения не
+ * копируются глубже узлов: key и str ссылаются на текст патча, он должен
+ * жить вместе с деревом. Новый ключ объекта с "~0"/"~1" раскрывается в
+ * таблицу интернирования потока (jsonSetThreadInternTable()), а без нее -
+ * в собственную копию, которую освобождает и freeJsonItemFull().
+ *
+ * До первого изменения проверяются все операции: имя, обязательные поля,
+ * синтаксис путей и поиск путей (и сравнение "test"), которые не зависят от
+ * более ранних операций, - при такой ошибке дерево не меняется. Если
+ * "test" или поиск пути зависят от более ранних операций (или не хватило
+ * памяти), операции до ошибки уже применены.
+ * \param root - изменяемое дерево.
+ * \param patch - массив операций.
+ * \return JsonSuccess, JsonErrorPath (нет пути или не прошел "test") или
+ * JsonErrorValue (неверная операция).
+ */
+JsonErrorEnum applyJsonPatch(JsonItem *root, const JsonItem *patch);
+
+/*!
+ * \brief Применяет JSON Merge Patch (RFC 7386) к дереву.
+ *
+ * Как и в applyJsonPatch(), строки ссылаются на текст патча.
+ * \param root - изменяемое дерево.
+ * \param patch - патч.
+ * \return JsonSuccess или код ошибки.
+ */
+JsonErrorEnum applyJsonMergePatch(JsonItem *root, const JsonItem *patch);
+
+/*!
+ * \brief Строит JSON Patch, переводящий from в to.
+ *
+ * Объекты сравниваются по ключам, массивы - по индексам (лишние элементы
+ * удаляются с конца). Неизмененные поддеревья в патч не попадают.
+ * \param from - исходное дерево.
+ * \param to - целевое дерево.
+ * \param len - выходная длина текста, может быть NULL.
+ * \return текст патча (освободить freeJsonText()) или NULL при ошибке.
+ */
+char *createJsonPatch(const JsonItem *from, const JsonItem *to, size_t *len);
+
+/*!
+ * \brief Освобождает текст, возвращенный библиотекой.
+ * \param text - текст.
+ */
+void freeJsonText(char *text);
+
+// Freeze
+
+/*!
+ * \brief Сортирует потомков всех объектов дерева по ключу.
+ *
+ * Помеченные удаленными потомки убираются, потомки перемещаются (в том
+ * числе в блочном режиме), parent исправляется. После этого
+ * findChildKeyLen() ищет в объектах двоичным поиском. Удаление потомков
+ * порядок сохраняет, добавление снимает признак с объекта.
+ * Ключи сравниваются побайтно, при одинаковых ключах находится первый,
+ * как и до сортировки.
+ * \param root - корень.
+ * \return false, если не хватило памяти.
+ */
+bool jsonFreeze(JsonItem *root);
+
+/*!
+ * \brief Отсортированы ли потомки объекта (jsonFreeze()).
+ */
+bool isItemFrozen(const JsonItem *item);
+
+/*!
+ * \brief Записывает элемент в каноническом компактном виде.
+ *
+ * Ключи объектов идут в порядке jsonFreeze() (дерево не меняется), числа
+ * записываются кратчайшей точной строкой, без пробелов. Строки и ключи
+ * выводятся как в исходном тексте, экранирование не нормализуется.
+ * Результат подходит для хеширования и сравнения содержимого.
+ * \param item - элемент.
+ * \param len - выходная длина без нулевого символа, может быть NULL.
+ * \return строка (освободить freeJsonText()) или NULL при ошибке.
+ */
+char *createJsonCanonical(const JsonItem *item, size_t *len);
+
+// Writer
+
+/*!
+ * \brief Потоковая запись JSON без построения дерева.
+ *
+ * Вызовы begin/key/value/end проверяют структуру по мере записи (ключ только
+ * в объекте, значение в объекте только после ключа, парные скобки, одно
+ * корневое значение). Текст копится в буфере фиксированного размера и
+ * отдается приемнику кусками, форматирование совпадает с writeJsonItem().
+ * Память не зависит от размера документа, вложенность до 1024.
+ * При первой ошибке запись прекращается, все вызовы возвращают false,
+ * причина - jsonWriterError().
+ */
+typedef struct JsonWriterTypeDef JsonWriter;
+
+/*!
+ * \brief Создает писатель в приемник.
+ * \param sink - приемник.
+ * \param pretty - с отступами как fprintJsonItem(), иначе компактно.
+ * \return писатель (освободить freeJsonWriter()) или NULL, если не хватило
+ * памяти.
+ */
+JsonWriter *createJsonWriter(JsonSink sink, bool pretty);
+
+/*!
+ * \brief Создает писатель в растущий буфер в памяти.
+ *
+ * Текст забирается finishJsonWriterText().
+ */
+JsonWriter *createJsonWriterText(bool pretty);
+
+/*!
+ * \brief Освобождает писатель (без сброса буфера, см. finishJsonWriter()).
+ */
+void freeJsonWriter(JsonWriter *writer);
+
+/*!
+ * \brief Первая ошибка писателя.
+ * \return JsonSuccess; JsonErrorSyntax - нарушена структура; JsonErrorDepth -
+ * превышена вложенность; JsonErrorFile - ошибка приемника или памяти;
+ * JsonErrorValue - неверный аргумент.
+ */
+JsonErrorEnum jsonWriterError(const JsonWriter *writer);
+
+bool jsonWriteBeginObject(JsonWriter *writer);
+bool jsonWriteEndObject(JsonWriter *writer);
+bool jsonWriteBeginArray(JsonWriter *writer);
+bool jsonWriteEndArray(JsonWriter *writer);
+
+/*!
+ * \brief Записывает ключ в текущий объект.
+ *
+ * Ключ, как и строки, записывается как есть, без экранирования (как и
+ * ключи в дереве).
+ */
+bool jsonWriteKey(JsonWriter *writer, const char *key);
+bool jsonWriteKeyLen(JsonWriter *writer, const char *key, size_t keyLen);
+
+bool jsonWriteNull(JsonWriter *writer);
+bool jsonWriteBool(JsonWriter *writer, bool value);
+
+/*!
+ * \brief Записывает число как fprintJsonItem(): кратчайшей точной строкой,
+ * NaN и бесконечности - как null.
+ */
+bool jsonWriteNumber(JsonWriter *writer, double value);
+
+/*!
+ * \brief Записывает строку в кавычках как есть, без экранирования.
+ */
+bool jsonWriteStr(JsonWriter *writer, const char *str);
+bool jsonWriteStrLen(JsonWriter *writer, const char *str, size_t strLen);
+
+/*!
+ * \brief Записывает значение элемента дерева (без его ключа) как значение.
+ */
+bool jsonWriteItem(JsonWriter *writer, const JsonItem *item);
+
+/*!
+ * \brief Проверяет, что документ закончен, и сбрасывает буфер приемнику.
+ * \return -1 при ошибке, иначе количество записанных байт.
+ */
+int64_t finishJsonWriter(JsonWriter *writer);
+
+/*!
+ * \brief finishJsonWriter() для createJsonWriterText().
+ * \param len - выходная длина без нулевого символа, может быть NULL.
+ * \return текст (освободить freeJsonText()) или NULL при ошибке.
+ */
+char *finishJsonWriterText(JsonWriter *writer, size_t *len);
+
+// Hash
+
+/*!
+ * \brief 64-битный хеш значения элемента (ключ самого элемента не входит).
+ *
+ * Порядок ключей объектов не важен, порядок элементов массивов важен.
+ * Равные по jsonEqual() значения имеют равный хеш; строки хешируются как
+ * есть (без раскрытия экранирования), -0 и 0 равны. Хеши объектов и
+ * массивов кешируются в дереве и сбрасываются изменениями (markItemDirty()),
+ * поэтому повторный вызов после правки пересчитывает только измененный
+ * путь. Из-за кеша одно дерево нельзя хешировать из нескольких потоков
+ * одновременно. Значение зависит от порядка байт платформы.
+ * \param item - элемент.
+ * \return хеш, 0 для NULL.
+ */
+uint64_t jsonHash(JsonItem *item);
+
+/*!
+ * \brief Сравнивает значения элементов (ключи самих элементов не входят).
+ *
+ * Объекты равны при одинаковых наборах ключей независимо от порядка.
+ * Выходит на первом различии; если у обоих элементов есть кеш jsonHash(),
+ * разные хеши дают false без обхода.
+ * \return true, если значения равны (или оба NULL).
+ */
+bool jsonEqual(const JsonItem *a, const JsonItem *b);
+
+// Schema
+
+/*!
+ * \brief Тип поля структуры для parseJsonStruct()/jsonWriteStruct().
+ */
+typedef enum {
+    JsonFieldBool,      // bool.
+    JsonFieldInt32,     // int32_t, целое без дробной части и экспоненты.
+    JsonFieldInt64,     // int64_t, как Int32, читается без потери точности.
+    JsonFieldDouble,    // double.
+    JsonFieldStr,       // JsonStrRef, ссылается на исходный текст.
+    JsonFieldObject,    // вложенная структура, описанная JsonField::schema.
+    JsonFieldDoubles,   // double[capacity], количество - size_t по countOffset.
+
+    JsonFieldTypeCount
+} JsonFieldType;
+
+/*!
+ * \brief Строка в исходном тексте (без кавычек, экранирование не раскрыто).
+ *
+ * str == NULL - строки нет, jsonWriteStruct() пишет null.
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+} JsonStrRef;
+
+/*!
+ * \brief Скомпилированная схема структуры, см. createJsonSchema().
+ */
+typedef struct JsonSchemaTypeDef JsonSchema;
+
+/*!
+ * \brief Описание поля структуры.
+ *
+ * Пример: { "id", offsetof(Msg, id), JsonFieldInt32, NULL, 0, 0 }.
+ */
+typedef struct {
+    /// Ключ в JSON, должен жить вместе со схемой.
+    const char *key;
+    /// Смещение поля в структуре (offsetof()).
+    size_t offset;
+    JsonFieldType type;
+    /// Схема вложенной структуры для JsonFieldObject.
+    const JsonSchema *schema;
+    /// Размер массива для JsonFieldDoubles.
+    size_t capacity;
+    /// Смещение size_t с количеством элементов для JsonFieldDoubles.
+    size_t countOffset;
+} JsonField;
+
+/*!
+ * \brief Компилирует описание полей в схему.
+ *
+ * Описания копируются, для ключей строится идеальный хеш, поэтому поиск
+ * поля по ключу - одно вычисление хеша и одно сравнение. Вложенные схемы
+ * создаются раньше и освобождаются позже.
+ * \param fields - описания полей.
+ * \param count - количество полей.
+ * \return схема (освободить freeJsonSchema()) или NULL, если описание
+ * неверно (повторяющиеся ключи, нет вложенной схемы) или не хватило памяти.
+ */
+JsonSchema *createJsonSchema(const JsonField *fields, size_t count);
+
+/*!
+ * \brief Освобождает схему (вложенные схемы не освобождаются).
+ */
+void freeJsonSchema(JsonSchema *schema);
+
+/*!
+ * \brief Разбирает JSON объект сразу в структуру, без дерева.
+ *
+ * Грамматика как у openJsonFromStr(), включая комментарии "//". Ключи,
+ * которых нет в схеме, проверяются и пропускаются. Отсутствующие поля и
+ * поля со значением null не меняются, поэтому out заполняется значениями по
+ * умолчанию заранее. При повторе ключа побеждает последний. Значение
+ * неподходящего типа, число с точкой или экспонентой (даже 1.0) или не
+ * помещающееся число для целого поля и массив длиннее capacity -
+ * JsonErrorValue. При ошибке out может быть
+ * частично заполнен. Текст заканчивается на len или на первом нулевом
+ * символе и должен жить, пока используются поля JsonStrRef.
+ * \param buf - текст.
+ * \param len - длина текста.
+ * \param schema - схема структуры.
+ * \param out - структура.
+ * \param errorInfo - ошибка, может быть NULL.
+ * \return true при успехе.
+ */
+bool parseJsonStruct(const char *buf, size_t len, const JsonSchema *schema, void *out,
+                     JsonErrorInfo *errorInfo);
+
+/*!
+ * \brief Записывает структуру как JSON объект (поля в порядке схемы).
+ *
+ * Целые записываются точно, строки - как есть, без экранирования.
+ * \param writer - писатель, объект пишется как очередное значение.
+ * \param schema - схема структуры.
+ * \param in - структура.
+ * \return false при ошибке, см. jsonWriterError().
+ */
+bool jsonWriteStruct(JsonWriter *writer, const JsonSchema *schema, const void *in);
+
+// Shared
+
+/*!
+ * \brief Разделяемый документ, перечитываемый при изменении файла.
+ *
+ * Читатели работают с неизменяемыми снимками: каждый снимок - отдельный
+ * разобранный документ со счетчиком ссылок. Перезагрузка разбирает файл в
+ * новый снимок и атомарно подменяет текущий; старый освобождается, когда его
+ * отпустит последний читатель. Ошибка разбора оставляет прежний снимок.
+ */
+typedef struct JsonSharedTypeDef JsonShared;
+
+/*!
+ * \brief Неизменяемый снимок разделяемого документа.
+ *
+ * Дерево снимка только читается (в том числе несколькими потоками сразу).
+ * Упакованные массивы чисел при этом не распаковываются, их читает
+ * getArrayNumberAt().
+ */
+typedef struct JsonSnapshotTypeDef JsonSnapshot;
+
+/*!
+ * \brief Открывает файл как разделяемый документ.
+ *
+ * Из options используются allocator, packNumberArrays и maxDepth;
+ * internTable и stats игнорируются. Наблюдение (watch) запускает поток, который
+ * перечитывает файл после записи или замены переименованием (inotify на
+ * Linux, иначе опрос stat() раз в секунду); без потоков и на Windows файл
+ * перечитывается только jsonSharedReload().
+ * \param fileName - путь к файлу.
+ * \param options - параметры разбора, может быть NULL.
+ * \param watch - следить за файлом.
+ * \param error - ошибка первого разбора, может быть NULL.
+ * \return документ (освободить freeJsonShared()) или NULL.
+ */
+JsonShared *createJsonShared(const char *fileName, const JsonParseOptions *options,
+                             bool watch, JsonErrorEnum *error);
+
+/*!
+ * \brief Останавливает наблюдение и отпускает текущий снимок.
+ *
+ * Снимки, полученные читателями, остаются действительными до
+ * jsonSnapshotRelease().
+ */
+void freeJsonShared(JsonShared *shared);
+
+/*!
+ * \brief Перечитывает файл и публикует новый снимок.
+ * \return false, если разбор не удался (текущий снимок не меняется), см.
+ * jsonSharedLastError().
+ */
+bool jsonSharedReload(JsonShared *shared);
+
+/*!
+ * \brief Ошибка последней перезагрузки (JsonSuccess, если удалась).
+ */
+JsonErrorEnum jsonSharedLastError(JsonShared *shared);
+
+/*!
+ * \brief Захватывает текущий снимок.
+ * \return снимок (отпустить jsonSnapshotRelease()).
+ */
+JsonSnapshot *jsonSharedAcquire(JsonShared *shared);
+
+/*!
+ * \brief Обновляет удерживаемый читателем снимок.
+ *
+ * Если снимок не менялся - одна атомарная загрузка без записи в общую
+ * память, поэтому вызывать можно на каждый запрос. Иначе старый снимок
+ * отпускается и захватывается текущий.
+ * \param shared - документ.
+ * \param snapshot - удерживаемый снимок (может быть NULL), заменяется.
+ * \return true, если снимок заменен.
+ */
+bool jsonSharedRefresh(JsonShared *shared, JsonSnapshot **snapshot);
+
+/*!
+ * \brief Отпускает снимок.
+ */
+void jsonSnapshotRelease(JsonSnapshot *snapshot);
+
+/*!
+ * \brief Корень дерева снимка.
+ */
+const JsonItem *jsonSnapshotRoot(const JsonSnapshot *snapshot);
+
+/*!
+ * \brief Номер снимка, растет с каждой успешной перезагрузкой (первый - 1).
+ */
+uint64_t jsonSnapshotVersion(const JsonSnapshot *snapshot);
+
+// Memory
+
+/*!
+ * \brief Память, занятая деревом, см. jsonMemoryUsage().
+ *
+ * Учитываются элементы, списки потомков и каталоги блоков; ключи и строки
+ * (текст, таблица интернирования, копии) не учитываются.
+ */
+typedef struct {
+    /// Количество элементов, включая сам элемент.
+    size_t nodeCount;
+    /// Количество чисел в упакованных массивах.
+    size_t numberCount;
+    /// Количество потомков, помеченных удаленными.
+    size_t tombstoneCount;
+    /// Количество выделенных списков потомков (блок - отдельный список).
+    size_t listCount;
+    /// Байт под живые элементы и числа.
+    size_t usedBytes;
+    /// Байт выделено: емкость списков, каталоги блоков и сам элемент.
+    size_t reservedBytes;
+} JsonMemoryUsage;
+
+/*!
+ * \brief Считает память поддерева.
+ *
+ * reservedBytes - usedBytes - запас емкости (рост удвоением) и удаленные
+ * потомки, которые убирает jsonShrinkToFit().
+ * \param item - корень поддерева.
+ * \return статистика, нулевая для NULL.
+ */
+JsonMemoryUsage jsonMemoryUsage(const JsonItem *item);
+
+/*!
+ * \brief Убирает запас емкости и удаленных потомков во всем дереве.
+ *
+ * Каждый список потомков переносится в новый блок точного размера в
+ * порядке обхода в глубину (сначала родитель, затем потомки по порядку),
+ * поэтому с последовательным аллокатором списки поддерева лежат подряд.
+ * parent исправляется в том же проходе. Указатели на потомков становятся
+ * недействительными, root остается на месте. Блочные списки
+ * (setChildrenChunked()) не переносятся, но их потомки сжимаются. Память
+ * берется у jsonCurrentAllocator(), деревья JsonParser и регионов сжимать
+ * нельзя.
+ * \param root - корень.
+ * \return false, если не хватило памяти (дерево цело, но сжато частично).
+ */
+bool jsonShrinkToFit(JsonItem *root);
+
 #if defined(__cplusplus) || defined(__cplusplus__)
 }
 #endif
@@ -0,0 +1,460 @@
+#ifndef JSONC_HPP
+#define JSONC_HPP
+
+#include "jsonc.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/*!
+ * \brief C++17 обертка над jsonc.
+ *
+ * Только заголовок, все методы встраиваются в вызовы C API. Строки
+ * возвращаются как std::string_view без копирования и ссылаются на исходный
+ * текст (экранирование не раскрывается).
+ */
+namespace jsonc {
+
+namespace detail {
+
+/// Не constexpr: вызов при вычислении пути на этапе компиляции - ошибка
+/// компиляции. Текст аргумента виден в сообщении компилятора.
+inline void keyPathError(const char *) noexcept {}
+
+/*!
+ * \brief Шаг пути ключей.
+ */
+struct KeyPathStep {
+    std::string_view key;
+    std::size_t index = SIZE_MAX; /// SIZE_MAX - без индекса.
+};
+
+/*!
+ * \brief Разбирает путь ключей, грамматика как у parseKeyPath().
+ * \param path - путь, например "\"pins\"[3]->\"position\"[1]->\"slot\"".
+ * \param steps - выходные шаги, nullptr - только посчитать.
+ * \return количество шагов, 0 при ошибке.
+ */
+constexpr std::size_t parseKeyPath(std::string_view path, KeyPathStep *steps) {
+    std::size_t count = 0;
+    std::size_t pos = 0;
+    for (;;) {
+        if (pos >= path.size() || path[pos] != '"') {
+            keyPathError("key path: expected '\"'");
+            return 0;
+        }
+        std::size_t begin = ++pos;
+        while (pos < path.size() && path[pos] != '"') {
+            pos += path[pos] == '\\' ? 2 : 1;
+        }
+        if (pos >= path.size()) {
+            keyPathError("key path: unterminated key");
+            return 0;
+        }
+        KeyPathStep step;
+        step.key = path.substr(begin, pos - begin);
+        ++pos;
+        if (pos < path.size() && path[pos] == '[') {
+            std::size_t index = 0;
+            std::size_t digits = 0;
+            for (++pos; pos < path.size() && path[pos] >= '0' && path[pos] <= '9'; ++pos, ++digits) {
+                index = index * 10 + static_cast<std::size_t>(path[pos] - '0');
+            }
+            if (!digits || pos >= path.size() || path[pos] != ']') {
+                keyPathError("key path: expected index and ']'");
+                return 0;
+            }
+            ++pos;
+            step.index = index;
+        }
+        if (steps) {
+            steps[count] = step;
+        }
+        ++count;
+        if (pos == path.size()) {
+            return count;
+        }
+        if (path.substr(pos, 2) != "->") {
+            keyPathError("key path: expected \"->\"");
+            return 0;
+        }
+        pos += 2;
+    }
+}
+
+} // namespace detail
+
+/*!
+ * \brief Путь ключей, разобранный на этапе компиляции.
+ *
+ * Создается макросом JSONC_KEY_PATH(). Длины ключей посчитаны заранее, поиск
+ * разворачивается в цепочку findChildKeyLen()/findChildIndex() без выделения
+ * памяти, результат совпадает с getItemStr(), а findNumber() - с
+ * getItemNumberStr().
+ */
+template <std::size_t N>
+class KeyPath {
+    static_assert(N > 0, "malformed key path");
+
+public:
+    constexpr explicit KeyPath(std::string_view path) : m_steps() {
+        detail::parseKeyPath(path, m_steps);
+    }
+
+    JsonItem *find(const JsonItem *root) const noexcept {
+        return findFrom<0, N>(root);
+    }
+
+    /// Число по пути, индекс последнего шага читается и в упакованном
+    /// массиве.
+    bool findNumber(const JsonItem *root, double &number) const noexcept {
+        const JsonItem *parent = root;
+        if constexpr (N > 1) {
+            parent = findFrom<0, N - 1>(root);
+        }
+        const detail::KeyPathStep &step = m_steps[N - 1];
+        JsonItem *item = findChildKeyLen(parent, step.key.data(), step.key.size());
+        if (item && step.index != SIZE_MAX) {
+            if (isArrayPacked(item)) {
+                return getArrayNumberAt(item, step.index, &number);
+            }
+            item = findChildIndex(item, step.index);
+        }
+        if (!item || item->type != JsonTypeNumber) {
+            return false;
+        }
+        number = item->number;
+        return true;
+    }
+
+    constexpr std::size_t size() const noexcept { return N; }
+    constexpr const detail::KeyPathStep &operator[](std::size_t i) const { return m_steps[i]; }
+
+private:
+    /// Шаги [I, End).
+    template <std::size_t I, std::size_t End>
+    JsonItem *findFrom(const JsonItem *item) const noexcept {
+        const detail::KeyPathStep &step = m_steps[I];
+        JsonItem *child = findChildKeyLen(item, step.key.data(), step.key.size());
+        if (child && step.index != SIZE_MAX) {
+            child = findChildIndex(child, step.index);
+        }
+        if constexpr (I + 1 < End) {
+            return child ? findFrom<I + 1, End>(child) : nullptr;
+        } else {
+            return child;
+        }
+    }
+
+    detail::KeyPathStep m_steps[N];
+};
+
+/*!
+ * \brief Путь ключей из строкового литерала, разобранный при компиляции.
+ *
+ * Пример: doc[JSONC_KEY_PATH("\"pins\"[3]->\"position\"[1]->\"slot\"")].
+ * Неверный путь - ошибка компиляции.
+ */
+#define JSONC_KEY_PATH(path) \
+    ([]() { \
+        constexpr ::jsonc::KeyPath<::jsonc::detail::parseKeyPath(path, nullptr)> jsoncKeyPath(path); \
+        return jsoncKeyPath; \
+    }())
+
+/*!
+ * \brief Невладеющий указатель на JsonItem.
+ *
+ * Пустое значение (isValid() == false) возвращают операции поиска, если
+ * элемент не найден; операции над пустым значением тоже дают пустое
+ * значение.
+ */
+class Value {
+public:
+    class Iterator;
+
+    Value() noexcept = default;
+    explicit Value(JsonItem *item) noexcept : m_item(item) {}
+
+    bool isValid() const noexcept { return m_item != nullptr; }
+    explicit operator bool() const noexcept { return isValid(); }
+
+    JsonTypeEnum type() const noexcept {
+        return m_item ? m_item->type : JsonTypeCount;
+    }
+    bool isNull() const noexcept { return type() == JsonTypeNull; }
+    bool isBool() const noexcept { return type() == JsonTypeBool; }
+    bool isNumber() const noexcept { return type() == JsonTypeNumber; }
+    bool isString() const noexcept { return type() == JsonTypeString; }
+    bool isObject() const noexcept { return type() == JsonTypeObject; }
+    bool isArray() const noexcept { return type() == JsonTypeArray; }
+    /// Упакованный массив чисел, см. numberCount() и numberAt().
+    bool isPacked() const noexcept { return isArrayPacked(m_item); }
+
+    /// Ключ элемента, пустой у элементов массива и корня.
+    std::string_view key() const noexcept {
+        if (!m_item || !m_item->key) {
+            return std::string_view();
+        }
+        return std::string_view(m_item->key, m_item->keyLen);
+    }
+
+    /// Значение строки, пустое для других типов.
+    std::string_view str() const noexcept {
+        if (!isString()) {
+            return std::string_view();
+        }
+        return std::string_view(m_item->str, m_item->strLen);
+    }
+
+    double number(double defaultValue = 0) const noexcept {
+        return isNumber() || isBool() ? m_item->number : defaultValue;
+    }
+
+    bool boolean(bool defaultValue = false) const noexcept {
+        return isBool() || isNumber() ? m_item->number != 0 : defaultValue;
+    }
+
+    /// Количество потомков (с учетом помеченных удаленными), по ним идет
+    /// итерация. У упакованного массива потомков нет (0), его числа
+    /// считает numberCount().
+    std::size_t size() const noexcept {
+        return m_item && !isPacked() ? m_item->childrenCount : 0;
+    }
+
+    /// Граница индексов numberAt(): размер массива, в том числе
+    /// упакованного, 0 для других типов.
+    std::size_t numberCount() const noexcept {
+        return isArray() ? m_item->childrenCount : 0;
+    }
+
+    /// Поиск по ключу, findChildKeyLen().
+    Value operator[](std::string_view key) const noexcept {
+        return Value(findChildKeyLen(m_item, key.data(), key.size()));
+    }
+
+    Value operator[](const char *key) const noexcept {
+        return (*this)[std::string_view(key)];
+    }
+
+    /// Поиск по индексу в массиве, findChildIndex(). Элементы упакованного
+    /// массива не видны (пустое значение), их читает numberAt().
+    template <typename Index,
+              typename std::enable_if<std::is_integral<Index>::value, int>::type = 0>
+    Value operator[](Index index) const noexcept {
+        if constexpr (std::is_signed<Index>::value) {
+            if (index < 0) {
+                return Value();
+            }
+        }
+        if (!m_item) {
+            return Value();
+        }
+        return Value(findChildIndex(m_item, static_cast<std::size_t>(index)));
+    }
+
+    /// Поиск по пути ключей, JSONC_KEY_PATH().
+    template <std::size_t N>
+    Value operator[](const KeyPath<N> &path) const noexcept {
+        return Value(path.find(m_item));
+    }
+
+    /// Потомок по индексу для массива и объекта, getChildAt().
+    Value at(std::size_t index) const noexcept {
+        return Value(getChildAt(m_item, index));
+    }
+
+    /// Число массива по индексу, в том числе упакованного,
+    /// getArrayNumberAt().
+    double numberAt(std::size_t index, double defaultValue = 0) const noexcept {
+        double r = defaultValue;
+        return getArrayNumberAt(m_item, index, &r) ? r : defaultValue;
+    }
+
+    /// Число по пути ключей, в том числе в упакованном массиве,
+    /// KeyPath::findNumber().
+    template <std::size_t N>
+    double numberAt(const KeyPath<N> &path, double defaultValue = 0) const noexcept {
+        double r = defaultValue;
+        return m_item && path.findNumber(m_item, r) ? r : defaultValue;
+    }
+
+    Iterator begin() const noexcept;
+    Iterator end() const noexcept;
+
+    JsonItem *get() const noexcept { return m_item; }
+
+    friend bool operator==(Value l, Value r) noexcept { return l.m_item == r.m_item; }
+    friend bool operator!=(Value l, Value r) noexcept { return l.m_item != r.m_item; }
+
+private:
+    JsonItem *m_item = nullptr;
+};
+
+/*!
+ * \brief Итератор по потомкам (range-for).
+ *
+ * Помеченные удаленными потомки пропускаются. Упакованный массив чисел
+ * обходится как пустой (как и его size()), дерево не меняется; его числа
+ * читают numberCount() и numberAt().
+ */
+class Value::Iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = Value;
+
+    Iterator() noexcept = default;
+    Iterator(JsonItem *parent, std::size_t index) noexcept
+        : m_parent(parent), m_index(index) {
+        skipRemoved();
+    }
+
+    Value operator*() const noexcept {
+        return Value(getChildAt(m_parent, m_index));
+    }
+
+    Iterator &operator++() noexcept {
+        ++m_index;
+        skipRemoved();
+        return *this;
+    }
+
+    Iterator operator++(int) noexcept {
+        Iterator r = *this;
+        ++*this;
+        return r;
+    }
+
+    friend bool operator==(const Iterator &l, const Iterator &r) noexcept {
+        return l.m_index == r.m_index && l.m_parent == r.m_parent;
+    }
+    friend bool operator!=(const Iterator &l, const Iterator &r) noexcept {
+        return !(l == r);
+    }
+
+private:
+    void skipRemoved() noexcept {
+        while (m_parent && m_index < m_parent->childrenCount
+               && !getChildAt(m_parent, m_index)) {
+            ++m_index;
+        }
+    }
+
+    JsonItem *m_parent = nullptr;
+    std::size_t m_index = 0;
+};
+
+inline Value::Iterator Value::begin() const noexcept {
+    return isPacked() ? end() : Iterator(m_item, 0);
+}
+
+inline Value::Iterator Value::end() const noexcept {
+    return Iterator(m_item, size());
+}
+
+/*!
+ * \brief Владеющая обертка над JsonCStruct (только перемещение).
+ *
+ * Дерево освобождается в деструкторе, в том числе при исключении. Текст,
+ * прочитанный fromFile(), освобождается вместе с деревом; текст,
+ * переданный в parse(), должен жить дольше документа.
+ */
+class Document {
+public:
+    Document() noexcept = default;
+
+    /// Принимает владение jStruct.
+    explicit Document(JsonCStruct jStruct, bool ownsText = false) noexcept
+        : m_struct(jStruct), m_ownsText(ownsText) {}
+
+    static Document parse(const char *jsonTextFull) noexcept {
+        return Document(openJsonFromStr(jsonTextFull));
+    }
+
+    static Document parse(const char *jsonTextFull, const JsonParseOptions &options) noexcept {
+        return Document(openJsonFromStrOpt(jsonTextFull, &options));
+    }
+
+    static Document fromFile(const char *fileName) noexcept {
+        return Document(openJsonFromFile(fileName), true);
+    }
+
+    ~Document() { reset(); }
+
+    Document(const Document &) = delete;
+    Document &operator=(const Document &) = delete;
+
+    Document(Document &&other) noexcept
+        : m_struct(other.release()), m_ownsText(other.m_ownsText) {}
+
+    Document &operator=(Document &&other) noexcept {
+        if (this != &other) {
+            reset();
+            m_ownsText = other.m_ownsText;
+            m_struct = other.release();
+        }
+        return *this;
+    }
+
+    /// Освобождает дерево (и текст, если им владеет).
+    void reset() noexcept {
+        if (m_ownsText) {
+            freeJsonCStructFull(m_struct);
+        } else {
+            freeJsonCStruct(m_struct);
+        }
+        m_struct = emptyStruct();
+    }
+
+    /// Отдает владение вызывающему, документ становится пустым.
+    JsonCStruct release() noexcept {
+        JsonCStruct r = m_struct;
+        m_struct = emptyStruct();
+        return r;
+    }
+
+    JsonErrorEnum error() const noexcept { return m_struct.error; }
+    explicit operator bool() const noexcept { return error() == JsonSuccess; }
+
+    Value root() const noexcept { return Value(m_struct.rootItem); }
+
+    Value operator[](std::string_view key) const noexcept { return root()[key]; }
+    Value operator[](const char *key) const noexcept { return root()[key]; }
+
+    template <typename Index,
+              typename std::enable_if<std::is_integral<Index>::value, int>::type = 0>
+    Value operator[](Index index) const noexcept { return root()[index]; }
+
+    template <std::size_t N>
+    Value operator[](const KeyPath<N> &path) const noexcept { return root()[path]; }
+
+    template <std::size_t N>
+    double numberAt(const KeyPath<N> &path, double defaultValue = 0) const noexcept {
+        return root().numberAt(path, defaultValue);
+    }
+
+    Value::Iterator begin() const noexcept { return root().begin(); }
+    Value::Iterator end() const noexcept { return root().end(); }
+
+    const JsonCStruct &cStruct() const noexcept { return m_struct; }
+
+private:
+    static JsonCStruct emptyStruct() noexcept {
+        JsonCStruct r = JsonCStruct();
+        r.error = JsonJustInit;
+        return r;
+    }
+
+    JsonCStruct m_struct = emptyStruct();
+    bool m_ownsText = false;
+};
+
+} // namespace jsonc
+
+#endif  /* ndef JSONC_HPP */
@@ -5,4 +5,12 @@ SOURCES += \
     $$PWD/jsonc.c
 
 HEADERS += \
-    $$PWD/jsonc.h
+    $$PWD/jsonc.h \
+    $$PWD/jsonc.hpp
+
+# Потокам (openJsonFromFiles(), JsonShared) нужны pthread.h и
+# stdatomic.h. В MSVC их нет, там по умолчанию JSONC_NO_THREADS; с
+# pthreads-win32 и /experimental:c11atomics потоки включает
+# DEFINES += JSONC_WITH_THREADS. Без потоков везде - DEFINES += JSONC_NO_THREADS.
+unix: LIBS += -lpthread
+contains(DEFINES, JSONC_WITH_ZLIB): LIBS += -lz